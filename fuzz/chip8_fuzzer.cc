@@ -0,0 +1,159 @@
+// libFuzzer entry point around Chip8. One machine is constructed for the
+// whole process and reset in place between inputs, so an execution costs
+// the restore of the memory pages the previous input dirtied, not a full
+// construction.
+//
+// Input layout:
+//   [rom size lo][rom size hi][seed][mode][rom bytes ...][input script ...]
+// the input script is a list of 3 byte events
+//   [delay / 16 cycles][keypad mask lo][keypad mask hi]
+// An odd mode byte also runs a second machine through Run(), one call per
+// event, which is where the superinstructions and their retagging execute;
+// its state must match the Cycle() machine's at every event or the input
+// aborts.
+//
+// Executed pcs and decoded opcodes are reported to libFuzzer as extra
+// counters (custom coverage feedback), so inputs that reach new code in
+// the ROM are kept even when they do not reach new emulator code.
+//
+// Build with `make fuzz` (clang, -fsanitize=fuzzer). With -D
+// EMU_FUZZ_STANDALONE it builds a plain reproducer that runs the files
+// given on the command line.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "chip8.h"
+
+namespace {
+
+constexpr uint32_t kMaxCycles = 20000;
+constexpr uint32_t kCyclesPerDelay = 16;
+
+constexpr size_t kPcCounters = 4096 / 2;
+constexpr size_t kNibbleCounters = 16 * 16; // high nibble x low nibble
+constexpr size_t kFCounters = 256; // Fx opcodes by their low byte
+
+// libFuzzer picks up this section as additional coverage
+__attribute__((section("__libfuzzer_extra_counters")))
+uint8_t extra_counters[kPcCounters + kNibbleCounters + kFCounters];
+
+inline void Cover(uint16_t pc, uint16_t opcode) noexcept {
+  ++extra_counters[(pc & 0x0FFFu) >> 1u];
+  if ((opcode & 0xF000u) == 0xF000u) {
+    ++extra_counters[kPcCounters + kNibbleCounters + (opcode & 0x00FFu)];
+  } else {
+    ++extra_counters[kPcCounters + ((opcode >> 12u) << 4u) + (opcode & 0x000Fu)];
+  }
+}
+
+bool Same(const emu::Chip8::Snapshot& a, const emu::Chip8::Snapshot& b) noexcept {
+  return a.registers == b.registers && a.memory == b.memory && a.index == b.index
+      && a.pc == b.pc && a.stack == b.stack && a.sp == b.sp
+      && a.delay_timer == b.delay_timer && a.sound_timer == b.sound_timer
+      && a.tick_phase == b.tick_phase && a.keypad == b.keypad && a.video == b.video
+      && std::memcmp(&a.rng, &b.rng, sizeof(a.rng)) == 0;
+}
+
+} // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  static emu::Chip8 chip8{};
+  static emu::Chip8 block{};
+
+  if (size < 4) {
+    return 0;
+  }
+  size_t rom_size = data[0] | (data[1] << 8u);
+  uint8_t seed = data[2];
+  const bool blocks = (data[3] & 0x1u) != 0;
+  data += 4;
+  size -= 4;
+  rom_size = std::min({rom_size, size, emu::Chip8::kMaxRomSize});
+
+  chip8.Reset(seed);
+  chip8.LoadRom(data, rom_size);
+  if (blocks) {
+    block.Reset(seed);
+    block.LoadRom(data, rom_size);
+  }
+  data += rom_size;
+  size -= rom_size;
+  // the counters live across resets, and the machines have run different
+  // inputs before
+  const uint64_t chip8_start = chip8.get_counters().instructions;
+  const uint64_t block_start = block.get_counters().instructions;
+
+  uint32_t cycle = 0;
+  while (cycle < kMaxCycles) {
+    uint32_t next_event = kMaxCycles;
+    if (size >= 3) {
+      uint16_t mask = data[1] | (data[2] << 8u);
+      for (uint8_t key = 0; key < 16; ++key) {
+        chip8.get_keypad()[key] = (mask >> key) & 0x1u;
+        block.get_keypad()[key] = (mask >> key) & 0x1u;
+      }
+      next_event = std::min(cycle + 1 + data[0] * kCyclesPerDelay, kMaxCycles);
+      data += 3;
+      size -= 3;
+    }
+
+    for (uint32_t i = cycle; i < next_event; ++i) {
+      const auto& memory = chip8.get_memory();
+      uint16_t pc = chip8.get_pc();
+      Cover(pc, (memory[pc & 0x0FFFu] << 8u) | memory[(pc + 1) & 0x0FFFu]);
+      chip8.Cycle();
+    }
+
+    if (blocks) {
+      block.Run(next_event - cycle);
+      emu::Chip8::Snapshot expected;
+      emu::Chip8::Snapshot actual;
+      chip8.Save(expected);
+      block.Save(actual);
+      if (!Same(expected, actual)
+          || chip8.get_counters().instructions - chip8_start
+              != block.get_counters().instructions - block_start) {
+        emu::log::Error("Run() diverged from Cycle() by cycle " + std::to_string(next_event));
+        std::abort();
+      }
+    }
+    cycle = next_event;
+  }
+  return 0;
+}
+
+#ifdef EMU_FUZZ_STANDALONE
+
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+int main(int argc, char* argv[]) {
+  for (int i = 1; i < argc; ++i) {
+    std::ifstream fs{argv[i], std::ios::binary};
+    if (!fs.is_open()) {
+      emu::log::Error("can't open input: " + std::string(argv[i]));
+      return 1;
+    }
+    std::vector<uint8_t> input{std::istreambuf_iterator<char>(fs), {}};
+    LLVMFuzzerTestOneInput(input.data(), input.size());
+    emu::log::Success(argv[i]);
+  }
+
+  size_t pcs = 0;
+  size_t opcodes = 0;
+  for (size_t i = 0; i < sizeof(extra_counters); ++i) {
+    if (extra_counters[i] != 0) {
+      (i < kPcCounters ? pcs : opcodes) += 1;
+    }
+  }
+  emu::log::Info("coverage: " + std::to_string(pcs) + " pcs, "
+      + std::to_string(opcodes) + " opcodes");
+  return 0;
+}
+
+#endif // EMU_FUZZ_STANDALONE
@@ -0,0 +1,62 @@
+#ifndef EMU_CHIP8_ENV_H_
+#define EMU_CHIP8_ENV_H_
+
+/** C ABI for the batched RL environment (src/env.h), for bindings */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct chip8_env chip8_env;
+
+enum chip8_env_reward_kind {
+  CHIP8_ENV_REWARD_BYTE = 0, /* memory[addr] */
+  CHIP8_ENV_REWARD_BCD = 1,  /* 3 decimal digits at addr, as written by Fx33 */
+};
+
+typedef struct chip8_env_reward {
+  uint16_t addr;
+  int kind;
+  float scale;
+} chip8_env_reward;
+
+typedef struct chip8_env_config {
+  int frame_skip;       /* frames per step, >= 1 */
+  int cycles_per_frame; /* instructions per frame, >= 1 */
+  float sticky;         /* probability of repeating the last action, 0..1 */
+  uint32_t max_frames;  /* episode length, 0 for never */
+  const chip8_env_reward* rewards; /* kinds from chip8_env_reward_kind */
+  size_t reward_count;
+} chip8_env_config;
+
+/* NULL on error (bad ROM or config), config may be NULL for defaults; a
+ * zeroed config is not the defaults, frame_skip and cycles_per_frame must
+ * be set */
+chip8_env* chip8_env_create(
+    const uint8_t* rom, size_t rom_size,
+    size_t instances,
+    const chip8_env_config* config);
+void chip8_env_destroy(chip8_env* env);
+
+void chip8_env_reset(chip8_env* env, uint64_t seed);
+void chip8_env_reset_one(chip8_env* env, size_t instance, uint64_t seed);
+/* actions[i] is the keypad bitmask for instance i */
+void chip8_env_step(chip8_env* env, const uint16_t* actions);
+
+/* publish the framebuffers to POSIX shared memory after every step, read
+ * them with tools/shmview or ShmReader (src/shm.h); 0 on success */
+int chip8_env_publish(chip8_env* env, const char* name);
+
+/* instance i: 32 rows of uint64_t at base + i * stride, bit 63 leftmost */
+const uint8_t* chip8_env_observation(const chip8_env* env, size_t* stride);
+const float* chip8_env_rewards(const chip8_env* env);
+const uint8_t* chip8_env_dones(const chip8_env* env);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // EMU_CHIP8_ENV_H_
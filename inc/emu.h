@@ -1,6 +1,22 @@
 #ifndef EMU_EMU_H_
 #define EMU_EMU_H_
 
+#include <string>
+
+#include "SDL2/SDL.h"
+
 #include "log.h"
 
+namespace emu {
+
+namespace log {
+  // SDL_GetError() is per thread, so it is read here and not by the logger;
+  // kept out of log.h so the headless tools don't need SDL
+  inline void SdlError(const std::string& msg) {
+    Error(msg + "\nSDL_Error: " + SDL_GetError());
+  }
+} // namespace log
+
+} // namespace emu
+
 #endif // EMU_EMU_H_
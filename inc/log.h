@@ -3,11 +3,26 @@
 
 /** INCLUDES ----------------------------------- */
 
-#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
 #include <string>
-#include <sstream>
+#include <string_view>
+#include <thread>
 
-#include "SDL2/SDL.h"
+/** LEVEL -------------------------------------- */
+
+// messages below this level are compiled out:
+// 0 debug, 1 info, 2 success, 3 warning, 4 failure, 5 error
+#ifndef EMU_LOG_LEVEL
+#define EMU_LOG_LEVEL 0
+#endif
 
 /** COLORS ------------------------------------- */
 
@@ -132,42 +147,412 @@
 #define CBACK_YELLOW_YELLOW "\033[33;43m"
 #define CBACK_YELLOW_WHITE  "\033[37;43m"
 
+/** LOGGER ------------------------------------- */
+
+namespace emu {
+
+namespace log {
+
+enum class Level : uint8_t {
+  kDebug = 0,
+  kInfo = 1,
+  kSuccess = 2,
+  kWarning = 3,
+  kFailure = 4,
+  kError = 5,
+};
+
+// Asynchronous logger. Call sites format into a fixed size record and push
+// it into a bounded lock-free multi producer queue, a background thread
+// drains it to the console and to an optional JSON lines file. Pushing
+// never blocks and never allocates: on a full queue the record is dropped
+// and counted, longer messages are truncated. An idle drainer sleeps on a
+// condition variable; a push only takes the lock when it has to wake it.
+class Logger {
+  public:
+    static constexpr size_t kRecordSize = 256;
+    static constexpr size_t kQueueSize = 1024; // power of two
+
+    struct Record {
+      int64_t time_us; // system clock, microseconds since the epoch
+      uint16_t size;
+      Level level;
+      char text[kRecordSize - 11];
+    };
+
+    static Logger& Get() {
+      static Logger logger;
+      return logger;
+    }
+
+    ~Logger() {
+      stop_.store(true, std::memory_order_release);
+      Wake();
+      if (drainer_.joinable()) {
+        drainer_.join();
+      }
+      if (json_ != nullptr) {
+        std::fclose(json_);
+      }
+    }
+
+    Logger(const Logger& rhs) = delete;
+    Logger(const Logger&& rhs) = delete;
+    Logger& operator=(const Logger& rhs) = delete;
+    Logger& operator=(const Logger&& rhs) = delete;
+
+    void Push(Level level, const char* text, size_t size) noexcept {
+      size_t pos = head_.load(std::memory_order_relaxed);
+      Cell* cell = nullptr;
+      for (;;) {
+        cell = &cells_[pos & (kQueueSize - 1u)];
+        size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+        if (diff == 0) {
+          if (head_.compare_exchange_weak(pos, pos + 1u, std::memory_order_relaxed)) {
+            break;
+          }
+        } else if (diff < 0) {
+          dropped_.fetch_add(1u, std::memory_order_relaxed);
+          return;
+        } else {
+          pos = head_.load(std::memory_order_relaxed);
+        }
+      }
+
+      Record& record = cell->record;
+      record.time_us = std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::system_clock::now().time_since_epoch()).count();
+      record.level = level;
+      record.size = static_cast<uint16_t>(std::min(size, sizeof(record.text)));
+      std::memcpy(record.text, text, record.size);
+      if (size > sizeof(record.text)) {
+        std::memcpy(record.text + sizeof(record.text) - 3, "...", 3);
+      }
+      cell->sequence.store(pos + 1u, std::memory_order_release);
+      Wake();
+    }
+
+    // wait until everything pushed so far is written, for output that
+    // has to interleave with direct stdout writes
+    void Flush() noexcept {
+      flush_.store(true, std::memory_order_relaxed);
+      Wake();
+      const size_t target = head_.load(std::memory_order_acquire);
+      while (written_.load(std::memory_order_acquire) < target) {
+        std::this_thread::yield();
+      }
+      flush_.store(false, std::memory_order_relaxed);
+    }
+
+    // also write every record as a JSON object per line, "" to stop
+    bool OpenJson(const std::string& file) {
+      std::FILE* json = file.empty() ? nullptr : std::fopen(file.c_str(), "a");
+      if (!file.empty() && json == nullptr) {
+        return false;
+      }
+      std::lock_guard<std::mutex> lock{open_mutex_};
+      Flush();
+      // the drainer is the only one writing to the files, so it closes the
+      // old one itself; wait until it has
+      next_json_ = json;
+      swap_.store(true, std::memory_order_release);
+      Wake();
+      while (swap_.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+      return true;
+    }
+
+    void set_console(bool console) noexcept {
+      console_.store(console, std::memory_order_relaxed);
+    }
+    [[nodiscard]] uint64_t get_dropped() const noexcept {
+      return dropped_.load(std::memory_order_relaxed);
+    }
+  private:
+    struct Cell {
+      std::atomic<size_t> sequence;
+      Record record;
+    };
+
+    Logger() : cells_(new Cell[kQueueSize]) {
+      for (size_t i = 0; i < kQueueSize; ++i) {
+        cells_[i].sequence.store(i, std::memory_order_relaxed);
+      }
+      drainer_ = std::thread{&Logger::Drain, this};
+    }
+
+    void Drain() noexcept {
+      uint64_t reported = 0;
+      auto last_report = std::chrono::steady_clock::now();
+      for (;;) {
+        if (swap_.load(std::memory_order_acquire)) {
+          SwapJson();
+        }
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        Cell& cell = cells_[pos & (kQueueSize - 1u)];
+        if (cell.sequence.load(std::memory_order_acquire) != pos + 1u) {
+          // idle: write out what was batched, report drops once a second
+          Sync(pos);
+          auto now = std::chrono::steady_clock::now();
+          uint64_t dropped = get_dropped();
+          if (dropped != reported && now - last_report >= std::chrono::seconds(1)) {
+            std::fprintf(stderr, "[" C_YELLOW "!" C_OFF "] %llu log records dropped\n",
+                static_cast<unsigned long long>(dropped - reported));
+            reported = dropped;
+            last_report = now;
+          }
+          // the queue is drained before the thread stops
+          if (stop_.load(std::memory_order_acquire)) {
+            if (dropped != reported) {
+              std::fprintf(stderr, "[" C_YELLOW "!" C_OFF "] %llu log records dropped\n",
+                  static_cast<unsigned long long>(dropped - reported));
+            }
+            return;
+          }
+          // sleep until a push, a file swap or the stop, or until pending
+          // drops are due to be reported
+          Park(pos, dropped != reported, last_report + std::chrono::seconds(1));
+          continue;
+        }
+        Write(cell.record);
+        cell.sequence.store(pos + kQueueSize, std::memory_order_release);
+        tail_.store(pos + 1u, std::memory_order_release);
+        // output is batched, a waiting Flush() needs it now
+        if (flush_.load(std::memory_order_relaxed)) {
+          Sync(pos + 1u);
+        }
+      }
+    }
+
+    // write out the batches, everything before pos is then on its way out
+    void Sync(size_t pos) noexcept {
+      Emit(nullptr);
+      if (json_ != nullptr) {
+        std::fflush(json_);
+      }
+      written_.store(pos, std::memory_order_release);
+    }
+
+    void SwapJson() noexcept {
+      if (json_ != nullptr) {
+        std::fclose(json_);
+      }
+      json_ = next_json_;
+      swap_.store(false, std::memory_order_release);
+    }
+
+    // sleeping_ is only touched with read-modify-writes, so of this one and
+    // the one in Wake() the later reads the earlier: either the waker sees
+    // the drainer asleep and takes the lock, or the drainer sees what the
+    // waker published before it
+    void Park(size_t pos, bool timed, std::chrono::steady_clock::time_point until) noexcept {
+      std::unique_lock<std::mutex> lock{mutex_};
+      sleeping_.exchange(1u, std::memory_order_acq_rel);
+      auto ready = [&] {
+        return cells_[pos & (kQueueSize - 1u)].sequence.load(std::memory_order_acquire) == pos + 1u
+            || swap_.load(std::memory_order_acquire)
+            || stop_.load(std::memory_order_acquire);
+      };
+      if (timed) {
+        wake_.wait_until(lock, until, ready);
+      } else {
+        wake_.wait(lock, ready);
+      }
+      sleeping_.exchange(0u, std::memory_order_acq_rel);
+    }
+
+    void Wake() noexcept {
+      if (sleeping_.fetch_add(0u, std::memory_order_acq_rel) != 0u) {
+        // the drainer holds the lock until it waits, so this can't notify
+        // between its last check and the wait
+        { std::lock_guard<std::mutex> lock{mutex_}; }
+        wake_.notify_one();
+      }
+    }
+
+    // append to the console batch, a change of stream writes the batch out
+    // first so stdout and stderr lines keep their order; nullptr to flush
+    void Emit(std::FILE* stream, const char* text = nullptr, size_t size = 0) noexcept {
+      if (stream != batch_stream_ || batch_size_ + size > sizeof(batch_)) {
+        if (batch_size_ != 0) {
+          std::fwrite(batch_, 1, batch_size_, batch_stream_);
+          std::fflush(batch_stream_);
+        }
+        batch_size_ = 0;
+        batch_stream_ = stream;
+      }
+      if (stream != nullptr) {
+        std::memcpy(batch_ + batch_size_, text, size);
+        batch_size_ += size;
+      }
+    }
+
+    void Write(const Record& record) noexcept {
+      if (console_.load(std::memory_order_relaxed)) {
+        static const char* const kPrefixes[] = {
+          CBACK_YELLOW_BLACK,
+          "[" C_BLUE "*" C_OFF "] ",
+          "[" C_GREEN "+" C_OFF "] ",
+          "[" C_YELLOW "!" C_OFF "] ",
+          "[" C_RED "-" C_OFF "] ",
+          "[" CBACK_RED_WHITE "ERROR" C_OFF "] ",
+        };
+        const uint8_t level = static_cast<uint8_t>(record.level);
+        // debug and error go to stderr like the old clog/cerr
+        std::FILE* stream = (record.level == Level::kDebug || record.level == Level::kError)
+            ? stderr : stdout;
+        char line[sizeof(record.text) + 32];
+        int size = std::snprintf(line, sizeof(line), "%s%.*s%s\n",
+            kPrefixes[level], static_cast<int>(record.size), record.text,
+            record.level == Level::kDebug ? C_OFF : "");
+        Emit(stream, line, std::min(static_cast<size_t>(size), sizeof(line) - 1u));
+      }
+      if (json_ != nullptr) {
+        static const char* const kNames[] = {
+          "debug", "info", "success", "warning", "failure", "error"
+        };
+        std::fprintf(json_, "{\"ts_us\":%lld,\"level\":\"%s\",\"msg\":\"",
+            static_cast<long long>(record.time_us),
+            kNames[static_cast<uint8_t>(record.level)]);
+        WriteJsonString(json_, record.text, record.size);
+        std::fputs("\"}\n", json_);
+      }
+    }
+
+    static void WriteJsonString(std::FILE* out, const char* text, int size) noexcept {
+      for (int i = 0; i < size; ++i) {
+        const unsigned char c = static_cast<unsigned char>(text[i]);
+        if (c == '"' || c == '\\') {
+          std::fputc('\\', out);
+          std::fputc(c, out);
+        } else if (c == '\n') {
+          std::fputs("\\n", out);
+        } else if (c < 0x20u) {
+          std::fprintf(out, "\\u%04x", c);
+        } else {
+          std::fputc(c, out);
+        }
+      }
+    }
+
+    std::unique_ptr<Cell[]> cells_;
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+    std::atomic<size_t> written_{0};
+    std::atomic<uint64_t> dropped_{0};
+    std::atomic<bool> stop_{false};
+    std::atomic<bool> console_{true};
+    std::atomic<bool> flush_{false};
+    std::thread drainer_;
+
+    // parking
+    std::atomic<uint32_t> sleeping_{0};
+    std::mutex mutex_;
+    std::condition_variable wake_;
+
+    // JSON file swap, handed to the drainer
+    std::mutex open_mutex_;
+    std::FILE* next_json_{nullptr};
+    std::atomic<bool> swap_{false};
+
+    // drainer thread only
+    std::FILE* json_{nullptr};
+    char batch_[64 * 1024];
+    size_t batch_size_{};
+    std::FILE* batch_stream_{nullptr};
+};
+
+// whether a level is compiled in
+template <Level kLevel>
+constexpr bool kEnabled = static_cast<int>(kLevel) >= EMU_LOG_LEVEL;
+
+template <Level kLevel>
+inline void Log(const char* text, size_t size) noexcept {
+  if constexpr (kEnabled<kLevel>) {
+    Logger::Get().Push(kLevel, text, size);
+  }
+}
+
+template <Level kLevel>
+inline void Log(std::string_view text) noexcept {
+  Log<kLevel>(text.data(), text.size());
+}
+
+} // namespace log
+
+} // namespace emu
+
 /** METHODS ------------------------------------ */
 
 namespace emu {
 
 namespace log {
-  inline void Info(const std::string& msg ) {
-    std::cout << "[" << C_BLUE << "*" << C_OFF << "] " << msg << "\n";
-    return;
+  // std::string and const char* overloads, the latter avoids building a
+  // temporary at call sites that log literals
+  inline void Info(const std::string& msg) {
+    Log<Level::kInfo>(msg.data(), msg.size());
+  }
+  inline void Info(const char* msg) {
+    Log<Level::kInfo>(msg, std::strlen(msg));
   }
   inline void Success(const std::string& msg) {
-    std::cout << "[" << C_GREEN << "+" << C_OFF << "] " << msg << "\n";
-    return;
+    Log<Level::kSuccess>(msg.data(), msg.size());
+  }
+  inline void Success(const char* msg) {
+    Log<Level::kSuccess>(msg, std::strlen(msg));
   }
   inline void Warning(const std::string& msg) {
-    std::cout << "[" << C_YELLOW << "!" << C_OFF << "] " << msg << "\n";
-    return;
+    Log<Level::kWarning>(msg.data(), msg.size());
+  }
+  inline void Warning(const char* msg) {
+    Log<Level::kWarning>(msg, std::strlen(msg));
   }
   inline void Failure(const std::string& msg) {
-    std::cout << "[" << C_RED << "-" << C_OFF << "] " << msg << "\n";
-    return;
+    Log<Level::kFailure>(msg.data(), msg.size());
+  }
+  inline void Failure(const char* msg) {
+    Log<Level::kFailure>(msg, std::strlen(msg));
   }
   inline void Error(const std::string& msg) {
-    std::cerr << "[" << CBACK_RED_WHITE << "ERROR" << C_OFF << "] " << msg << "\n";
-    return;
+    Log<Level::kError>(msg.data(), msg.size());
+  }
+  inline void Error(const char* msg) {
+    Log<Level::kError>(msg, std::strlen(msg));
   }
   inline void Debug(const std::string& msg) {
-    std::clog << CBACK_YELLOW_BLACK << msg << C_OFF << "\n";
-    return;
+    Log<Level::kDebug>(msg.data(), msg.size());
+  }
+  inline void Debug(const char* msg) {
+    Log<Level::kDebug>(msg, std::strlen(msg));
+  }
+
+  // block until every message logged so far is written out
+  inline void Flush() noexcept {
+    Logger::Get().Flush();
+  }
+  // additionally write JSON lines to file ("" to stop), false on error
+  inline bool OpenJson(const std::string& file) {
+    return Logger::Get().OpenJson(file);
   }
-  inline void SdlError(const std::string& msg) {
-    std::cerr << "[" << CBACK_RED_WHITE << "ERROR" << C_OFF << "] " << msg
-              << "\nSDL_Error: " << SDL_GetError()
-              << "\n";
+  inline void SetConsole(bool console) noexcept {
+    Logger::Get().set_console(console);
   }
 } // namespace log
 
 } // namespace emu
 
+// The functions above take a finished message, so a call built with + and
+// std::to_string formats it even when its level is compiled out. This
+// evaluates message only when level (a Level enumerator) is compiled in,
+// for messages built on hot paths:
+//   EMU_LOG(kDebug, "rolled back to " + std::to_string(frame));
+#define EMU_LOG(level, message)                                                    \
+  do {                                                                             \
+    if constexpr (::emu::log::kEnabled<::emu::log::Level::level>) {                \
+      ::emu::log::Log<::emu::log::Level::level>(message);                          \
+    }                                                                              \
+  } while (false)
+
 #endif // EMU_LOG_H_
@@ -0,0 +1,329 @@
+#include <chrono>
+
+#include "capture.h"
+#include "log.h"
+
+namespace emu {
+
+namespace {
+
+constexpr uint32_t kMaxRepeat = 0xFFFFu; // APNG delays are 16 bit
+constexpr uint16_t kCaptureFps = 60;
+
+uint32_t Crc32(const uint8_t* data, size_t size, uint32_t crc = 0u) noexcept {
+  static const auto table = [] {
+    std::array<uint32_t, 256> t{};
+    for (uint32_t n = 0; n < 256; ++n) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; ++k) {
+        c = (c & 1u) ? 0xEDB88320u ^ (c >> 1u) : c >> 1u;
+      }
+      t[n] = c;
+    }
+    return t;
+  }();
+  crc = ~crc;
+  for (size_t i = 0; i < size; ++i) {
+    crc = table[(crc ^ data[i]) & 0xFFu] ^ (crc >> 8u);
+  }
+  return ~crc;
+}
+
+uint32_t Adler32(const uint8_t* data, size_t size) noexcept {
+  uint32_t a = 1u;
+  uint32_t b = 0u;
+  for (size_t i = 0; i < size; ++i) {
+    a = (a + data[i]) % 65521u;
+    b = (b + a) % 65521u;
+  }
+  return (b << 16u) | a;
+}
+
+void PutU16(std::vector<uint8_t>& out, uint16_t value) {
+  out.push_back(static_cast<uint8_t>(value >> 8u));
+  out.push_back(static_cast<uint8_t>(value));
+}
+
+void PutU32(std::vector<uint8_t>& out, uint32_t value) {
+  out.push_back(static_cast<uint8_t>(value >> 24u));
+  out.push_back(static_cast<uint8_t>(value >> 16u));
+  out.push_back(static_cast<uint8_t>(value >> 8u));
+  out.push_back(static_cast<uint8_t>(value));
+}
+
+bool EndsWith(const std::string& str, const std::string& suffix) {
+  return str.size() >= suffix.size()
+      && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+} // namespace
+
+Capture::Capture(size_t queue_size) {
+  size_t size = 1;
+  while (size < queue_size) {
+    size <<= 1u;
+  }
+  ring_.resize(size);
+  mask_ = size - 1;
+}
+
+Capture::~Capture() {
+  Close();
+}
+
+Capture::Format Capture::FormatFromFile(const std::string& file) {
+  if (EndsWith(file, ".y4m")) {
+    return Format::kY4m;
+  }
+  if (EndsWith(file, ".png") || EndsWith(file, ".apng")) {
+    return Format::kApng;
+  }
+  return Format::kRaw;
+}
+
+int Capture::Open(const std::string& file) {
+  return Open(file, FormatFromFile(file));
+}
+
+int Capture::Open(const std::string& file, Format format) {
+  if (IsOpen()) {
+    log::Error("capture already open");
+    return 1;
+  }
+  file_ = std::fopen(file.c_str(), "wb");
+  if (file_ == nullptr) {
+    log::Error("can't open capture file: " + file);
+    return 1;
+  }
+  format_ = format;
+  frames_ = 0;
+  pending_repeat_ = 0;
+  apng_frames_ = 0;
+  apng_sequence_ = 0;
+  head_.store(0, std::memory_order_relaxed);
+  tail_.store(0, std::memory_order_relaxed);
+  dropped_.store(0, std::memory_order_relaxed);
+  stop_.store(false, std::memory_order_relaxed);
+
+  encoder_ = std::thread(&Capture::Encode, this);
+  return 0;
+}
+
+void Capture::Close() {
+  if (!IsOpen()) {
+    return;
+  }
+  if (pending_repeat_ != 0) {
+    Enqueue(pending_, pending_repeat_);
+    pending_repeat_ = 0;
+  }
+  stop_.store(true, std::memory_order_release);
+  encoder_.join();
+
+  WriteTrailer();
+  std::fclose(file_);
+  file_ = nullptr;
+
+  uint64_t dropped = get_dropped();
+  if (dropped != 0) {
+    log::Warning("capture dropped " + std::to_string(dropped) + " frames");
+  }
+}
+
+void Capture::Push(const Frame& frame) noexcept {
+  if (!IsOpen()) {
+    return;
+  }
+  ++frames_;
+  // fold static screens into the previous entry
+  if (pending_repeat_ != 0 && pending_repeat_ < kMaxRepeat && frame == pending_) {
+    ++pending_repeat_;
+    return;
+  }
+  if (pending_repeat_ != 0) {
+    Enqueue(pending_, pending_repeat_);
+  }
+  pending_ = frame;
+  pending_repeat_ = 1;
+}
+
+void Capture::Enqueue(const Frame& frame, uint32_t repeat) noexcept {
+  size_t head = head_.load(std::memory_order_relaxed);
+  size_t tail = tail_.load(std::memory_order_acquire);
+  if (head - tail == ring_.size()) {
+    dropped_.fetch_add(repeat, std::memory_order_relaxed);
+    return;
+  }
+  Entry& entry = ring_[head & mask_];
+  entry.frame = frame;
+  entry.repeat = repeat;
+  head_.store(head + 1, std::memory_order_release);
+}
+
+void Capture::Encode() {
+  WriteHeader();
+  for (;;) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) {
+      if (stop_.load(std::memory_order_acquire)
+          && tail == head_.load(std::memory_order_acquire)) {
+        break;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+      continue;
+    }
+    WriteEntry(ring_[tail & mask_]);
+    tail_.store(tail + 1, std::memory_order_release);
+  }
+}
+
+void Capture::WriteHeader() {
+  switch (format_) {
+    case Format::kRaw:
+      break;
+    case Format::kY4m:
+      std::fprintf(file_, "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 Cmono\n",
+          kFrameWidth, kFrameHeight, kCaptureFps);
+      break;
+    case Format::kApng: {
+      static const uint8_t kSignature[8] = {
+        0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'
+      };
+      std::fwrite(kSignature, 1, sizeof(kSignature), file_);
+
+      std::vector<uint8_t> ihdr;
+      PutU32(ihdr, kFrameWidth);
+      PutU32(ihdr, kFrameHeight);
+      ihdr.push_back(1); // bit depth
+      ihdr.push_back(0); // grayscale
+      ihdr.push_back(0); // deflate
+      ihdr.push_back(0); // adaptive filtering
+      ihdr.push_back(0); // no interlace
+      WriteChunk("IHDR", ihdr);
+
+      // frame count is patched on close
+      apng_actl_offset_ = std::ftell(file_);
+      std::vector<uint8_t> actl;
+      PutU32(actl, 0);
+      PutU32(actl, 0); // loop forever
+      WriteChunk("acTL", actl);
+      break;
+    }
+  }
+}
+
+void Capture::WriteEntry(const Entry& entry) {
+  switch (format_) {
+    case Format::kRaw: {
+      uint8_t record[4 + kFrameHeight * 8];
+      // big endian like the rows, the file reads the same on any host
+      for (uint16_t b = 0; b < 4; ++b) {
+        record[b] = static_cast<uint8_t>(entry.repeat >> (24u - 8u * b));
+      }
+      for (uint16_t y = 0; y < kFrameHeight; ++y) {
+        for (uint16_t b = 0; b < 8; ++b) {
+          record[4 + y * 8 + b] =
+              static_cast<uint8_t>(entry.frame[y] >> (56u - 8u * b));
+        }
+      }
+      std::fwrite(record, 1, sizeof(record), file_);
+      break;
+    }
+    case Format::kY4m: {
+      uint8_t plane[kFrameWidth * kFrameHeight];
+      for (uint16_t y = 0; y < kFrameHeight; ++y) {
+        for (uint16_t x = 0; x < kFrameWidth; ++x) {
+          plane[y * kFrameWidth + x] = GetPixel(entry.frame, x, y) ? 235u : 16u;
+        }
+      }
+      // y4m is constant rate, duplicates are cheap to write but must be there
+      for (uint32_t i = 0; i < entry.repeat; ++i) {
+        std::fputs("FRAME\n", file_);
+        std::fwrite(plane, 1, sizeof(plane), file_);
+      }
+      break;
+    }
+    case Format::kApng: {
+      std::vector<uint8_t> fctl;
+      PutU32(fctl, apng_sequence_++);
+      PutU32(fctl, kFrameWidth);
+      PutU32(fctl, kFrameHeight);
+      PutU32(fctl, 0);
+      PutU32(fctl, 0);
+      PutU16(fctl, static_cast<uint16_t>(entry.repeat));
+      PutU16(fctl, kCaptureFps);
+      fctl.push_back(0); // dispose none
+      fctl.push_back(0); // blend source
+      WriteChunk("fcTL", fctl);
+
+      std::vector<uint8_t> data = PngImageData(entry.frame);
+      if (apng_frames_ == 0) {
+        WriteChunk("IDAT", data);
+      } else {
+        std::vector<uint8_t> fdat;
+        fdat.reserve(data.size() + 4);
+        PutU32(fdat, apng_sequence_++);
+        fdat.insert(fdat.end(), data.begin(), data.end());
+        WriteChunk("fdAT", fdat);
+      }
+      ++apng_frames_;
+      break;
+    }
+  }
+}
+
+void Capture::WriteTrailer() {
+  if (format_ != Format::kApng) {
+    return;
+  }
+  // a PNG needs an IDAT, closed before the first frame it gets a blank one
+  if (apng_frames_ == 0) {
+    WriteEntry(Entry{Frame{}, 1});
+  }
+  WriteChunk("IEND", {});
+  std::fseek(file_, apng_actl_offset_, SEEK_SET);
+  std::vector<uint8_t> actl;
+  PutU32(actl, apng_frames_);
+  PutU32(actl, 0);
+  WriteChunk("acTL", actl);
+}
+
+void Capture::WriteChunk(const char* type, const std::vector<uint8_t>& data) {
+  std::vector<uint8_t> chunk;
+  chunk.reserve(data.size() + 12);
+  PutU32(chunk, static_cast<uint32_t>(data.size()));
+  chunk.insert(chunk.end(), type, type + 4);
+  chunk.insert(chunk.end(), data.begin(), data.end());
+  PutU32(chunk, Crc32(chunk.data() + 4, data.size() + 4));
+  std::fwrite(chunk.data(), 1, chunk.size(), file_);
+}
+
+// zlib stream of stored (uncompressed) deflate blocks, a 1bpp frame is only
+// 288 bytes so compressing it is not worth a dependency
+std::vector<uint8_t> Capture::PngImageData(const Frame& frame) const {
+  std::vector<uint8_t> raw;
+  raw.reserve(kFrameHeight * 9);
+  for (uint16_t y = 0; y < kFrameHeight; ++y) {
+    raw.push_back(0); // filter none
+    for (uint16_t b = 0; b < 8; ++b) {
+      raw.push_back(static_cast<uint8_t>(frame[y] >> (56u - 8u * b)));
+    }
+  }
+
+  std::vector<uint8_t> out;
+  out.reserve(raw.size() + 11);
+  out.push_back(0x78);
+  out.push_back(0x01);
+  out.push_back(0x01); // final stored block
+  uint16_t len = static_cast<uint16_t>(raw.size());
+  uint16_t nlen = static_cast<uint16_t>(~len);
+  out.push_back(static_cast<uint8_t>(len));
+  out.push_back(static_cast<uint8_t>(len >> 8u));
+  out.push_back(static_cast<uint8_t>(nlen));
+  out.push_back(static_cast<uint8_t>(nlen >> 8u));
+  out.insert(out.end(), raw.begin(), raw.end());
+  PutU32(out, Adler32(raw.data(), raw.size()));
+  return out;
+}
+
+} // namespace emu
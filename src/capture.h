@@ -0,0 +1,89 @@
+#ifndef EMU_CAPTURE_H_
+#define EMU_CAPTURE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "frame.h"
+
+namespace emu {
+
+// Frame capture to disk. The emulation thread pushes packed frames into a
+// bounded single producer / single consumer ring, identical consecutive
+// frames are folded into a repeat count before they reach the ring, and a
+// background thread encodes them. Push() never blocks, when the ring is
+// full the frame is dropped and counted.
+class Capture {
+  public:
+    enum class Format {
+      kRaw,  // [u32 repeat][32 rows, 8 bytes each], all big endian, per record
+      kY4m,  // YUV4MPEG2 mono, 60 fps, repeated frames written out
+      kApng, // animated PNG, 1 bit grayscale, repeats become frame delays
+    };
+
+    explicit Capture(size_t queue_size = 1024);
+    ~Capture();
+
+    Capture(const Capture& rhs) = delete;
+    Capture(const Capture&& rhs) = delete;
+    Capture& operator=(const Capture& rhs) = delete;
+    Capture& operator=(const Capture&& rhs) = delete;
+
+    // format is taken from the extension (.y4m, .png/.apng, anything else raw)
+    [[nodiscard]] int Open(const std::string& file);
+    [[nodiscard]] int Open(const std::string& file, Format format);
+    void Close();
+
+    // called once per presented frame from the emulation thread
+    void Push(const Frame& frame) noexcept;
+
+    [[nodiscard]] bool IsOpen() const noexcept { return file_ != nullptr; }
+    [[nodiscard]] uint64_t get_frames() const noexcept { return frames_; }
+    [[nodiscard]] uint64_t get_dropped() const noexcept {
+      return dropped_.load(std::memory_order_relaxed);
+    }
+
+    static Format FormatFromFile(const std::string& file);
+  private:
+    struct Entry {
+      Frame frame;
+      uint32_t repeat;
+    };
+
+    // producer side (emulation thread)
+    void Enqueue(const Frame& frame, uint32_t repeat) noexcept;
+    Frame pending_{};
+    uint32_t pending_repeat_{};
+    uint64_t frames_{};
+
+    // ring
+    std::vector<Entry> ring_;
+    size_t mask_;
+    std::atomic<size_t> head_{0};
+    std::atomic<size_t> tail_{0};
+    std::atomic<uint64_t> dropped_{0};
+    std::atomic<bool> stop_{false};
+
+    // consumer side (encoder thread)
+    void Encode();
+    void WriteHeader();
+    void WriteEntry(const Entry& entry);
+    void WriteTrailer();
+    void WriteChunk(const char* type, const std::vector<uint8_t>& data);
+    std::vector<uint8_t> PngImageData(const Frame& frame) const;
+
+    Format format_{Format::kRaw};
+    std::FILE* file_{nullptr};
+    std::thread encoder_;
+    uint32_t apng_frames_{};
+    uint32_t apng_sequence_{};
+    long apng_actl_offset_{};
+};
+
+} // namespace emu
+
+#endif // EMU_CAPTURE_H_
@@ -1,8 +1,9 @@
+#include <algorithm>
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <fstream>
 #include <memory>
-#include <chrono>
 
 #include "chip8.h"
 
@@ -11,68 +12,82 @@ namespace emu {
 Chip8::Chip8() noexcept
     : Chip8(64, 32) {}
 
-Chip8::Chip8(uint16_t width, uint16_t height) noexcept
-    : width_(width), height_(height),
-      pc_(kEntryPointAddr),
-      rand_gen_(std::chrono::system_clock::now().time_since_epoch().count()) {
+// function pointer tables, one set for every instance
+constexpr std::array<Chip8::instruction, 0xF + 1> Chip8::kTable{
+  &Chip8::Table0,  &Chip8::OP_1nnn, &Chip8::OP_2nnn, &Chip8::OP_3xkk,
+  &Chip8::OP_4xkk, &Chip8::OP_5xy0, &Chip8::OP_6xkk, &Chip8::OP_7xkk,
+  &Chip8::Table8,  &Chip8::OP_9xy0, &Chip8::OP_Annn, &Chip8::OP_Bnnn,
+  &Chip8::OP_Cxkk, &Chip8::OP_Dxyn, &Chip8::TableE,  &Chip8::TableF,
+};
+
+constexpr std::array<Chip8::instruction, 0xF + 1> Chip8::kTable0 = [] {
+  std::array<instruction, 0xF + 1> table{};
+  for (auto& entry : table) {
+    entry = &Chip8::OP_NULL;
+  }
+  table[0x0] = &Chip8::OP_00E0;
+  table[0xE] = &Chip8::OP_00EE;
+  return table;
+}();
+
+constexpr std::array<Chip8::instruction, 0xF + 1> Chip8::kTable8 = [] {
+  std::array<instruction, 0xF + 1> table{};
+  for (auto& entry : table) {
+    entry = &Chip8::OP_NULL;
+  }
+  table[0x0] = &Chip8::OP_8xy0;
+  table[0x1] = &Chip8::OP_8xy1;
+  table[0x2] = &Chip8::OP_8xy2;
+  table[0x3] = &Chip8::OP_8xy3;
+  table[0x4] = &Chip8::OP_8xy4;
+  table[0x5] = &Chip8::OP_8xy5;
+  table[0x6] = &Chip8::OP_8xy6;
+  table[0x7] = &Chip8::OP_8xy7;
+  table[0xE] = &Chip8::OP_8xyE;
+  return table;
+}();
+
+constexpr std::array<Chip8::instruction, 0xF + 1> Chip8::kTableE = [] {
+  std::array<instruction, 0xF + 1> table{};
+  for (auto& entry : table) {
+    entry = &Chip8::OP_NULL;
+  }
+  table[0x1] = &Chip8::OP_ExA1;
+  table[0xE] = &Chip8::OP_Ex9E;
+  return table;
+}();
+
+constexpr std::array<Chip8::instruction, 0xFF + 1> Chip8::kTableF = [] {
+  std::array<instruction, 0xFF + 1> table{};
+  for (auto& entry : table) {
+    entry = &Chip8::OP_NULL;
+  }
+  table[0x07] = &Chip8::OP_Fx07;
+  table[0x0A] = &Chip8::OP_Fx0A;
+  table[0x15] = &Chip8::OP_Fx15;
+  table[0x18] = &Chip8::OP_Fx18;
+  table[0x1E] = &Chip8::OP_Fx1E;
+  table[0x29] = &Chip8::OP_Fx29;
+  table[0x33] = &Chip8::OP_Fx33;
+  table[0x55] = &Chip8::OP_Fx55;
+  table[0x65] = &Chip8::OP_Fx65;
+  return table;
+}();
+
+Chip8::Chip8(uint16_t width, uint16_t height, uint64_t seed) noexcept
+    : pc_(kEntryPointAddr),
+      width_(std::min(width, kFrameWidth)),
+      height_(std::min(height, kFrameHeight)),
+      rng_(seed) {
+  static_assert(offsetof(Chip8, cycle_) == 0 && offsetof(Chip8, sp_) < 64,
+      "the hot state must fit the first cache line");
 
   // load fonts into memory
   for (uint16_t i = 0; i < kFontSetSize; ++i) {
     memory_[kFontSetAddr + i] = kFontSet[i];
   }
 
-  // initialize RNG
-  rand_byte_ = std::uniform_int_distribution<uint8_t>(0u, 255u);
-
-  // set up function pointer table
-  table_[0x0] = &Chip8::Table0;
-  table_[0x1] = &Chip8::OP_1nnn;
-  table_[0x2] = &Chip8::OP_2nnn;
-  table_[0x3] = &Chip8::OP_3xkk;
-  table_[0x4] = &Chip8::OP_4xkk;
-  table_[0x5] = &Chip8::OP_5xy0;
-  table_[0x6] = &Chip8::OP_6xkk;
-  table_[0x7] = &Chip8::OP_7xkk;
-  table_[0x8] = &Chip8::Table8;
-  table_[0x9] = &Chip8::OP_9xy0;
-  table_[0xA] = &Chip8::OP_Annn;
-  table_[0xB] = &Chip8::OP_Bnnn;
-  table_[0xC] = &Chip8::OP_Cxkk;
-  table_[0xD] = &Chip8::OP_Dxyn;
-  table_[0xE] = &Chip8::TableE;
-  table_[0xF] = &Chip8::TableF;
-
-  //for (auto& value : table_0_) value = &Chip8::OP_NULL;
-  std::fill(std::begin(table_0_), std::end(table_0_), &Chip8::OP_NULL);
-  std::fill(std::begin(table_8_), std::end(table_8_), &Chip8::OP_NULL);
-  std::fill(std::begin(table_E_), std::end(table_E_), &Chip8::OP_NULL);
-  std::fill(std::begin(table_F_), std::end(table_F_), &Chip8::OP_NULL);
-
-  table_0_[0x0] = &Chip8::OP_00E0;
-  table_0_[0xE] = &Chip8::OP_00EE;
-
-  table_8_[0x0] = &Chip8::OP_8xy0;
-  table_8_[0x1] = &Chip8::OP_8xy1;
-  table_8_[0x2] = &Chip8::OP_8xy2;
-  table_8_[0x3] = &Chip8::OP_8xy3;
-  table_8_[0x4] = &Chip8::OP_8xy4;
-  table_8_[0x5] = &Chip8::OP_8xy5;
-  table_8_[0x6] = &Chip8::OP_8xy6;
-  table_8_[0x7] = &Chip8::OP_8xy7;
-  table_8_[0xE] = &Chip8::OP_8xyE;
-
-  table_E_[0x1] = &Chip8::OP_ExA1;
-  table_E_[0xE] = &Chip8::OP_Ex9E;
-
-  table_F_[0x07] = &Chip8::OP_Fx07;
-  table_F_[0x0A] = &Chip8::OP_Fx0A;
-  table_F_[0x15] = &Chip8::OP_Fx15;
-  table_F_[0x18] = &Chip8::OP_Fx18;
-  table_F_[0x1E] = &Chip8::OP_Fx1E;
-  table_F_[0x29] = &Chip8::OP_Fx29;
-  table_F_[0x33] = &Chip8::OP_Fx33;
-  table_F_[0x55] = &Chip8::OP_Fx55;
-  table_F_[0x65] = &Chip8::OP_Fx65;
+  Analyze(0, static_cast<uint16_t>(memory_.size()));
 }
 
 Chip8::~Chip8() noexcept {}
@@ -89,30 +104,476 @@ void Chip8::LoadRom(const std::string& file) {
     fs.read(buffer.get(), size);
     fs.close();
 
-    for (uint16_t i = 0; i < size; ++i) {
-      memory_[kEntryPointAddr + i] = buffer[i];
-    }
+    LoadRom(reinterpret_cast<const uint8_t*>(buffer.get()),
+        static_cast<size_t>(size));
   } else {
     throw std::runtime_error("can't open ROM file: " + file);
   }
   fs.close();
 }
 
+void Chip8::LoadRom(const uint8_t* data, size_t size) {
+  if (size > kMaxRomSize) {
+    throw std::runtime_error("ROM too large: " + std::to_string(size) + " bytes");
+  }
+  std::copy(data, data + size, memory_.begin() + kEntryPointAddr);
+  for (size_t page = kEntryPointAddr / kPageSize;
+       page * kPageSize < kEntryPointAddr + size; ++page) {
+    dirty_pages_ |= 1u << page;
+  }
+  Analyze(kEntryPointAddr, static_cast<uint16_t>(size));
+}
+
+size_t Chip8::Patch(uint16_t addr, const uint8_t* data, size_t size) noexcept {
+  size = std::min(size, memory_.size());
+  size_t changed = 0;
+  size_t first = 0;
+  size_t last = 0;
+  for (size_t i = 0; i < size; ++i) {
+    const uint16_t at = (addr + i) & kAddrMask;
+    if (memory_[at] == data[i]) {
+      continue;
+    }
+    Store(at, data[i]);
+    if (changed++ == 0) {
+      first = i;
+    }
+    last = i;
+  }
+  // one pass over the span, edits are usually a few bytes close together
+  if (changed != 0) {
+    Analyze(static_cast<uint16_t>((addr + first) & kAddrMask),
+        static_cast<uint16_t>(last - first + 1u));
+  }
+  return changed;
+}
+
+void Chip8::Reset(uint64_t seed) noexcept {
+  // only pages written since the last reset differ from the power on image
+  // (zeros plus the font in page 0)
+  for (uint16_t page = 0; dirty_pages_ != 0; ++page, dirty_pages_ >>= 1u) {
+    if ((dirty_pages_ & 1u) == 0u) {
+      continue;
+    }
+    std::fill_n(memory_.begin() + page * kPageSize, kPageSize, 0);
+    if (page == kFontSetAddr / kPageSize) {
+      std::copy(kFontSet.begin(), kFontSet.end(), memory_.begin() + kFontSetAddr);
+    }
+    Analyze(page * kPageSize, kPageSize);
+  }
+
+  registers_.fill(0);
+  index_ = 0;
+  pc_ = kEntryPointAddr;
+  stack_.fill(0);
+  sp_ = 0;
+  timer_loads_ -= get_delay_timer() + get_sound_timer();
+  cycle_ = 0;
+  delay_end_ = 0;
+  sound_end_ = 0;
+  keypad_.fill(0);
+  video_.fill(0u);
+  rng_.Seed(seed);
+}
+
+void Chip8::Save(Snapshot& snapshot) const noexcept {
+  snapshot.registers = registers_;
+  snapshot.memory = memory_;
+  snapshot.index = index_;
+  snapshot.pc = pc_;
+  snapshot.stack = stack_;
+  snapshot.sp = sp_;
+  snapshot.delay_timer = get_delay_timer();
+  snapshot.sound_timer = get_sound_timer();
+  snapshot.tick_phase = static_cast<uint32_t>(cycle_ % cycles_per_tick_);
+  snapshot.keypad = keypad_;
+  snapshot.video = video_;
+  snapshot.rng = rng_.get_state();
+}
+
+void Chip8::Load(const Snapshot& snapshot) noexcept {
+  registers_ = snapshot.registers;
+  memory_ = snapshot.memory;
+  dirty_pages_ = 0xFFFFu;
+  Analyze(0, static_cast<uint16_t>(memory_.size()));
+  index_ = snapshot.index;
+  pc_ = snapshot.pc;
+  stack_ = snapshot.stack;
+  sp_ = snapshot.sp;
+  timer_loads_ += snapshot.delay_timer + snapshot.sound_timer
+      - get_delay_timer() - get_sound_timer();
+  // restart the clock at the same phase, tick 0
+  cycle_ = snapshot.tick_phase % cycles_per_tick_;
+  delay_end_ = snapshot.delay_timer;
+  sound_end_ = snapshot.sound_timer;
+  keypad_ = snapshot.keypad;
+  video_ = snapshot.video;
+  rng_.set_state(snapshot.rng);
+}
+
 void Chip8::Cycle() {
   // fetch
-  opcode_ = (memory_[pc_] << 8u) | memory_[pc_ + 1];
+  opcode_ = (memory_[pc_ & kAddrMask] << 8u) | memory_[(pc_ + 1) & kAddrMask];
   // increment pc before executing
   pc_ += 2;
+  ++instructions_;
   // decode and execute
-  (this->*(table_[(opcode_ & 0xF000u) >> 12u]))();
-  // decrement delay timer
-  if (delay_timer_ > 0) {
-    --delay_timer_;
+  (this->*(kTable[(opcode_ & 0xF000u) >> 12u]))();
+  // the timers tick by themselves, see TimerAt()
+  ++cycle_;
+}
+
+void Chip8::set_cycles_per_tick(uint32_t cycles) noexcept {
+  // keep the current values, counting from a fresh tick
+  const uint8_t delay = get_delay_timer();
+  const uint8_t sound = get_sound_timer();
+  cycles_per_tick_ = std::max(cycles, 1u);
+  cycle_ = 0;
+  delay_end_ = delay;
+  sound_end_ = sound;
+}
+
+uint32_t Chip8::Run(uint32_t cycles) noexcept {
+  // working copies, the compiler can keep these in registers because
+  // nothing else (memory_ stores in particular) can alias them
+  uint8_t v[16];
+  std::copy(registers_.begin(), registers_.end(), v);
+  uint16_t pc = pc_;
+  uint16_t index = index_;
+  uint8_t sp = sp_;
+  const uint8_t* const mem = memory_.data();
+  uint64_t fused = 0;
+  uint64_t idle = 0;
+
+  auto fetch = [mem](uint16_t addr) -> uint16_t {
+    return (mem[addr & kAddrMask] << 8u) | mem[(addr + 1) & kAddrMask];
+  };
+
+  for (uint32_t n = 0; n < cycles; ++n) {
+    // superinstructions, each case either runs its whole sequence within
+    // the budget and continues, or breaks to execute one instruction below
+    const uint32_t left = cycles - n;
+    switch (fusion_[pc & kAddrMask]) {
+      case kNotFused:
+        break;
+      case kJumpSelf:
+        // nothing changes until the budget runs out
+        pc &= kAddrMask;
+        idle += left - 1u;
+        n = cycles - 1;
+        continue;
+      case kKeyWait: {
+        const uint16_t a = fetch(pc);
+        const bool pressed = keypad_[v[(a >> 8u) & 0xFu] & 0xFu] != 0u;
+        // Ex9E skips when pressed, ExA1 when not
+        const uint16_t at = pc & kAddrMask;
+        const uint16_t next = at + ((((a & 0xFu) == 0xEu) == pressed) ? 4u : 2u);
+        if (left < 2 || fetch(next) != (0x1000u | at)) {
+          break;
+        }
+        // the keypad can't change inside Run, loop for the rest of the
+        // budget; an odd budget ends after the key test
+        pc = (left & 1u) ? next : at;
+        idle += left - 1u;
+        n = cycles - 1;
+        continue;
+      }
+      case kTimerWait: {
+        if (left < 3) {
+          break;
+        }
+        const uint16_t a = fetch(pc);
+        const uint16_t b = fetch(pc + 2);
+        const uint8_t vx = (a >> 8u) & 0xFu;
+        const bool skip_if_equal = (b >> 12u) == 0x3u;
+        uint32_t done = 0;
+        for (;;) {
+          v[vx] = TimerAt(delay_end_, cycle_ + n + done);
+          if ((v[vx] == (b & 0xFFu)) == skip_if_equal) {
+            pc += 6;
+            done += 2;
+            break;
+          }
+          pc &= kAddrMask; // the jump back
+          done += 3;
+          if (left - done < 3) {
+            break;
+          }
+        }
+        fused += done - 1u;
+        n += done - 1u;
+        continue;
+      }
+      case kImmPair: {
+        if (left < 2) {
+          break;
+        }
+        const uint16_t a = fetch(pc);
+        const uint16_t b = fetch(pc + 2);
+        // 6xkk keeps none of Vx, 7xkk all of it
+        uint8_t& va = v[(a >> 8u) & 0xFu];
+        va = (va & static_cast<uint8_t>(0u - ((a >> 12u) & 1u))) + (a & 0xFFu);
+        uint8_t& vb = v[(b >> 8u) & 0xFu];
+        vb = (vb & static_cast<uint8_t>(0u - ((b >> 12u) & 1u))) + (b & 0xFFu);
+        pc += 4;
+        ++fused;
+        ++n;
+        continue;
+      }
+      case kAddSkip: {
+        if (left < 2) {
+          break;
+        }
+        const uint16_t a = fetch(pc);
+        const uint16_t b = fetch(pc + 2);
+        v[(a >> 8u) & 0xFu] += a & 0xFFu;
+        const bool equal = v[(b >> 8u) & 0xFu] == (b & 0xFFu);
+        pc += (equal == ((b >> 12u) == 0x3u)) ? 6 : 4;
+        ++fused;
+        ++n;
+        continue;
+      }
+      case kDrawAdd: {
+        if (left < 2) {
+          break;
+        }
+        const uint16_t a = fetch(pc);
+        const uint16_t b = fetch(pc + 2);
+        v[0xF] = Draw(v[(a >> 8u) & 0xFu], v[(a >> 4u) & 0xFu], a & 0xFu, index);
+        v[(b >> 8u) & 0xFu] += b & 0xFFu;
+        pc += 4;
+        ++fused;
+        ++n;
+        continue;
+      }
+      case kSetDraw: {
+        if (left < 2) {
+          break;
+        }
+        const uint16_t b = fetch(pc + 2);
+        index = fetch(pc) & 0xFFFu;
+        v[0xF] = Draw(v[(b >> 8u) & 0xFu], v[(b >> 4u) & 0xFu], b & 0xFu, index);
+        pc += 4;
+        ++fused;
+        ++n;
+        continue;
+      }
+      case kSetLoad: {
+        if (left < 2) {
+          break;
+        }
+        const uint8_t last = (fetch(pc + 2) >> 8u) & 0xFu;
+        index = fetch(pc) & 0xFFFu;
+        for (uint8_t i = 0; i <= last; ++i) {
+          v[i] = mem[(index + i) & kAddrMask];
+        }
+        pc += 4;
+        ++fused;
+        ++n;
+        continue;
+      }
+    }
+
+    const uint16_t op = fetch(pc);
+    pc += 2;
+
+    const uint8_t x = (op >> 8u) & 0xFu;
+    const uint8_t y = (op >> 4u) & 0xFu;
+    const uint8_t kk = op & 0xFFu;
+    const uint16_t nnn = op & 0xFFFu;
+
+    switch (op >> 12u) {
+      case 0x0:
+        switch (op & 0xFu) {
+          case 0x0: video_.fill(0u); break;
+          case 0xE: sp = (sp - 1u) & 0xFu; pc = stack_[sp]; break;
+        }
+        break;
+      case 0x1: pc = nnn; break;
+      case 0x2: stack_[sp] = pc; sp = (sp + 1u) & 0xFu; pc = nnn; break;
+      case 0x3: if (v[x] == kk) pc += 2; break;
+      case 0x4: if (v[x] != kk) pc += 2; break;
+      case 0x5: if (v[x] == v[y]) pc += 2; break;
+      case 0x6: v[x] = kk; break;
+      case 0x7: v[x] += kk; break;
+      case 0x8:
+        // VF is written first and the operands are read again after, the
+        // same order as the OP_8xy* handlers
+        switch (op & 0xFu) {
+          case 0x0: v[x] = v[y]; break;
+          case 0x1: v[x] |= v[y]; break;
+          case 0x2: v[x] &= v[y]; break;
+          case 0x3: v[x] ^= v[y]; break;
+          case 0x4: {
+            uint16_t sum = v[x] + v[y];
+            v[0xF] = sum > 255u;
+            v[x] = sum & 0xFFu;
+            break;
+          }
+          case 0x5: v[0xF] = v[x] > v[y]; v[x] -= v[y]; break;
+          case 0x6: v[0xF] = v[x] & 0x1u; v[x] >>= 1; break;
+          case 0x7: v[0xF] = v[y] > v[x]; v[x] = v[y] - v[x]; break;
+          case 0xE: v[0xF] = v[x] >> 7u; v[x] <<= 1; break;
+        }
+        break;
+      case 0x9: if (v[x] != v[y]) pc += 2; break;
+      case 0xA: index = nnn; break;
+      case 0xB: pc = v[0x0] + nnn; break;
+      case 0xC: v[x] = rng_.NextByte() & kk; break;
+      case 0xD: v[0xF] = Draw(v[x], v[y], op & 0xFu, index); break;
+      case 0xE:
+        switch (op & 0xFu) {
+          case 0xE: if (keypad_[v[x] & 0xFu]) pc += 2; break;
+          case 0x1: if (!keypad_[v[x] & 0xFu]) pc += 2; break;
+        }
+        break;
+      case 0xF:
+        switch (kk) {
+          case 0x07: v[x] = TimerAt(delay_end_, cycle_ + n); break;
+          case 0x0A: {
+            uint8_t key = 0;
+            while (key < 16 && !keypad_[key]) {
+              ++key;
+            }
+            if (key < 16) {
+              v[x] = key;
+              break;
+            }
+            // the keypad can't change inside Run, so every remaining cycle
+            // would re-execute this wait
+            pc -= 2;
+            n = cycles - 1;
+            continue;
+          }
+          case 0x15:
+            timer_loads_ += v[x] - TimerAt(delay_end_, cycle_ + n);
+            delay_end_ = TickAt(cycle_ + n) + v[x];
+            break;
+          case 0x18:
+            timer_loads_ += v[x] - TimerAt(sound_end_, cycle_ + n);
+            sound_end_ = TickAt(cycle_ + n) + v[x];
+            break;
+          case 0x1E: index += v[x]; break;
+          case 0x29: index = kFontSetAddr + (5 * v[x]); break;
+          case 0x33:
+            Store(index, v[x] / 100u);
+            Store(index + 1, (v[x] / 10u) % 10u);
+            Store(index + 2, v[x] % 10u);
+            Analyze(index, 3);
+            break;
+          case 0x55:
+            for (uint8_t i = 0; i <= x; ++i) {
+              Store(index + i, v[i]);
+            }
+            Analyze(index, x + 1u);
+            break;
+          case 0x65:
+            for (uint8_t i = 0; i <= x; ++i) {
+              v[i] = mem[(index + i) & kAddrMask];
+            }
+            break;
+        }
+        break;
+    }
+  }
+
+  std::copy(v, v + 16, registers_.begin());
+  pc_ = pc;
+  index_ = index;
+  sp_ = sp;
+  cycle_ += cycles;
+  instructions_ += cycles;
+  fused_ += fused;
+  idle_ += idle;
+  return cycles;
+}
+
+uint8_t Chip8::Fuse(uint16_t addr) const noexcept {
+  auto fetch = [this](uint16_t a) -> uint16_t {
+    return (memory_[a & kAddrMask] << 8u) | memory_[(a + 1) & kAddrMask];
+  };
+  // match what Run() decodes, e.g. any ExyE is Ex9E there
+  const uint16_t op = fetch(addr);
+  const uint16_t next = fetch(addr + 2);
+  const uint16_t jump_back = 0x1000u | addr;
+  const uint8_t kind = op >> 12u;
+  const uint8_t next_kind = next >> 12u;
+
+  switch (kind) {
+    case 0x1:
+      return ((op & 0xFFFu) == addr) ? kJumpSelf : kNotFused;
+    case 0x6:
+    case 0x7:
+      if (next_kind == 0x6u || next_kind == 0x7u) {
+        return kImmPair;
+      }
+      return (kind == 0x7u && (next_kind == 0x3u || next_kind == 0x4u)) ? kAddSkip : kNotFused;
+    case 0xA:
+      if (next_kind == 0xDu) {
+        return kSetDraw;
+      }
+      return ((next & 0xF0FFu) == 0xF065u) ? kSetLoad : kNotFused;
+    case 0xD:
+      return (next_kind == 0x7u) ? kDrawAdd : kNotFused;
+    case 0xE:
+      if (((op & 0xFu) == 0xEu || (op & 0xFu) == 0x1u)
+          && (next == jump_back || fetch(addr + 4) == jump_back)) {
+        return kKeyWait;
+      }
+      return kNotFused;
+    case 0xF:
+      if ((op & 0xFFu) == 0x07u && (next_kind == 0x3u || next_kind == 0x4u)
+          && ((next >> 8u) & 0xFu) == ((op >> 8u) & 0xFu)
+          && fetch(addr + 4) == jump_back) {
+        return kTimerWait;
+      }
+      return kNotFused;
+  }
+  return kNotFused;
+}
+
+void Chip8::Analyze(uint16_t addr, uint16_t size) noexcept {
+  if (!fusion_enabled_) {
+    return;
   }
-  // decrement sound timer
-  if (sound_timer_ > 0) {
-    --sound_timer_;
+  // a byte is part of the sequences starting up to kFusedSpan - 1 before it
+  const size_t count = std::min<size_t>(size + kFusedSpan - 1u, memory_.size());
+  uint16_t start = (addr - (kFusedSpan - 1u)) & kAddrMask;
+  for (size_t i = 0; i < count; ++i) {
+    const uint16_t at = (start + i) & kAddrMask;
+    fusion_[at] = Fuse(at);
+  }
+}
+
+void Chip8::set_fusion(bool fusion) noexcept {
+  fusion_enabled_ = fusion;
+  fusion_.fill(kNotFused);
+  Analyze(0, static_cast<uint16_t>(memory_.size()));
+}
+
+uint8_t Chip8::Draw(uint8_t vx, uint8_t vy, uint8_t height, uint16_t index) noexcept {
+  // wrap if going beyond screen boundaries
+  uint8_t x = vx % width_;
+  uint8_t y = vy % height_;
+  uint8_t collision = 0;
+  ++draws_;
+
+  for (uint16_t row = 0; row < height; ++row) {
+    // move the sprite byte to the left edge, then rotate it into place so
+    // pixels past the right edge wrap around
+    uint64_t sprite = static_cast<uint64_t>(memory_[(index + row) & kAddrMask]) << 56u;
+    if (x != 0u) {
+      sprite = (sprite >> x) | (sprite << (64u - x));
+    }
+    uint64_t& screen_row = video_[(y + row) % height_];
+    // any sprite pixel over a screen pixel that is on -> collision
+    if ((screen_row & sprite) != 0u) {
+      collision = 1;
+    }
+    // XOR the whole row at once
+    screen_row ^= sprite;
   }
+  return collision;
 }
 
 // opcodes
@@ -120,12 +581,12 @@ void Chip8::Cycle() {
 // 00E0: CLS
 // Clear the display
 void Chip8::OP_00E0() noexcept {
-  memset(video_.data(), 0, video_.size());
+  video_.fill(0u);
 }
 // 00EE: RET
 // Return from a subroutine
 void Chip8::OP_00EE() noexcept {
-  --sp_;
+  sp_ = (sp_ - 1u) & 0xFu;
   pc_ = stack_[sp_];
 }
 // 1nnn: JP addr
@@ -139,7 +600,7 @@ void Chip8::OP_1nnn() noexcept {
 void Chip8::OP_2nnn() noexcept {
   uint16_t addr = opcode_ & 0x0FFFu;
   stack_[sp_] = pc_;
-  ++sp_;
+  sp_ = (sp_ + 1u) & 0xFu;
   pc_ = addr;
 }
 // 3xkk: SE Vx, byte
@@ -297,7 +758,7 @@ void Chip8::OP_Bnnn() noexcept {
 void Chip8::OP_Cxkk() noexcept {
   uint8_t Vx = (opcode_ & 0x0F00u) >> 8u;
   uint8_t byte = opcode_ & 0x00FFu;
-  registers_[Vx] = rand_byte_(rand_gen_) & byte;
+  registers_[Vx] = rng_.NextByte() & byte;
 }
 // Dxyn: DRW Vx, Vy, nibble
 // Display n-byte sprite starting ot memory location I at (Vx, Vy), set VF = collision
@@ -306,39 +767,13 @@ void Chip8::OP_Dxyn() noexcept {
   uint8_t Vy = (opcode_ & 0x00F0u) >> 4u;
   uint8_t height = opcode_ & 0x000Fu;
 
-  //// wrap if going beyond screen boundaries
-  uint8_t x = registers_[Vx] % width_;
-  uint8_t y = registers_[Vy] % height_;
-  //uint8_t x = registers_[Vx];
-  //uint8_t y = registers_[Vy];
-
-  registers_[0xF] = 0;
-
-  for (uint16_t row = 0; row < height; ++row) {
-    uint8_t sprite_byte = memory_[index_ + row];
-    for (uint16_t col = 0; col < 8; ++col) {
-      uint8_t sprite_pixel = sprite_byte & (0x80u >> col);
-      // wrap if going beyond screen boundaries
-      x = x % width_;
-      y = y % height_;
-      uint32_t* screen_pixel = &video_[(y + row) * width_ + (x + col)];
-      // sprite pixel on
-      if (sprite_pixel != 0u) {
-        // screen pixel also on -> collision
-        if (*screen_pixel == 0xFFFFFFFFu) {
-          registers_[0xF] = 1;
-        }
-        // effectively XOR with the sprite pixel
-        *screen_pixel ^= 0xFFFFFFFFu;
-      }
-    }
-  }
+  registers_[0xF] = Draw(registers_[Vx], registers_[Vy], height, index_);
 }
 // Ex9E: SKP Vx
 // Skip next instruction if key with the value of Vx is pressed
 void Chip8::OP_Ex9E() noexcept {
   uint8_t Vx = (opcode_ & 0x0F00u) >> 8u;
-  uint8_t key = registers_[Vx];
+  uint8_t key = registers_[Vx] & 0xFu;
   if (keypad_[key]) {
     pc_ += 2;
   }
@@ -347,7 +782,7 @@ void Chip8::OP_Ex9E() noexcept {
 // Skip next instruction if key with the value of Vx is not pressed
 void Chip8::OP_ExA1() noexcept {
   uint8_t Vx = (opcode_ & 0x0F00u) >> 8u;
-  uint8_t key = registers_[Vx];
+  uint8_t key = registers_[Vx] & 0xFu;
   if (!keypad_[key]) {
     pc_ += 2;
   }
@@ -356,7 +791,7 @@ void Chip8::OP_ExA1() noexcept {
 // Set Vx = delay timer value
 void Chip8::OP_Fx07() noexcept {
   uint8_t Vx = (opcode_ & 0x0F00u) >> 8u;
-  registers_[Vx] = delay_timer_;
+  registers_[Vx] = get_delay_timer();
 }
 // Fx0A: LD Vx, K
 // Wait for a key press, store the value of the key in Vx
@@ -402,13 +837,15 @@ void Chip8::OP_Fx0A() noexcept {
 // Set delay timer = Vx
 void Chip8::OP_Fx15() noexcept {
   uint8_t Vx = (opcode_ & 0x0F00u) >> 8u;
-  delay_timer_ = registers_[Vx];
+  timer_loads_ += registers_[Vx] - get_delay_timer();
+  delay_end_ = TickAt(cycle_) + registers_[Vx];
 }
 // Fx18: LD ST, Vx
 // Set sound time = Vx
 void Chip8::OP_Fx18() noexcept {
   uint8_t Vx = (opcode_ & 0x0F00u) >> 8u;
-  sound_timer_ = registers_[Vx];
+  timer_loads_ += registers_[Vx] - get_sound_timer();
+  sound_end_ = TickAt(cycle_) + registers_[Vx];
 }
 // Fx1E: ADD, I, Vx
 // Set I = I + Vx
@@ -431,28 +868,30 @@ void Chip8::OP_Fx33() noexcept {
   uint8_t Vx = (opcode_ & 0x0F00u) >> 8u;
   uint8_t value = registers_[Vx];
   // ones
-  memory_[index_ + 2] = value % 10;
+  Store(index_ + 2, value % 10);
   value /= 10;
   // tens
-  memory_[index_ + 1] = value % 10;
+  Store(index_ + 1, value % 10);
   value /= 10;
   // hundreds
-  memory_[index_] = value % 10;
+  Store(index_, value % 10);
+  Analyze(index_, 3);
 }
 // LD [I], Vx
 // Stare registers V0 through Vx in memory starting at location I
 void Chip8::OP_Fx55() noexcept {
   uint8_t Vx = (opcode_ & 0x0F00u) >> 8u;
   for (uint8_t i = 0; i <= Vx; ++i) {
-    memory_[index_ + i] = registers_[i];
+    Store(index_ + i, registers_[i]);
   }
+  Analyze(index_, Vx + 1u);
 }
 // LD Vx, [I]
 // Read registers V0 through Vx from memory starting at location I
 void Chip8::OP_Fx65() noexcept {
   uint8_t Vx = (opcode_ & 0x0F00u) >> 8u;
   for (uint8_t i = 0; i <= Vx; ++i) {
-    registers_[i] = memory_[index_ + i];
+    registers_[i] = memory_[(index_ + i) & kAddrMask];
   }
 }
 
@@ -4,16 +4,44 @@
 #include <array>
 #include <string>
 #include <cstdint>
-#include <random>
 
 #include "log.h"
+#include "frame.h"
+#include "rng.h"
 
 namespace emu {
 
 class Chip8 {
   public:
+    // full machine state, used for save states
+    struct Snapshot {
+      std::array<uint8_t, 16> registers;
+      std::array<uint8_t, 4096> memory;
+      uint16_t index;
+      uint16_t pc;
+      std::array<uint16_t, 16> stack;
+      uint8_t sp;
+      uint8_t delay_timer;
+      uint8_t sound_timer;
+      uint32_t tick_phase; // instructions since the last timer tick
+      std::array<uint8_t, 16> keypad;
+      Frame video;
+      Rng::State rng;
+    };
+
+    // lifetime statistics, they survive Reset() and Load()
+    struct Counters {
+      uint64_t instructions;
+      uint64_t draws;       // Dxyn executed
+      uint64_t timer_ticks; // decrements of the delay and sound timers
+    };
+
+    static constexpr uint64_t kDefaultSeed = 0x5EED;
+    static constexpr uint16_t kEntryPointAddr = 0x200;
+    static constexpr size_t kMaxRomSize = 4096 - kEntryPointAddr;
+
     Chip8() noexcept;
-    Chip8(uint16_t width, uint16_t height) noexcept;
+    Chip8(uint16_t width, uint16_t height, uint64_t seed = kDefaultSeed) noexcept;
     ~Chip8() noexcept;
 
     Chip8(const Chip8& rhs) = delete;
@@ -22,16 +50,101 @@ class Chip8 {
     Chip8& operator=(const Chip8&& rhs) = delete;
 
     void LoadRom(const std::string& file);
+    void LoadRom(const uint8_t* data, size_t size);
+    // live code edits: writes the bytes of data that differ from memory at
+    // addr and retags them; registers, stack, timers and the screen are
+    // kept. Returns the number of bytes changed
+    size_t Patch(uint16_t addr, const uint8_t* data, size_t size) noexcept;
     void Cycle();
+    // execute cycles instructions in one tight loop, same semantics as
+    // calling Cycle() that many times
+    uint32_t Run(uint32_t cycles) noexcept;
+
+    // back to the power on state without reconstructing, only the memory
+    // pages written since the last reset are restored
+    void Reset(uint64_t seed = kDefaultSeed) noexcept;
+
+    void Seed(uint64_t seed) noexcept { rng_.Seed(seed); }
+
+    void Save(Snapshot& snapshot) const noexcept;
+    void Load(const Snapshot& snapshot) noexcept;
+
+    // instructions per 60 Hz timer tick, i.e. instructions per frame; the
+    // default 1 ticks after every instruction
+    void set_cycles_per_tick(uint32_t cycles) noexcept;
+    uint32_t get_cycles_per_tick() const noexcept { return cycles_per_tick_; }
+
+    uint8_t get_delay_timer() const noexcept { return TimerAt(delay_end_); }
+    uint8_t get_sound_timer() const noexcept { return TimerAt(sound_end_); }
+    // the clock of the timers, in instructions: from 0 at Reset() and
+    // set_cycles_per_tick(), from the snapshot's tick phase at Load(); only
+    // compare it with values read since the last of those
+    uint64_t get_cycle() const noexcept { return cycle_; }
+    // the sound is on until this get_cycle(), known as soon as Fx18 loads
+    // the timer so an audio backend can schedule the off edge up front
+    uint64_t get_sound_end() const noexcept { return sound_end_ * cycles_per_tick_; }
+    bool IsSounding() const noexcept { return get_sound_timer() != 0u; }
+
+    // superinstructions in Run(), on by default; off is only useful to
+    // measure what they gain
+    void set_fusion(bool fusion) noexcept;
+    // dispatches Run() saved by executing sequences as one
+    uint64_t get_fused() const noexcept { return fused_; }
+    // instructions of idle loops (kJumpSelf, kKeyWait) Run() skipped to
+    // the end of its budget, not counted in get_fused()
+    uint64_t get_idle() const noexcept { return idle_; }
 
     auto& get_keypad() { return keypad_; }
     auto& get_video() { return video_; }
+    const auto& get_video() const { return video_; }
+    const auto& get_memory() const { return memory_; }
+    uint16_t get_pc() const { return pc_; }
+    Counters get_counters() const noexcept {
+      // ticks = everything loaded into the timers minus what is left, so
+      // the decrement path needs no bookkeeping
+      return {instructions_, draws_, timer_loads_ - get_delay_timer() - get_sound_timer()};
+    }
+
+    friend class Debugger;
   private:
+    // Hot state, everything a plain instruction reads or writes: first in
+    // the object and within one cache line (checked in the constructor),
+    // ahead of RAM and the framebuffer.
+    //
+    // The timers are evaluated lazily. Fx15/Fx18 store the tick (cycle_ /
+    // cycles_per_tick_) at which the timer reaches zero, its value at any
+    // later point is the distance to that tick. Nothing runs per instruction.
+    alignas(64) uint64_t cycle_{};
+    uint64_t delay_end_{};
+    uint64_t sound_end_{};
+    uint64_t instructions_{}; // counters, see get_counters()
+    uint32_t cycles_per_tick_{1};
+    uint16_t pc_{};
+    uint16_t index_{};
+    uint16_t opcode_{};
+    uint16_t dirty_pages_{}; // one bit per kPageSize block of memory_
+    std::array<uint8_t, 16> registers_{};
+    uint8_t sp_{};
+
+    // warm: calls, keys, draws
+    std::array<uint16_t, 16> stack_{};
+    std::array<uint8_t, 16> keypad_{};
     const uint16_t width_{};
     const uint16_t height_{};
+    uint64_t draws_{};
+    uint64_t timer_loads_{};
+    uint64_t fused_{};
+    uint64_t idle_{};
+    bool fusion_enabled_{true};
+    Rng rng_;
+
+    std::array<uint8_t, 4096> memory_{};
+    Frame video_{};
+    std::array<uint8_t, 4096> fusion_{}; // superinstruction tags, see below
 
-    static constexpr uint16_t kEntryPointAddr = 0x200;
     static constexpr uint16_t kFontSetAddr = 0x50;
+    static constexpr uint16_t kAddrMask = 0x0FFF; // addresses wrap at 4 KB
+    static constexpr uint16_t kPageSize = 256; // dirty tracking granularity
 
     static constexpr uint16_t kFontSetSize = 80;
     static constexpr std::array<uint8_t, kFontSetSize> kFontSet{
@@ -53,27 +166,44 @@ class Chip8 {
 	    0xF0, 0x80, 0xF0, 0x80, 0x80  // F
     };
 
-    std::array<uint8_t, 16> registers_{};
-    std::array<uint8_t, 4096> memory_{};
-
-    uint16_t index_{};
-    uint16_t pc_{};
-
-    std::array<uint16_t, 16> stack_{};
-    uint8_t sp_{};
-
-    uint8_t delay_timer_{};
-    uint8_t sound_timer_{};
+    uint64_t TickAt(uint64_t cycle) const noexcept { return cycle / cycles_per_tick_; }
+    uint8_t TimerAt(uint64_t end, uint64_t cycle) const noexcept {
+      const uint64_t tick = TickAt(cycle);
+      return (end > tick) ? static_cast<uint8_t>(end - tick) : 0u;
+    }
+    uint8_t TimerAt(uint64_t end) const noexcept { return TimerAt(end, cycle_); }
 
-    std::array<uint8_t, 16> keypad_{};
+    // Superinstructions. Run() looks up the tag of pc before decoding and
+    // executes the whole sequence starting there with one dispatch. The
+    // idioms are the most frequent ones in profiles of roms/ (tools/fusion.cc).
+    // Tags follow memory: every store, load or reset retags the addresses
+    // whose sequence covers a changed byte. No sequence contains a store, so
+    // the code can't change under one while it executes.
+    enum Fused : uint8_t {
+      kNotFused,
+      kJumpSelf,  // 1nnn to itself, an idle loop
+      kKeyWait,   // Ex9E/ExA1 with a 1nnn back to it after it or the skip
+      kTimerWait, // Fx07, 3xkk/4xkk on that Vx, 1nnn back to the Fx07
+      kImmPair,   // 6xkk/7xkk then 6xkk/7xkk
+      kAddSkip,   // 7xkk then 3xkk/4xkk
+      kDrawAdd,   // Dxyn then 7xkk
+      kSetDraw,   // Annn then Dxyn
+      kSetLoad,   // Annn then Fx65
+    };
+    static constexpr uint16_t kFusedSpan = 6; // bytes of the longest sequence
 
-    std::array<uint32_t, 64 * 32> video_{};
+    uint8_t Fuse(uint16_t addr) const noexcept;
+    // retag after bytes [addr, addr + size) changed
+    void Analyze(uint16_t addr, uint16_t size) noexcept;
 
-    uint16_t opcode_;
+    void Store(uint16_t addr, uint8_t value) noexcept {
+      addr &= kAddrMask;
+      memory_[addr] = value;
+      dirty_pages_ |= 1u << (addr / kPageSize);
+    }
 
-    //std::default_random_engine rand_gen_;
-    std::mt19937 rand_gen_;
-    std::uniform_int_distribution<uint8_t> rand_byte_;
+    // Dxyn on values, returns the collision flag
+    uint8_t Draw(uint8_t vx, uint8_t vy, uint8_t height, uint16_t index) noexcept;
 
     // opcodes
     void OP_00E0() noexcept;
@@ -118,26 +248,27 @@ class Chip8 {
 
     // function pointer table functions
     void Table0() {
-      (this->*(table_0_[opcode_ & 0x000Fu]))();
+      (this->*(kTable0[opcode_ & 0x000Fu]))();
     }
     void Table8() {
-      (this->*(table_8_[opcode_ & 0x000Fu]))();
+      (this->*(kTable8[opcode_ & 0x000Fu]))();
     }
     void TableE() {
-      (this->*(table_E_[opcode_ & 0x000Fu]))();
+      (this->*(kTableE[opcode_ & 0x000Fu]))();
     }
     void TableF() {
-      (this->*(table_F_[opcode_ & 0x00FFu]))();
+      (this->*(kTableF[opcode_ & 0x00FFu]))();
     }
     void OP_NULL() {}
 
-    // function pointer table
+    // function pointer tables, built at compile time and shared by every
+    // instance (defined in chip8.cc, the class must be complete)
     using instruction = void (Chip8::*)();
-    std::array<instruction, 0xF + 1> table_; // entire opcode unique
-    std::array<instruction, 0xE + 1> table_0_; // last digit unique
-    std::array<instruction, 0xE + 1> table_8_; // last digit unique
-    std::array<instruction, 0xE + 1> table_E_; // last digit unique
-    std::array<instruction, 0x65 + 1> table_F_; // last two unique
+    static const std::array<instruction, 0xF + 1> kTable; // entire opcode unique
+    static const std::array<instruction, 0xF + 1> kTable0; // last digit unique
+    static const std::array<instruction, 0xF + 1> kTable8; // last digit unique
+    static const std::array<instruction, 0xF + 1> kTableE; // last digit unique
+    static const std::array<instruction, 0xFF + 1> kTableF; // last two unique
 };
 
 } // namespace emu
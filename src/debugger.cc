@@ -0,0 +1,436 @@
+#include <cstdio>
+#include <sstream>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "debugger.h"
+
+namespace emu {
+
+namespace {
+
+std::string Hex(unsigned value, int width) {
+  char buffer[16];
+  std::snprintf(buffer, sizeof(buffer), "%0*X", width, value);
+  return buffer;
+}
+
+uint16_t ParseHex(const std::string& str) {
+  size_t end = 0;
+  unsigned long value = std::stoul(str, &end, 16);
+  if (end != str.size() || value > 0xFFFFu) {
+    throw std::invalid_argument("bad number: " + str);
+  }
+  return static_cast<uint16_t>(value);
+}
+
+} // namespace
+
+Debugger::Debugger(Chip8& chip8)
+    : chip8_(chip8) {}
+
+Debugger::~Debugger() {
+  if (in_fd_ > STDIN_FILENO && in_fd_ != listen_fd_) {
+    close(in_fd_);
+  }
+  if (listen_fd_ >= 0) {
+    close(listen_fd_);
+    unlink(socket_path_.c_str());
+  }
+}
+
+int Debugger::Open(const std::string& endpoint) {
+  if (endpoint == "-") {
+    in_fd_ = STDIN_FILENO;
+    out_fd_ = STDOUT_FILENO;
+    Stop("attach");
+    return 0;
+  }
+
+  sockaddr_un addr{};
+  if (endpoint.size() >= sizeof(addr.sun_path)) {
+    log::Error("debugger socket path too long: " + endpoint);
+    return 1;
+  }
+  listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (listen_fd_ < 0) {
+    log::Error("debugger socket() failed");
+    return 1;
+  }
+  addr.sun_family = AF_UNIX;
+  endpoint.copy(addr.sun_path, endpoint.size());
+  unlink(endpoint.c_str());
+  if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+      || listen(listen_fd_, 1) != 0) {
+    log::Error("can't listen on debugger socket: " + endpoint);
+    close(listen_fd_);
+    listen_fd_ = -1;
+    return 1;
+  }
+  socket_path_ = endpoint;
+  log::Info("debugger listening on " + endpoint);
+  // start paused so a client can set breakpoints before the first cycle
+  state_ = State::kPaused;
+  return 0;
+}
+
+void Debugger::Update(int cycles) {
+  Poll();
+  for (int i = 0; i < cycles && state_ != State::kPaused; ++i) {
+    Step();
+  }
+}
+
+void Debugger::Poll() {
+  // accept a client if we are serving a socket and nobody is connected
+  if (listen_fd_ >= 0 && in_fd_ < 0) {
+    int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK);
+    if (fd < 0) {
+      return;
+    }
+    in_fd_ = fd;
+    out_fd_ = fd;
+    Send(IsPaused() ? "stop: attach\n" + Registers() : "running\n");
+  }
+  if (in_fd_ < 0) {
+    return;
+  }
+
+  bool closed = false;
+  pollfd pfd{in_fd_, POLLIN, 0};
+  while (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLIN | POLLHUP)) != 0) {
+    char buffer[512];
+    ssize_t n = read(in_fd_, buffer, sizeof(buffer));
+    if (n <= 0) {
+      closed = true;
+      break;
+    }
+    input_.append(buffer, static_cast<size_t>(n));
+  }
+
+  size_t eol;
+  while ((eol = input_.find('\n')) != std::string::npos) {
+    std::string line = input_.substr(0, eol);
+    input_.erase(0, eol + 1);
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (!line.empty()) {
+      Execute(line);
+    }
+  }
+
+  if (closed) {
+    // the lines sent before the close ran above, an unterminated one is lost
+    input_.clear();
+    if (in_fd_ != STDIN_FILENO) {
+      // client went away, wait for the next one
+      close(in_fd_);
+    } else {
+      // nothing can attach to the console again, so nothing could resume
+      // the machine or clear a breakpoint: detach and let it run
+      breakpoints_.reset();
+      watches_.clear();
+      Resume(State::kRunning);
+      log::Info("debugger console closed, running");
+    }
+    in_fd_ = -1;
+    out_fd_ = -1;
+  }
+}
+
+void Debugger::Execute(const std::string& line) {
+  std::istringstream iss(line);
+  std::vector<std::string> args;
+  for (std::string arg; iss >> arg;) {
+    args.push_back(arg);
+  }
+  // a line of only blanks
+  if (args.empty()) {
+    return;
+  }
+  const std::string& cmd = args[0];
+
+  try {
+    if ((cmd == "b" || cmd == "d") && args.size() == 2) {
+      uint16_t addr = ParseHex(args[1]) & 0x0FFFu;
+      breakpoints_.set(addr, cmd == "b");
+    } else if (cmd == "w" || cmd == "uw") {
+      Watch watch{};
+      if (!ParseWatch(args, watch)) {
+        Send("error: usage: " + cmd + " mem ADDR | v X | i\n");
+        return;
+      }
+      auto it = watches_.begin();
+      for (; it != watches_.end(); ++it) {
+        if (it->kind == watch.kind && it->target == watch.target) {
+          break;
+        }
+      }
+      if (cmd == "w" && it == watches_.end()) {
+        watch.last = ReadWatch(watch);
+        watches_.push_back(watch);
+      } else if (cmd == "uw" && it != watches_.end()) {
+        watches_.erase(it);
+      }
+    } else if (cmd == "s") {
+      steps_ = (args.size() > 1) ? ParseHex(args[1]) : 1;
+      if (steps_ == 0) {
+        steps_ = 1;
+      }
+      Resume(State::kStepping);
+    } else if (cmd == "n") {
+      uint16_t pc = chip8_.pc_;
+      uint16_t opcode = (chip8_.memory_[pc & 0x0FFFu] << 8u)
+          | chip8_.memory_[(pc + 1) & 0x0FFFu];
+      if ((opcode & 0xF000u) == 0x2000u) {
+        over_pc_ = pc + 2;
+        over_sp_ = chip8_.sp_;
+        Resume(State::kStepOver);
+      } else {
+        steps_ = 1;
+        Resume(State::kStepping);
+      }
+    } else if (cmd == "c") {
+      Resume(State::kRunning);
+    } else if (cmd == "p") {
+      if (!IsPaused()) {
+        Stop("pause");
+      }
+    } else if (cmd == "r") {
+      Send(Registers());
+    } else if (cmd == "bt") {
+      Send(Stack());
+    } else if (cmd == "x" && args.size() >= 2) {
+      uint16_t addr = ParseHex(args[1]);
+      uint16_t len = (args.size() > 2) ? ParseHex(args[2]) : 0x10u;
+      std::string out;
+      for (uint16_t i = 0; i < len; ++i) {
+        uint16_t a = (addr + i) & 0x0FFFu;
+        if (i % 16 == 0) {
+          out += (i ? "\n" : "") + Hex(a, 3) + ":";
+        }
+        out += " " + Hex(chip8_.memory_[a], 2);
+      }
+      Send(out + "\n");
+    } else if (cmd == "l") {
+      std::string out;
+      for (size_t addr = 0; addr < breakpoints_.size(); ++addr) {
+        if (breakpoints_.test(addr)) {
+          out += "b " + Hex(static_cast<unsigned>(addr), 3) + "\n";
+        }
+      }
+      for (const auto& watch : watches_) {
+        switch (watch.kind) {
+          case Watch::Kind::kMemory:
+            out += "w mem " + Hex(watch.target, 3) + "\n"; break;
+          case Watch::Kind::kRegister:
+            out += "w v " + Hex(watch.target, 1) + "\n"; break;
+          case Watch::Kind::kIndex:
+            out += "w i\n"; break;
+        }
+      }
+      Send(out);
+    } else if (cmd == "h") {
+      Send("b ADDR, d ADDR, w|uw mem ADDR|v X|i, s [N], n, c, p, r, bt, "
+           "x ADDR [LEN], l, h\n");
+    } else {
+      Send("error: unknown command: " + line + "\n");
+      return;
+    }
+  } catch (std::exception& e) {
+    Send(std::string("error: ") + e.what() + "\n");
+    return;
+  }
+  Send("ok\n");
+}
+
+void Debugger::Step() {
+  // breakpoints fire before the instruction runs, but not on the one we
+  // are resuming from
+  if (!resuming_ && breakpoints_.test(chip8_.pc_ & 0x0FFFu)) {
+    Stop("breakpoint " + Hex(chip8_.pc_, 3));
+    return;
+  }
+  resuming_ = false;
+
+  chip8_.Cycle();
+
+  if (CheckWatchpoints()) {
+    return;
+  }
+  if (state_ == State::kStepping && --steps_ <= 0) {
+    Stop("step");
+  } else if (state_ == State::kStepOver
+      && chip8_.pc_ == over_pc_ && chip8_.sp_ == over_sp_) {
+    Stop("step");
+  }
+}
+
+bool Debugger::CheckWatchpoints() {
+  for (auto& watch : watches_) {
+    uint16_t value = ReadWatch(watch);
+    if (value == watch.last) {
+      continue;
+    }
+    std::string what;
+    switch (watch.kind) {
+      case Watch::Kind::kMemory: what = "mem " + Hex(watch.target, 3); break;
+      case Watch::Kind::kRegister: what = "v" + Hex(watch.target, 1); break;
+      case Watch::Kind::kIndex: what = "i"; break;
+    }
+    std::string reason = "watch " + what + " " + Hex(watch.last, 2)
+        + " -> " + Hex(value, 2);
+    watch.last = value;
+    Stop(reason);
+    return true;
+  }
+  return false;
+}
+
+void Debugger::Stop(const std::string& reason) {
+  state_ = State::kPaused;
+  Send("stop: " + reason + "\n" + Registers());
+}
+
+void Debugger::Resume(State state) {
+  state_ = state;
+  resuming_ = true;
+}
+
+uint16_t Debugger::ReadWatch(const Watch& watch) const noexcept {
+  switch (watch.kind) {
+    case Watch::Kind::kMemory: return chip8_.memory_[watch.target];
+    case Watch::Kind::kRegister: return chip8_.registers_[watch.target];
+    case Watch::Kind::kIndex: return chip8_.index_;
+  }
+  return 0;
+}
+
+bool Debugger::ParseWatch(
+    const std::vector<std::string>& args, Watch& watch) const {
+  if (args.size() == 2 && args[1] == "i") {
+    watch.kind = Watch::Kind::kIndex;
+    watch.target = 0;
+    return true;
+  }
+  if (args.size() != 3) {
+    return false;
+  }
+  if (args[1] == "mem") {
+    watch.kind = Watch::Kind::kMemory;
+    watch.target = ParseHex(args[2]) & 0x0FFFu;
+    return true;
+  }
+  if (args[1] == "v") {
+    watch.kind = Watch::Kind::kRegister;
+    watch.target = ParseHex(args[2]) & 0x000Fu;
+    return true;
+  }
+  return false;
+}
+
+std::string Debugger::Registers() const {
+  uint16_t pc = chip8_.pc_;
+  uint16_t opcode = (chip8_.memory_[pc & 0x0FFFu] << 8u)
+      | chip8_.memory_[(pc + 1) & 0x0FFFu];
+  std::string out = "pc=" + Hex(pc, 3)
+      + " i=" + Hex(chip8_.index_, 3)
+      + " sp=" + Hex(chip8_.sp_, 1)
+      + " dt=" + Hex(chip8_.get_delay_timer(), 2)
+      + " st=" + Hex(chip8_.get_sound_timer(), 2) + "\n";
+  for (uint8_t i = 0; i < 16; ++i) {
+    out += "v" + Hex(i, 1) + "=" + Hex(chip8_.registers_[i], 2)
+        + (i == 15 ? "\n" : " ");
+  }
+  out += Hex(pc, 3) + ": " + Hex(opcode, 4) + "  " + Disassemble(opcode) + "\n";
+  return out;
+}
+
+std::string Debugger::Stack() const {
+  std::string out;
+  for (int i = chip8_.sp_ - 1; i >= 0; --i) {
+    out += "#" + std::to_string(chip8_.sp_ - 1 - i) + " "
+        + Hex(chip8_.stack_[i & 0xF], 3) + "\n";
+  }
+  return out;
+}
+
+void Debugger::Send(const std::string& text) {
+  if (out_fd_ < 0) {
+    return;
+  }
+  size_t done = 0;
+  while (done < text.size()) {
+    // no SIGPIPE if a socket client disconnects mid write
+    ssize_t n = (out_fd_ == STDOUT_FILENO)
+        ? write(out_fd_, text.data() + done, text.size() - done)
+        : send(out_fd_, text.data() + done, text.size() - done, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return;
+    }
+    done += static_cast<size_t>(n);
+  }
+}
+
+std::string Debugger::Disassemble(uint16_t opcode) {
+  const std::string x = "V" + Hex((opcode >> 8u) & 0xFu, 1);
+  const std::string y = "V" + Hex((opcode >> 4u) & 0xFu, 1);
+  const std::string nnn = Hex(opcode & 0x0FFFu, 3);
+  const std::string kk = Hex(opcode & 0x00FFu, 2);
+  switch (opcode >> 12u) {
+    case 0x0:
+      if (opcode == 0x00E0u) return "CLS";
+      if (opcode == 0x00EEu) return "RET";
+      return "SYS " + nnn;
+    case 0x1: return "JP " + nnn;
+    case 0x2: return "CALL " + nnn;
+    case 0x3: return "SE " + x + ", " + kk;
+    case 0x4: return "SNE " + x + ", " + kk;
+    case 0x5: return "SE " + x + ", " + y;
+    case 0x6: return "LD " + x + ", " + kk;
+    case 0x7: return "ADD " + x + ", " + kk;
+    case 0x8:
+      switch (opcode & 0xFu) {
+        case 0x0: return "LD " + x + ", " + y;
+        case 0x1: return "OR " + x + ", " + y;
+        case 0x2: return "AND " + x + ", " + y;
+        case 0x3: return "XOR " + x + ", " + y;
+        case 0x4: return "ADD " + x + ", " + y;
+        case 0x5: return "SUB " + x + ", " + y;
+        case 0x6: return "SHR " + x;
+        case 0x7: return "SUBN " + x + ", " + y;
+        case 0xE: return "SHL " + x;
+      }
+      break;
+    case 0x9: return "SNE " + x + ", " + y;
+    case 0xA: return "LD I, " + nnn;
+    case 0xB: return "JP V0, " + nnn;
+    case 0xC: return "RND " + x + ", " + kk;
+    case 0xD: return "DRW " + x + ", " + y + ", " + Hex(opcode & 0xFu, 1);
+    case 0xE:
+      if ((opcode & 0xFFu) == 0x9Eu) return "SKP " + x;
+      if ((opcode & 0xFFu) == 0xA1u) return "SKNP " + x;
+      break;
+    case 0xF:
+      switch (opcode & 0xFFu) {
+        case 0x07: return "LD " + x + ", DT";
+        case 0x0A: return "LD " + x + ", K";
+        case 0x15: return "LD DT, " + x;
+        case 0x18: return "LD ST, " + x;
+        case 0x1E: return "ADD I, " + x;
+        case 0x29: return "LD F, " + x;
+        case 0x33: return "LD B, " + x;
+        case 0x55: return "LD [I], " + x;
+        case 0x65: return "LD " + x + ", [I]";
+      }
+      break;
+  }
+  return "DW " + Hex(opcode, 4);
+}
+
+} // namespace emu
@@ -0,0 +1,103 @@
+#ifndef EMU_DEBUGGER_H_
+#define EMU_DEBUGGER_H_
+
+#include <bitset>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "chip8.h"
+
+namespace emu {
+
+// Interactive debugger. It owns its own execution loop (Update) that wraps
+// Chip8::Cycle() with the breakpoint and watchpoint checks, so the normal
+// path through the engine does not carry any of them.
+//
+// Driven by a line based text protocol, either on stdin/stdout or on a unix
+// domain socket. Every command is answered with its output followed by a
+// line "ok" or "error: <reason>"; stops are reported asynchronously as a
+// line "stop: <reason>" followed by the register view. Numbers are hex.
+//
+//   b ADDR / d ADDR            set / delete a pc breakpoint
+//   w mem ADDR | v X | i       watch a memory byte, a register or I
+//   uw mem ADDR | v X | i      remove a watchpoint
+//   s [N]                      step N instructions (default 1)
+//   n                          step, running a 2nnn call to its return
+//   c / p                      continue / pause
+//   r                          registers
+//   bt                         call stack
+//   x ADDR [LEN]               dump memory
+//   l                          list breakpoints and watchpoints
+//   h                          help
+class Debugger {
+  public:
+    explicit Debugger(Chip8& chip8);
+    ~Debugger();
+
+    Debugger(const Debugger& rhs) = delete;
+    Debugger(const Debugger&& rhs) = delete;
+    Debugger& operator=(const Debugger& rhs) = delete;
+    Debugger& operator=(const Debugger&& rhs) = delete;
+
+    // "-" for the console, anything else is a unix socket path; when the
+    // console closes the debugger detaches and the machine runs on
+    [[nodiscard]] int Open(const std::string& endpoint);
+
+    // read pending commands, then run up to cycles instructions
+    void Update(int cycles);
+
+    [[nodiscard]] bool IsPaused() const noexcept { return state_ == State::kPaused; }
+
+    static std::string Disassemble(uint16_t opcode);
+  private:
+    enum class State {
+      kRunning,
+      kPaused,
+      kStepping,
+      kStepOver,
+    };
+
+    struct Watch {
+      enum class Kind { kMemory, kRegister, kIndex } kind;
+      uint16_t target;
+      uint16_t last;
+    };
+
+    void Poll();
+    void Execute(const std::string& line);
+    void Step();
+    [[nodiscard]] bool CheckWatchpoints();
+    void Stop(const std::string& reason);
+    void Resume(State state);
+
+    [[nodiscard]] uint16_t ReadWatch(const Watch& watch) const noexcept;
+    [[nodiscard]] bool ParseWatch(
+        const std::vector<std::string>& args, Watch& watch) const;
+
+    std::string Registers() const;
+    std::string Stack() const;
+    void Send(const std::string& text);
+
+    Chip8& chip8_;
+
+    State state_{State::kPaused};
+    bool resuming_{false};
+    int steps_{};
+    uint16_t over_pc_{};
+    uint8_t over_sp_{};
+
+    std::bitset<4096> breakpoints_;
+    std::vector<Watch> watches_;
+
+    // transport
+    int listen_fd_{-1};
+    int in_fd_{-1};
+    int out_fd_{-1};
+    std::string socket_path_;
+    std::string input_;
+};
+
+} // namespace emu
+
+#endif // EMU_DEBUGGER_H_
@@ -1,3 +1,6 @@
+#include <chrono>
+#include <cstdlib>
+
 #include "engine.h"
 
 namespace emu {
@@ -6,9 +9,12 @@ SDL_Event Engine::event_{};
 bool Engine::running_ = false;
 
 Engine::Engine()
-    : chip8_(new Chip8{64, 32}) {}
+    : seed_(static_cast<uint64_t>(
+          std::chrono::steady_clock::now().time_since_epoch().count())) {}
 
 Engine::~Engine() {
+  capture_.Close();
+
   if (Window::window_ != nullptr) {
     SDL_DestroyWindow(Window::window_);
   }
@@ -22,13 +28,20 @@ Engine::~Engine() {
   SDL_Quit();
 }
 
-int Engine::Init(const std::string& title, int x, int y, int w, int h, int scale, bool full_screen) {
+int Engine::Init(
+    const std::string& title,
+    int x, int y,
+    int w, int h,
+    int scale,
+    bool full_screen,
+    int vsync_hz) {
   // set window value
   Window::x_ = x;
   Window::y_ = y;
   Window::w_ = w;
   Window::h_ = h;
   Window::scale_ = scale;
+  title_ = title;
 
   // init sdl
   if (SDL_Init(SDL_INIT_VIDEO) > 0) {
@@ -51,15 +64,30 @@ int Engine::Init(const std::string& title, int x, int y, int w, int h, int scale
     return 1;
   }
 
-  // create renderer
+  // create renderer, synced to the display only if it refreshes at the
+  // rate we want, vsync on a 144 Hz monitor would run the game too fast
+  Uint32 renderer_flags = SDL_RENDERER_ACCELERATED;
+  if (vsync_hz != 0) {
+    SDL_DisplayMode mode{};
+    int display = SDL_GetWindowDisplayIndex(Window::window_);
+    if (display >= 0 && SDL_GetCurrentDisplayMode(display, &mode) == 0
+        && std::abs(mode.refresh_rate - vsync_hz) <= 1) {
+      renderer_flags |= SDL_RENDERER_PRESENTVSYNC;
+    } else {
+      log::Info("display is not at " + std::to_string(vsync_hz) + " Hz, pacing on the timer");
+    }
+  }
   Window::renderer_ = SDL_CreateRenderer(
       Window::window_,
       -1,
-      SDL_RENDERER_ACCELERATED);
+      renderer_flags);
   if (Window::renderer_ == nullptr) {
     log::SdlError("SDL_CreateRenderer failed!");
     return 1;
   }
+  SDL_RendererInfo info{};
+  vsync_ = SDL_GetRendererInfo(Window::renderer_, &info) == 0
+      && (info.flags & SDL_RENDERER_PRESENTVSYNC) != 0;
   SDL_SetRenderDrawColor(Window::renderer_, 0, 0, 0, 255);
   // create texture
   Window::texture_ = SDL_CreateTexture(
@@ -73,7 +101,9 @@ int Engine::Init(const std::string& title, int x, int y, int w, int h, int scale
   }
 
   // set pitch
-  video_pitch_ = sizeof(chip8_->get_video()[0]) * Window::w_;
+  video_pitch_ = sizeof(pixels_[0]) * Window::w_;
+
+  UpdateTitle();
 
   // ready to run!
   running_ = true;
@@ -81,101 +111,278 @@ int Engine::Init(const std::string& title, int x, int y, int w, int h, int scale
   return 0;
 }
 
+int Engine::EnableFilter(const Filter::Config& config) {
+  filter_.reset(new Filter{config});
+
+  // the texture now holds the filtered output at its final size
+  if (Window::texture_ != nullptr) {
+    SDL_DestroyTexture(Window::texture_);
+  }
+  Window::texture_ = SDL_CreateTexture(
+      Window::renderer_,
+      SDL_PIXELFORMAT_RGBA8888,
+      SDL_TEXTUREACCESS_STREAMING,
+      filter_->get_width(), filter_->get_height());
+  if (Window::texture_ == nullptr) {
+    log::SdlError("SDL_CreateTexture failed!");
+    return 1;
+  }
+
+  return 0;
+}
+
 void Engine::HandleEvents() {
+  if (watcher_.IsOpen()) {
+    ReloadChanged();
+  }
+  // with netplay the machine's keypad belongs to the rollback, it gets the
+  // local keys mixed with the remote ones frame by frame
+  auto keypad = [this]() -> std::array<uint8_t, 16>& {
+    return netplay_.IsOpen() ? keys_ : chip8_->get_keypad();
+  };
   while (SDL_PollEvent(&event_)) {
     if (event_.type == SDL_QUIT) {
       running_ = false;
+    } else if (event_.type == SDL_WINDOWEVENT) {
+      switch (event_.window.event) {
+        case SDL_WINDOWEVENT_HIDDEN:
+        case SDL_WINDOWEVENT_MINIMIZED:
+          visible_ = false; break;
+        case SDL_WINDOWEVENT_SHOWN:
+        case SDL_WINDOWEVENT_EXPOSED:
+        case SDL_WINDOWEVENT_RESTORED:
+          visible_ = true; break;
+      }
     } else if (event_.type == SDL_KEYDOWN) {
       switch (event_.key.keysym.sym) {
         case SDLK_ESCAPE:
           running_ = false; break;
+        case SDLK_TAB:
+          turbo_ = true; break;
+        case SDLK_F1: case SDLK_F2: case SDLK_F3: case SDLK_F4:
+        case SDLK_F5: case SDLK_F6: case SDLK_F7: case SDLK_F8:
+        case SDLK_F9: case SDLK_F10: case SDLK_F11: case SDLK_F12:
+          Switch(static_cast<size_t>(event_.key.keysym.sym - SDLK_F1)); break;
         case SDLK_x:
-          chip8_->get_keypad()[0x0] = 1; break;
+          keypad()[0x0] = 1; break;
         case SDLK_1:
-          chip8_->get_keypad()[0x1] = 1; break;
+          keypad()[0x1] = 1; break;
         case SDLK_2:
-          chip8_->get_keypad()[0x2] = 1; break;
+          keypad()[0x2] = 1; break;
         case SDLK_3:
-          chip8_->get_keypad()[0x3] = 1; break;
+          keypad()[0x3] = 1; break;
         case SDLK_q:
-          chip8_->get_keypad()[0x4] = 1; break;
+          keypad()[0x4] = 1; break;
         case SDLK_w:
-          chip8_->get_keypad()[0x5] = 1; break;
+          keypad()[0x5] = 1; break;
         case SDLK_e:
-          chip8_->get_keypad()[0x6] = 1; break;
+          keypad()[0x6] = 1; break;
         case SDLK_a:
-          chip8_->get_keypad()[0x7] = 1; break;
+          keypad()[0x7] = 1; break;
         case SDLK_s:
-          chip8_->get_keypad()[0x8] = 1; break;
+          keypad()[0x8] = 1; break;
         case SDLK_d:
-          chip8_->get_keypad()[0x9] = 1; break;
+          keypad()[0x9] = 1; break;
         case SDLK_z:
-          chip8_->get_keypad()[0xA] = 1; break;
+          keypad()[0xA] = 1; break;
         case SDLK_c:
-          chip8_->get_keypad()[0xB] = 1; break;
+          keypad()[0xB] = 1; break;
         case SDLK_4:
-          chip8_->get_keypad()[0xC] = 1; break;
+          keypad()[0xC] = 1; break;
         case SDLK_r:
-          chip8_->get_keypad()[0xD] = 1; break;
+          keypad()[0xD] = 1; break;
         case SDLK_f:
-          chip8_->get_keypad()[0xE] = 1; break;
+          keypad()[0xE] = 1; break;
         case SDLK_v:
-          chip8_->get_keypad()[0xF] = 1; break;
+          keypad()[0xF] = 1; break;
       }
     } else if (event_.type == SDL_KEYUP) {
       switch (event_.key.keysym.sym) {
+        case SDLK_TAB:
+          turbo_ = false; break;
         case SDLK_x:
-          chip8_->get_keypad()[0x0] = 0; break;
+          keypad()[0x0] = 0; break;
         case SDLK_1:
-          chip8_->get_keypad()[0x1] = 0; break;
+          keypad()[0x1] = 0; break;
         case SDLK_2:
-          chip8_->get_keypad()[0x2] = 0; break;
+          keypad()[0x2] = 0; break;
         case SDLK_3:
-          chip8_->get_keypad()[0x3] = 0; break;
+          keypad()[0x3] = 0; break;
         case SDLK_q:
-          chip8_->get_keypad()[0x4] = 0; break;
+          keypad()[0x4] = 0; break;
         case SDLK_w:
-          chip8_->get_keypad()[0x5] = 0; break;
+          keypad()[0x5] = 0; break;
         case SDLK_e:
-          chip8_->get_keypad()[0x6] = 0; break;
+          keypad()[0x6] = 0; break;
         case SDLK_a:
-          chip8_->get_keypad()[0x7] = 0; break;
+          keypad()[0x7] = 0; break;
         case SDLK_s:
-          chip8_->get_keypad()[0x8] = 0; break;
+          keypad()[0x8] = 0; break;
         case SDLK_d:
-          chip8_->get_keypad()[0x9] = 0; break;
+          keypad()[0x9] = 0; break;
         case SDLK_z:
-          chip8_->get_keypad()[0xA] = 0; break;
+          keypad()[0xA] = 0; break;
         case SDLK_c:
-          chip8_->get_keypad()[0xB] = 0; break;
+          keypad()[0xB] = 0; break;
         case SDLK_4:
-          chip8_->get_keypad()[0xC] = 0; break;
+          keypad()[0xC] = 0; break;
         case SDLK_r:
-          chip8_->get_keypad()[0xD] = 0; break;
+          keypad()[0xD] = 0; break;
         case SDLK_f:
-          chip8_->get_keypad()[0xE] = 0; break;
+          keypad()[0xE] = 0; break;
         case SDLK_v:
-          chip8_->get_keypad()[0xF] = 0; break;
+          keypad()[0xF] = 0; break;
+      }
+    }
+  }
+}
+
+void Engine::LoadRom(const std::string& file) {
+  size_t slot = session_.Add(file, seed_ + session_.size());
+  session_.get_slot(slot).chip8->set_cycles_per_tick(cycles_per_frame_);
+  exporter_.Add(session_.get_slot(slot).metrics.get());
+  if (chip8_ == nullptr) {
+    chip8_ = session_.get_active().chip8.get();
+  }
+}
+
+void Engine::set_cycles_per_frame(uint32_t cycles) noexcept {
+  cycles_per_frame_ = cycles;
+  for (size_t i = 0; i < session_.size(); ++i) {
+    session_.get_slot(i).chip8->set_cycles_per_tick(cycles);
+  }
+}
+
+void Engine::Switch(size_t slot) {
+  // the peer runs the same game, always
+  if (netplay_.IsOpen() || slot == session_.get_active_index() || !session_.Switch(slot)) {
+    return;
+  }
+  // keys held down now would stay pressed in the frozen machine
+  chip8_->get_keypad().fill(0);
+  chip8_ = session_.get_active().chip8.get();
+  UpdateTitle();
+}
+
+int Engine::StartPublish(const std::string& name) {
+  if (publisher_.Open(name, static_cast<uint32_t>(session_.size())) != 0) {
+    return 1;
+  }
+  // the machines in the background don't run, their slots hold the frame
+  // they were left at
+  for (size_t i = 0; i < session_.size(); ++i) {
+    publisher_.Publish(static_cast<uint32_t>(i), session_.get_slot(i).chip8->get_video());
+  }
+  return 0;
+}
+
+int Engine::StartWatch() {
+  for (size_t i = 0; i < session_.size(); ++i) {
+    if (watcher_.Add(session_.get_slot(i).file) != 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void Engine::ReloadChanged() {
+  for (const auto& file : watcher_.Poll()) {
+    for (size_t i = 0; i < session_.size(); ++i) {
+      if (session_.get_slot(i).file != file) {
+        continue;
+      }
+      const auto start = std::chrono::steady_clock::now();
+      try {
+        const size_t patched = session_.Reload(i);
+        const auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        log::Info("reloaded " + session_.get_slot(i).name + ": "
+            + std::to_string(patched) + " bytes patched in " + std::to_string(us) + " us");
+      } catch (std::exception& e) {
+        // a half written file, the next save will do
+        log::Warning(std::string{"reload failed: "} + e.what());
       }
     }
   }
 }
 
+void Engine::UpdateTitle() {
+  if (Window::window_ != nullptr && session_.size() > 1) {
+    SDL_SetWindowTitle(Window::window_, (title_ + " - " + session_.get_active().name).c_str());
+  }
+}
+
 void Engine::Update() {
-  chip8_->Cycle();
+  Step();
+  Upload();
+}
+
+int Engine::StartNetplay(const Netplay::Config& config) {
+  keys_.fill(0);
+  return netplay_.Open(config, *chip8_);
+}
+
+void Engine::Step() {
+  if (netplay_.IsOpen()) {
+    uint16_t keys = 0;
+    for (uint8_t key = 0; key < 16; ++key) {
+      keys |= static_cast<uint16_t>(keys_[key] << key);
+    }
+    // a stalled frame is shown again, it ran nothing
+    if (netplay_.Advance(keys)) {
+      session_.get_active().metrics->Update(chip8_->get_counters());
+    }
+    return;
+  }
+  // the debugger runs its own checked loop, the plain path has no checks
+  if (debugger_ != nullptr && debugged_ == chip8_) {
+    debugger_->Update(static_cast<int>(cycles_per_frame_));
+  } else {
+    chip8_->Run(cycles_per_frame_);
+  }
+  session_.get_active().metrics->Update(chip8_->get_counters());
+}
+
+void Engine::Upload() {
+  if (filter_ != nullptr) {
+    void* pixels = nullptr;
+    int pitch = 0;
+    if (SDL_LockTexture(Window::texture_, nullptr, &pixels, &pitch) == 0) {
+      filter_->Apply(chip8_->get_video(), static_cast<uint8_t*>(pixels), pitch);
+      SDL_UnlockTexture(Window::texture_);
+    }
+    return;
+  }
+  ExpandFrame(chip8_->get_video(), pixels_.data());
   SDL_UpdateTexture(
       Window::texture_,
       nullptr,
-      static_cast<void*>(chip8_->get_video().data()),
+      static_cast<void*>(pixels_.data()),
       video_pitch_);
 }
 
+void Engine::DisableVsync() {
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+  SDL_RenderSetVSync(Window::renderer_, 0);
+#endif
+  vsync_ = false;
+}
+
 void Engine::Render() {
-  SDL_RenderClear(Window::renderer_);
+  // nobody is watching a hidden window
+  if (visible_) {
+    SDL_RenderClear(Window::renderer_);
+
+    SDL_RenderCopy(Window::renderer_, Window::texture_, nullptr, nullptr);
 
-  SDL_RenderCopy(Window::renderer_, Window::texture_, nullptr, nullptr);
+    SDL_RenderPresent(Window::renderer_);
+  }
 
-  SDL_RenderPresent(Window::renderer_);
+  // tap the frame that was just presented
+  capture_.Push(chip8_->get_video());
+  if (publisher_.IsOpen()) {
+    publisher_.Publish(static_cast<uint32_t>(session_.get_active_index()), chip8_->get_video());
+  }
 }
 
 } // namespace emu
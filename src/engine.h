@@ -9,6 +9,14 @@
 
 #include "window.h"
 #include "chip8.h"
+#include "capture.h"
+#include "filter.h"
+#include "debugger.h"
+#include "shm.h"
+#include "metrics.h"
+#include "session.h"
+#include "netplay.h"
+#include "watch.h"
 
 namespace emu {
 
@@ -27,24 +35,115 @@ class Engine {
         int x, int y,
         int w, int h,
         int scale,
-        bool full_screen);
+        bool full_screen,
+        int vsync_hz = 0);
 
-    void LoadRom(const std::string& file) {
-      chip8_->LoadRom(file);
+    // every ROM gets its own resident machine, the first one runs
+    void LoadRom(const std::string& file);
+    void Seed(uint64_t seed) {
+      chip8_->Seed(seed);
     }
+    // make a loaded ROM the running one (F1..F12), the others are frozen
+    void Switch(size_t slot);
+    // instructions executed per Update(), i.e. per frame; the timers tick
+    // once per frame whatever the value
+    void set_cycles_per_frame(uint32_t cycles) noexcept;
+
+    // after Init, switches the upload path to the CPU filter
+    [[nodiscard]] int EnableFilter(const Filter::Config& config);
+
+    // "-" for a console on stdin, otherwise a unix socket path
+    // the debugger stays with the machine active when it is attached
+    [[nodiscard]] int AttachDebugger(const std::string& endpoint) {
+      debugger_.reset(new Debugger{*chip8_});
+      debugged_ = chip8_;
+      return debugger_->Open(endpoint);
+    }
+
+    [[nodiscard]] int StartCapture(const std::string& file) {
+      return capture_.Open(file);
+    }
+
+    // two player rollback netplay on the active machine, before it ran a
+    // frame; one Step() is one netplay frame from then on, see src/netplay.h
+    [[nodiscard]] int StartNetplay(const Netplay::Config& config);
+    [[nodiscard]] const Netplay& get_netplay() const noexcept { return netplay_; }
+
+    // reload the ROM files when they are saved, patching the running
+    // machines in place instead of restarting them (checked every frame)
+    [[nodiscard]] int StartWatch();
+
+    // presents block on a display refreshing at the vsync_hz given to Init
+    [[nodiscard]] bool HasVsync() const noexcept { return vsync_; }
+    void DisableVsync();
+
+    // "unix:PATH" for a socket dump, otherwise a Prometheus text file
+    // one instance per loaded ROM
+    [[nodiscard]] int StartMetrics(const std::string& target) {
+      return exporter_.Open(target);
+    }
+    [[nodiscard]] const Metrics& get_metrics() noexcept {
+      return *session_.get_active().metrics;
+    }
+    // called by the main loop once a frame is presented, for the machine
+    // that is running
+    void RecordFrame(uint64_t ns, bool late) noexcept {
+      session_.get_active().metrics->RecordFrame(ns, late);
+    }
+    void RecordJitter(uint64_t ns) noexcept {
+      session_.get_active().metrics->RecordJitter(ns);
+    }
+
+    // shared memory framebuffers for other processes, see src/shm.h: slot
+    // i holds the frames of the i-th ROM loaded, call after the last one
+    [[nodiscard]] int StartPublish(const std::string& name);
 
     void HandleEvents();
+    // Step() then Upload()
     void Update();
+    // emulate one frame, nothing is drawn
+    void Step();
+    // expand the current frame into the texture
+    void Upload();
     void Render();
 
+    // the turbo key (Tab) is held
+    [[nodiscard]] bool IsTurbo() const noexcept { return turbo_; }
+    // the window is neither hidden nor minimized
+    [[nodiscard]] bool IsVisible() const noexcept { return visible_; }
+
     [[nodiscard]] bool IsRunning() noexcept { return running_; };
   private:
     static bool running_;
 
     static SDL_Event event_;
 
-    std::unique_ptr<Chip8> chip8_;
+    void UpdateTitle();
+    void ReloadChanged();
+
+    Session session_;
+    Chip8* chip8_{nullptr}; // the active machine, owned by session_
+    uint64_t seed_;
+    std::string title_;
+    std::array<uint32_t, kFrameWidth * kFrameHeight> pixels_{};
     int video_pitch_;
+    uint32_t cycles_per_frame_{1};
+    bool vsync_{false};
+    bool turbo_{false};
+    bool visible_{true};
+
+    std::unique_ptr<Filter> filter_;
+    std::unique_ptr<Debugger> debugger_;
+    Chip8* debugged_{nullptr};
+
+    Capture capture_;
+    ShmPublisher publisher_;
+
+    FileWatcher watcher_;
+    Netplay netplay_;
+    std::array<uint8_t, 16> keys_{}; // the local keypad while netplay runs
+
+    MetricsExporter exporter_; // after session_, it reads the metrics until closed
 };
 
 } // namespace emu
@@ -0,0 +1,127 @@
+#include <limits>
+
+#include "env.h"
+
+namespace emu {
+
+Env::Env(const std::vector<uint8_t>& rom, size_t instances, const Config& config)
+    : rom_(rom),
+      config_(config),
+      count_(instances),
+      machines_(new Chip8[instances]),
+      sticky_rng_(instances),
+      last_action_(instances),
+      score_(instances),
+      frames_(instances),
+      rewards_(instances),
+      dones_(instances) {
+  if (rom_.size() > Chip8::kMaxRomSize) {
+    throw std::runtime_error("ROM too large: " + std::to_string(rom_.size()) + " bytes");
+  }
+  // a step of no cycles never advances, and the product is what Step() runs
+  if (config_.frame_skip < 1 || config_.cycles_per_frame < 1
+      || config_.frame_skip > std::numeric_limits<int>::max() / config_.cycles_per_frame) {
+    throw std::invalid_argument("bad frame_skip / cycles_per_frame: "
+        + std::to_string(config_.frame_skip) + " / " + std::to_string(config_.cycles_per_frame));
+  }
+  // written so that NaN fails too
+  if (!(config_.sticky >= 0.0f && config_.sticky <= 1.0f)) {
+    throw std::invalid_argument("sticky not in [0, 1]: " + std::to_string(config_.sticky));
+  }
+  for (const auto& reward : config_.rewards) {
+    if (reward.kind != Reward::Kind::kByte && reward.kind != Reward::Kind::kBcd) {
+      throw std::invalid_argument("unknown reward kind: "
+          + std::to_string(static_cast<int>(reward.kind)));
+    }
+  }
+  // 60 Hz timers, one tick per emulated frame
+  for (size_t i = 0; i < count_; ++i) {
+    machines_[i].set_cycles_per_tick(static_cast<uint32_t>(config_.cycles_per_frame));
+  }
+  Reset(0);
+}
+
+Env::~Env() {}
+
+void Env::Reset(uint64_t seed) noexcept {
+  for (size_t i = 0; i < count_; ++i) {
+    Reset(i, seed + i);
+  }
+}
+
+void Env::Reset(size_t instance, uint64_t seed) noexcept {
+  Chip8& chip8 = machines_[instance];
+  chip8.Reset(seed);
+  chip8.LoadRom(rom_.data(), rom_.size());
+  sticky_rng_[instance].Seed(~seed);
+  last_action_[instance] = 0;
+  score_[instance] = Score(chip8);
+  frames_[instance] = 0;
+  rewards_[instance] = 0.0f;
+  dones_[instance] = 0;
+}
+
+void Env::Step(const uint16_t* actions) noexcept {
+  // sticky actions compare against a byte, 256 levels are plenty
+  const unsigned sticky = static_cast<unsigned>(config_.sticky * 256.0f);
+  const int cycles = config_.frame_skip * config_.cycles_per_frame;
+
+  for (size_t i = 0; i < count_; ++i) {
+    Chip8& chip8 = machines_[i];
+
+    uint16_t action = actions[i];
+    if (sticky != 0u && sticky_rng_[i].NextByte() < sticky) {
+      action = last_action_[i];
+    }
+    last_action_[i] = action;
+
+    auto& keypad = chip8.get_keypad();
+    for (uint8_t key = 0; key < 16; ++key) {
+      keypad[key] = (action >> key) & 0x1u;
+    }
+
+    chip8.Run(static_cast<uint32_t>(cycles));
+
+    float score = Score(chip8);
+    rewards_[i] = score - score_[i];
+    score_[i] = score;
+
+    frames_[i] += config_.frame_skip;
+    dones_[i] = (config_.max_frames != 0 && frames_[i] >= config_.max_frames) ? 1 : 0;
+
+    if (publisher_.IsOpen()) {
+      publisher_.Publish(static_cast<uint32_t>(i), chip8.get_video());
+    }
+  }
+}
+
+Env::Observation Env::get_observation() const noexcept {
+  Observation observation{};
+  observation.base = reinterpret_cast<const uint8_t*>(machines_[0].get_video().data());
+  observation.stride = sizeof(Chip8);
+  observation.count = count_;
+  return observation;
+}
+
+float Env::Score(const Chip8& chip8) const noexcept {
+  const auto& memory = chip8.get_memory();
+  float score = 0.0f;
+  for (const auto& reward : config_.rewards) {
+    uint16_t addr = reward.addr & 0x0FFFu;
+    float value = 0.0f;
+    switch (reward.kind) {
+      case Reward::Kind::kByte:
+        value = memory[addr];
+        break;
+      case Reward::Kind::kBcd:
+        value = memory[addr] * 100.0f
+            + memory[(addr + 1) & 0x0FFFu] * 10.0f
+            + memory[(addr + 2) & 0x0FFFu];
+        break;
+    }
+    score += value * reward.scale;
+  }
+  return score;
+}
+
+} // namespace emu
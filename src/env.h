@@ -0,0 +1,96 @@
+#ifndef EMU_ENV_H_
+#define EMU_ENV_H_
+
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "chip8.h"
+#include "shm.h"
+
+namespace emu {
+
+// Batched reinforcement learning environment over N machines running the
+// same ROM. Observations are zero copy views into the machines' packed
+// framebuffers: instance i starts at base + i * stride bytes and holds
+// kFrameHeight uint64_t rows (bit 63 is the leftmost pixel). Rewards are
+// the change of values read from RAM, e.g. a score written by Fx33. Step()
+// and Reset() do not allocate.
+class Env {
+  public:
+    struct Reward {
+      enum class Kind {
+        kByte, // memory[addr]
+        kBcd,  // three decimal digits at addr..addr+2, as written by Fx33
+      };
+      uint16_t addr;
+      Kind kind;
+      float scale;
+    };
+
+    struct Config {
+      int frame_skip{4};        // frames emulated per step, same action
+      int cycles_per_frame{10}; // instructions per frame
+      float sticky{0.0f};       // probability of repeating the last action
+      uint32_t max_frames{0};   // truncate episodes, 0 for never
+      std::vector<Reward> rewards;
+    };
+
+    struct Observation {
+      const uint8_t* base;
+      size_t stride; // bytes between instances
+      size_t count;
+    };
+
+    // throws on a ROM that doesn't fit and on a config out of range:
+    // frame_skip and cycles_per_frame below 1, sticky outside [0, 1] or an
+    // unknown reward kind
+    Env(const std::vector<uint8_t>& rom, size_t instances, const Config& config);
+    ~Env();
+
+    Env(const Env& rhs) = delete;
+    Env(const Env&& rhs) = delete;
+    Env& operator=(const Env& rhs) = delete;
+    Env& operator=(const Env&& rhs) = delete;
+
+    // reset every instance, instance i is seeded with seed + i
+    void Reset(uint64_t seed) noexcept;
+    void Reset(size_t instance, uint64_t seed) noexcept;
+
+    // actions[i] is the keypad bitmask (bit k = key k) for instance i
+    void Step(const uint16_t* actions) noexcept;
+
+    // publish every instance's framebuffer to a shared memory segment
+    // after each step, see src/shm.h
+    [[nodiscard]] int Publish(const std::string& name) {
+      return publisher_.Open(name, static_cast<uint32_t>(count_));
+    }
+
+    [[nodiscard]] Observation get_observation() const noexcept;
+    [[nodiscard]] const float* get_rewards() const noexcept { return rewards_.data(); }
+    [[nodiscard]] const uint8_t* get_dones() const noexcept { return dones_.data(); }
+    [[nodiscard]] size_t size() const noexcept { return count_; }
+  private:
+    [[nodiscard]] float Score(const Chip8& chip8) const noexcept;
+
+    std::vector<uint8_t> rom_;
+    Config config_;
+    size_t count_;
+
+    // one allocation so the framebuffers sit at a fixed stride
+    std::unique_ptr<Chip8[]> machines_;
+
+    std::vector<Xorshift64> sticky_rng_;
+    std::vector<uint16_t> last_action_;
+    std::vector<float> score_;
+    std::vector<uint32_t> frames_;
+    std::vector<float> rewards_;
+    std::vector<uint8_t> dones_;
+
+    ShmPublisher publisher_;
+};
+
+} // namespace emu
+
+#endif // EMU_ENV_H_
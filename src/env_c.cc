@@ -0,0 +1,87 @@
+#include "chip8_env.h"
+#include "env.h"
+
+struct chip8_env {
+  emu::Env env;
+};
+
+static_assert(static_cast<int>(emu::Env::Reward::Kind::kByte) == CHIP8_ENV_REWARD_BYTE
+    && static_cast<int>(emu::Env::Reward::Kind::kBcd) == CHIP8_ENV_REWARD_BCD,
+    "reward kinds of the C ABI and Env differ");
+
+extern "C" {
+
+chip8_env* chip8_env_create(
+    const uint8_t* rom, size_t rom_size,
+    size_t instances,
+    const chip8_env_config* config) {
+  if (rom == nullptr || instances == 0) {
+    return nullptr;
+  }
+  emu::Env::Config cfg{};
+  if (config != nullptr) {
+    cfg.frame_skip = config->frame_skip;
+    cfg.cycles_per_frame = config->cycles_per_frame;
+    cfg.sticky = config->sticky;
+    cfg.max_frames = config->max_frames;
+    if (config->reward_count != 0 && config->rewards == nullptr) {
+      return nullptr;
+    }
+    for (size_t i = 0; i < config->reward_count; ++i) {
+      const auto& reward = config->rewards[i];
+      // the enums match, Env rejects any other kind
+      cfg.rewards.push_back({
+          reward.addr,
+          static_cast<emu::Env::Reward::Kind>(reward.kind),
+          reward.scale});
+    }
+  }
+  try {
+    return new chip8_env{emu::Env{{rom, rom + rom_size}, instances, cfg}};
+  } catch (std::exception& e) {
+    return nullptr;
+  }
+}
+
+void chip8_env_destroy(chip8_env* env) {
+  delete env;
+}
+
+void chip8_env_reset(chip8_env* env, uint64_t seed) {
+  env->env.Reset(seed);
+}
+
+void chip8_env_reset_one(chip8_env* env, size_t instance, uint64_t seed) {
+  if (instance < env->env.size()) {
+    env->env.Reset(instance, seed);
+  }
+}
+
+void chip8_env_step(chip8_env* env, const uint16_t* actions) {
+  env->env.Step(actions);
+}
+
+int chip8_env_publish(chip8_env* env, const char* name) {
+  if (name == nullptr) {
+    return 1;
+  }
+  return env->env.Publish(name);
+}
+
+const uint8_t* chip8_env_observation(const chip8_env* env, size_t* stride) {
+  emu::Env::Observation observation = env->env.get_observation();
+  if (stride != nullptr) {
+    *stride = observation.stride;
+  }
+  return observation.base;
+}
+
+const float* chip8_env_rewards(const chip8_env* env) {
+  return env->env.get_rewards();
+}
+
+const uint8_t* chip8_env_dones(const chip8_env* env) {
+  return env->env.get_dones();
+}
+
+} // extern "C"
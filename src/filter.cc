@@ -0,0 +1,181 @@
+#include <algorithm>
+#include <cstring>
+
+#include "filter.h"
+
+namespace emu {
+
+namespace {
+
+using u16x8 = uint16_t __attribute__((vector_size(16)));
+using u32x4 = uint32_t __attribute__((vector_size(16)));
+
+// bit of a sprite byte that feeds each lane, leftmost pixel first
+constexpr u16x8 kPixelBits = { 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01 };
+
+uint32_t Lerp(uint32_t off, uint32_t on, uint32_t t) noexcept {
+  uint32_t out = 0u;
+  for (uint32_t shift = 0; shift < 32; shift += 8) {
+    uint32_t a = (off >> shift) & 0xFFu;
+    uint32_t b = (on >> shift) & 0xFFu;
+    out |= ((a * (255u - t) + b * t) / 255u) << shift;
+  }
+  return out;
+}
+
+u32x4 Load(const uint32_t* p) noexcept {
+  u32x4 v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+void Store(uint32_t* p, u32x4 v) noexcept {
+  std::memcpy(p, &v, sizeof(v));
+}
+
+// a where the mask lanes are all ones, b elsewhere
+u32x4 Select(u32x4 mask, u32x4 a, u32x4 b) noexcept {
+  return (a & mask) | (b & ~mask);
+}
+
+} // namespace
+
+Filter::Filter(const Config& config)
+    : config_(config) {
+  switch (config_.upscale) {
+    case Upscale::kNone:
+      out_scale_ = 1;
+      break;
+    case Upscale::kNearest:
+      out_scale_ = std::max(config_.scale, 1);
+      break;
+    case Upscale::kScale2x:
+      out_scale_ = std::max(config_.scale & ~1, 2);
+      doubled_.resize(kFrameWidth * kFrameHeight * 4);
+      break;
+  }
+  for (uint32_t i = 0; i < palette_.size(); ++i) {
+    palette_[i] = Lerp(config_.off, config_.on, i);
+  }
+}
+
+void Filter::Apply(const Frame& frame, uint8_t* pixels, int pitch) noexcept {
+  Shade(frame);
+  switch (config_.upscale) {
+    case Upscale::kNone:
+    case Upscale::kNearest:
+      Nearest(shaded_.data(), kFrameWidth, kFrameHeight, out_scale_, pixels, pitch);
+      break;
+    case Upscale::kScale2x:
+      Scale2x();
+      Nearest(doubled_.data(), kFrameWidth * 2, kFrameHeight * 2, out_scale_ / 2,
+          pixels, pitch);
+      break;
+  }
+}
+
+// unpack, decay and colour the frame, 8 pixels (one sprite byte) per step
+void Filter::Shade(const Frame& frame) noexcept {
+  const u16x8 zero{};
+  const u16x8 decay = zero + static_cast<uint16_t>(config_.decay);
+  const u16x8 full = zero + static_cast<uint16_t>(0xFFu);
+
+  for (uint16_t y = 0; y < kFrameHeight; ++y) {
+    uint64_t row = frame[y];
+    for (uint16_t group = 0; group < kFrameWidth / 8; ++group) {
+      uint16_t byte = static_cast<uint16_t>((row >> (56u - 8u * group)) & 0xFFu);
+      // all ones in the lanes whose pixel is lit
+      u16x8 lit = reinterpret_cast<u16x8>(((zero + byte) & kPixelBits) != zero) & full;
+
+      uint16_t* cell = &intensity_[y * kFrameWidth + group * 8];
+      u16x8 value;
+      std::memcpy(&value, cell, sizeof(value));
+      if (config_.phosphor) {
+        // intensity and decay are both <= 255 so the product fits 16 bits,
+        // a lit pixel ORs back to full brightness
+        value = ((value * decay) >> 8) | lit;
+      } else {
+        value = lit;
+      }
+      std::memcpy(cell, &value, sizeof(value));
+
+      uint32_t* out = &shaded_[y * kFrameWidth + group * 8];
+      for (int lane = 0; lane < 8; ++lane) {
+        out[lane] = palette_[value[lane]];
+      }
+    }
+  }
+}
+
+// scale2x / EPX, edges repeat the border pixel. 4 source pixels per step:
+// each row is copied with its border pixel repeated on both ends, so the
+// left and right neighbours are plain unaligned loads
+void Filter::Scale2x() noexcept {
+  const int w = kFrameWidth;
+  const int h = kFrameHeight;
+  uint32_t padded[kFrameWidth + 2];
+  for (int y = 0; y < h; ++y) {
+    const uint32_t* above = &shaded_[std::max(y - 1, 0) * w];
+    const uint32_t* row = &shaded_[y * w];
+    const uint32_t* below = &shaded_[std::min(y + 1, h - 1) * w];
+    std::memcpy(padded + 1, row, w * sizeof(uint32_t));
+    padded[0] = row[0];
+    padded[w + 1] = row[w - 1];
+    uint32_t* out0 = &doubled_[(2 * y) * 2 * w];
+    uint32_t* out1 = out0 + 2 * w;
+    for (int x = 0; x < w; x += 4) {
+      const u32x4 b = Load(above + x);
+      const u32x4 d = Load(padded + x);
+      const u32x4 e = Load(padded + x + 1);
+      const u32x4 f = Load(padded + x + 2);
+      const u32x4 hh = Load(below + x);
+      const u32x4 edge = reinterpret_cast<u32x4>((b != hh) & (d != f));
+      const u32x4 e0 = Select(edge & reinterpret_cast<u32x4>(d == b), d, e);
+      const u32x4 e1 = Select(edge & reinterpret_cast<u32x4>(b == f), f, e);
+      const u32x4 e2 = Select(edge & reinterpret_cast<u32x4>(d == hh), d, e);
+      const u32x4 e3 = Select(edge & reinterpret_cast<u32x4>(hh == f), f, e);
+      // interleave the left and right halves of each output pixel
+      Store(out0 + 2 * x, __builtin_shufflevector(e0, e1, 0, 4, 1, 5));
+      Store(out0 + 2 * x + 4, __builtin_shufflevector(e0, e1, 2, 6, 3, 7));
+      Store(out1 + 2 * x, __builtin_shufflevector(e2, e3, 0, 4, 1, 5));
+      Store(out1 + 2 * x + 4, __builtin_shufflevector(e2, e3, 2, 6, 3, 7));
+    }
+  }
+}
+
+// widen each source row once, then copy it down factor - 1 times. A pixel
+// is widened with 4 lane stores of its colour; a store that runs past the
+// block is overwritten by the next one, only the row's end is filled lane
+// by lane
+void Filter::Nearest(
+    const uint32_t* src, int src_w, int src_h,
+    int factor,
+    uint8_t* dst, int pitch) noexcept {
+  const int width = src_w * factor;
+  const size_t row_bytes = static_cast<size_t>(width) * sizeof(uint32_t);
+  for (int y = 0; y < src_h; ++y) {
+    uint8_t* first = dst + static_cast<size_t>(y) * factor * pitch;
+    uint32_t* out = reinterpret_cast<uint32_t*>(first);
+    if (factor == 1) {
+      std::memcpy(out, src + y * src_w, row_bytes);
+    } else {
+      for (int x = 0; x < src_w; ++x) {
+        const uint32_t colour = src[y * src_w + x];
+        const u32x4 splat = u32x4{} + colour;
+        int i = x * factor;
+        const int end = i + factor;
+        for (; i < end && i + 4 <= width; i += 4) {
+          Store(out + i, splat);
+        }
+        for (; i < end; ++i) {
+          out[i] = colour;
+        }
+      }
+    }
+    for (int i = 1; i < factor; ++i) {
+      std::memcpy(first + static_cast<size_t>(i) * pitch, first, row_bytes);
+    }
+  }
+}
+
+} // namespace emu
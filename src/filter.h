@@ -0,0 +1,65 @@
+#ifndef EMU_FILTER_H_
+#define EMU_FILTER_H_
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "frame.h"
+
+namespace emu {
+
+// CPU post-process stage that runs before the texture upload, so the
+// renderer only ever does a 1:1 copy. Phosphor decay keeps a per pixel
+// intensity that fades instead of switching off, which hides the flicker of
+// XOR drawn sprites. The decay pass works on 8 pixels per vector op and the
+// upscalers on 4, using the GCC/clang vector extensions (SSE2 / NEON
+// without intrinsics).
+class Filter {
+  public:
+    enum class Upscale {
+      kNone,    // 64x32 output, the renderer scales
+      kNearest, // integer nearest neighbour
+      kScale2x, // scale2x (EPX) then integer nearest, needs an even scale
+    };
+
+    struct Config {
+      Upscale upscale{Upscale::kNone};
+      int scale{1};
+      bool phosphor{false};
+      uint8_t decay{160}; // intensity kept per frame, out of 256
+      uint32_t on{0xFFFFFFFFu};
+      uint32_t off{0x000000FFu};
+    };
+
+    explicit Filter(const Config& config);
+
+    // output size in pixels
+    [[nodiscard]] int get_width() const noexcept { return kFrameWidth * out_scale_; }
+    [[nodiscard]] int get_height() const noexcept { return kFrameHeight * out_scale_; }
+
+    // filter a frame into RGBA8888 pixels, pitch in bytes
+    void Apply(const Frame& frame, uint8_t* pixels, int pitch) noexcept;
+  private:
+    void Shade(const Frame& frame) noexcept;
+    void Scale2x() noexcept;
+    static void Nearest(
+        const uint32_t* src, int src_w, int src_h,
+        int factor,
+        uint8_t* dst, int pitch) noexcept;
+
+    Config config_;
+    int out_scale_;
+
+    // phosphor intensity, 0..255 per pixel, kept in 16 bit lanes so the
+    // decay multiply does not overflow
+    alignas(16) std::array<uint16_t, kFrameWidth * kFrameHeight> intensity_{};
+    std::array<uint32_t, 256> palette_{};
+
+    std::array<uint32_t, kFrameWidth * kFrameHeight> shaded_{};
+    std::vector<uint32_t> doubled_; // scale2x output
+};
+
+} // namespace emu
+
+#endif // EMU_FILTER_H_
@@ -0,0 +1,50 @@
+#ifndef EMU_FRAME_H_
+#define EMU_FRAME_H_
+
+#include <array>
+#include <cstdint>
+
+namespace emu {
+
+static constexpr uint16_t kFrameWidth = 64;
+static constexpr uint16_t kFrameHeight = 32;
+
+// packed 1bpp framebuffer, one word per row, bit 63 is the leftmost pixel
+using Frame = std::array<uint64_t, kFrameHeight>;
+
+inline bool GetPixel(const Frame& frame, uint16_t x, uint16_t y) noexcept {
+  return (frame[y] >> (kFrameWidth - 1u - x)) & 0x1u;
+}
+
+// FNV-1a over the rows, most significant byte first so the value is the
+// same on any host; used for golden frame checks
+inline uint64_t HashFrame(const Frame& frame) noexcept {
+  uint64_t hash = 0xCBF29CE484222325u;
+  for (uint64_t row : frame) {
+    for (int shift = 56; shift >= 0; shift -= 8) {
+      hash = (hash ^ ((row >> shift) & 0xFFu)) * 0x100000001B3u;
+    }
+  }
+  return hash;
+}
+
+// expand a packed frame into 32 bit pixels (kFrameWidth * kFrameHeight)
+inline void ExpandFrame(
+    const Frame& frame,
+    uint32_t* pixels,
+    uint32_t on = 0xFFFFFFFFu,
+    uint32_t off = 0x00000000u) noexcept {
+  for (uint16_t y = 0; y < kFrameHeight; ++y) {
+    uint64_t row = frame[y];
+    for (uint16_t x = 0; x < kFrameWidth; ++x) {
+      // branchless select, the mask is all ones when the pixel is set
+      uint32_t mask = 0u - static_cast<uint32_t>((row >> 63u) & 0x1u);
+      *pixels++ = (on & mask) | (off & ~mask);
+      row <<= 1u;
+    }
+  }
+}
+
+} // namespace emu
+
+#endif // EMU_FRAME_H_
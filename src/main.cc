@@ -1,60 +1,279 @@
+#include <chrono>
 #include <iostream>
 #include <memory>
+#include <stdexcept>
+#include <vector>
 
 #include "emu.h"
 #include "engine.h"
+#include "pacer.h"
 
-int loop(int scale, const std::string& rom_file) {
+// instructions per frame; far past any ROM, but each frame still ends
+constexpr int kMaxCycles = 100000;
+// emulated frames per displayed frame, "max" for as many as fit
+constexpr int kMaxSpeed = 1000;
+// simulated one way network delay and its jitter, in ms
+constexpr int kMaxLatency = 10000;
+
+struct Options {
+  int scale;
+  uint32_t cycles;
+  std::vector<std::string> rom_files;
+  std::string capture_file;
+  std::string publish_name;
+  std::string metrics_target;
+  bool vsync;
+  uint32_t speed; // emulated frames per displayed frame, 0 for unlimited
+  uint32_t turbo; // the same while the turbo key is held
+  std::string debug_endpoint;
+  bool filter;
+  emu::Filter::Config filter_config;
+  bool watch;
+  bool netplay;
+  emu::Netplay::Config netplay_config;
+};
+
+// the whole of text as a decimal in [min, max]
+int ParseInt(const std::string& text, int min, int max) {
+  size_t end = 0;
+  const int value = std::stoi(text, &end);
+  if (end != text.size() || value < min || value > max) {
+    throw std::out_of_range(text);
+  }
+  return value;
+}
+
+int loop(const Options& options) {
   // loop
   const int fps = 60;
-  const int frame_delay = 1000 / fps; // time a frame should take in ms (1000ms / frame per second)
-
-  Uint32 frame_start; // start of the frame
-  int frame_time; // end of the frame, how long it take to process the frame
 
   std::unique_ptr<emu::Engine> engine{ new emu::Engine{} };
 
-  engine->LoadRom(rom_file);
+  for (const auto& rom_file : options.rom_files) {
+    engine->LoadRom(rom_file);
+  }
+  engine->set_cycles_per_frame(options.cycles);
   int ret = engine->Init(
       "chip8 emulator",
       SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
       64, 32,
-      scale,
-      false);
+      options.scale,
+      false,
+      options.vsync ? fps : 0);
   if (ret != 0) {
     return 1;
   }
+  if (options.filter && engine->EnableFilter(options.filter_config) != 0) {
+    return 1;
+  }
+  if (!options.debug_endpoint.empty()
+      && engine->AttachDebugger(options.debug_endpoint) != 0) {
+    return 1;
+  }
+  if (!options.capture_file.empty()
+      && engine->StartCapture(options.capture_file) != 0) {
+    return 1;
+  }
+  if (!options.metrics_target.empty()
+      && engine->StartMetrics(options.metrics_target) != 0) {
+    return 1;
+  }
+  if (!options.publish_name.empty()
+      && engine->StartPublish(options.publish_name) != 0) {
+    return 1;
+  }
+  if (options.watch && engine->StartWatch() != 0) {
+    return 1;
+  }
+  if (options.netplay) {
+    emu::Netplay::Config config = options.netplay_config;
+    config.cycles_per_frame = options.cycles;
+    if (engine->StartNetplay(config) != 0) {
+      return 1;
+    }
+  }
 
+  emu::Pacer pacer{fps};
+  pacer.Start(engine->HasVsync() ? emu::Pacer::Mode::kVsync : emu::Pacer::Mode::kTimer);
+  // unlimited speed emulates for most of a display frame, then presents
+  const auto budget = std::chrono::nanoseconds(pacer.get_period() * 9 / 10);
   while (engine->IsRunning() == true) {
-    frame_start = SDL_GetTicks();
+    const auto frame_begin = emu::Metrics::Clock::now();
 
     engine->HandleEvents();
-    engine->Update();
+    // both players run at the same pace, one frame per frame
+    const uint32_t speed = options.netplay ? 1
+        : engine->IsTurbo() ? options.turbo : options.speed;
+    if (speed == 0) {
+      do {
+        engine->Step();
+      } while (emu::Metrics::Clock::now() - frame_begin < budget);
+    } else {
+      for (uint32_t i = 0; i < speed; ++i) {
+        engine->Step();
+      }
+    }
+    // frames in between are never expanded, hidden windows not at all
+    if (engine->IsVisible()) {
+      engine->Upload();
+    }
     engine->Render();
 
-    frame_time = SDL_GetTicks() - frame_start;
-    // check if we need to delay our next frame (or we are running low on fps just render the next one)
-    if(frame_delay > frame_time) {
-      // delay remaining time
-      SDL_Delay(frame_delay - frame_time);
+    const auto frame_ns = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            emu::Metrics::Clock::now() - frame_begin).count());
+    engine->RecordFrame(frame_ns, frame_ns > pacer.get_period());
+
+    // sleep until the next frame is due
+    pacer.Wait();
+    engine->RecordJitter(pacer.get_jitter());
+    if (engine->HasVsync() && pacer.get_mode() != emu::Pacer::Mode::kVsync) {
+      emu::log::Info("vsync is not keeping " + std::to_string(fps) + " Hz, pacing on the timer");
+      engine->DisableVsync();
     }
   }
 
+  const auto values = engine->get_metrics().Read();
+  char buffer[160];
+  std::snprintf(buffer, sizeof(buffer),
+      "pacing: %.3f Hz over %llu frames, %llu missed, jitter p50 %.1f us p99 %.1f us max %.1f us",
+      pacer.get_rate(),
+      static_cast<unsigned long long>(pacer.get_frames()),
+      static_cast<unsigned long long>(pacer.get_missed()),
+      values.jitter_quantiles[0] / 1e3, values.jitter_quantiles[2] / 1e3,
+      values.jitter_max / 1e3);
+  emu::log::Info(buffer);
+  if (options.netplay) {
+    const auto& stats = engine->get_netplay().get_stats();
+    std::snprintf(buffer, sizeof(buffer),
+        "netplay: %u frames, %llu rollbacks, %llu frames resimulated, depth max %u,"
+        " rollback max %.1f us, %llu stalls",
+        engine->get_netplay().get_frame(),
+        static_cast<unsigned long long>(stats.rollbacks),
+        static_cast<unsigned long long>(stats.resimulated),
+        stats.max_depth, stats.max_rollback_ns / 1e3,
+        static_cast<unsigned long long>(stats.stalls));
+    emu::log::Info(buffer);
+  }
+
   return 0;
 }
 
 int main(int argc, char* argv[]) {
   // args
-  if (argc != 3) {
-    emu::log::Error("Usage: " + std::string(argv[0]) + " SCALE ROM");
+  const std::string usage = "Usage: " + std::string(argv[0])
+      + " SCALE ROM [ROM...] [--cycles=N] [--speed=N|max] [--turbo=N|max] [--capture=FILE] [--publish=NAME]"
+      + " [--log-json=FILE] [--metrics=FILE|unix:PATH] [--vsync] [--upscale=nearest|scale2x]"
+      + " [--phosphor[=DECAY]] [--debug[=SOCKET]] [--watch]"
+      + " [--netplay=PORT,HOST:PORT] [--net-latency=MS[,JITTER]] [--net-loss=PCT]";
+  if (argc < 3) {
+    emu::log::Error(usage);
+    return 1;
+  }
+  Options options{};
+  int i = 1;
+  try {
+    options.scale = ParseInt(argv[1], 1, 64);
+    options.rom_files.push_back(argv[2]);
+    options.cycles = 1;
+    options.speed = 1;
+    options.turbo = 0;
+    options.filter_config.scale = options.scale;
+    options.netplay_config.seed = emu::Chip8::kDefaultSeed;
+    for (i = 3; i < argc; ++i) {
+      const std::string arg = argv[i];
+      if (arg.rfind("--", 0) != 0) {
+        // more games, F1..F12 switch between them
+        options.rom_files.push_back(arg);
+      } else if (arg.rfind("--cycles=", 0) == 0) {
+        options.cycles = static_cast<uint32_t>(ParseInt(arg.substr(9), 1, kMaxCycles));
+      } else if (arg.rfind("--capture=", 0) == 0) {
+        options.capture_file = arg.substr(10);
+      } else if (arg.rfind("--log-json=", 0) == 0) {
+        if (!emu::log::OpenJson(arg.substr(11))) {
+          emu::log::Error("can't open log file: " + arg.substr(11));
+          return 1;
+        }
+      } else if (arg.rfind("--speed=", 0) == 0) {
+        options.speed = (arg == "--speed=max")
+            ? 0 : static_cast<uint32_t>(ParseInt(arg.substr(8), 1, kMaxSpeed));
+      } else if (arg.rfind("--turbo=", 0) == 0) {
+        options.turbo = (arg == "--turbo=max")
+            ? 0 : static_cast<uint32_t>(ParseInt(arg.substr(8), 1, kMaxSpeed));
+      } else if (arg == "--vsync") {
+        options.vsync = true;
+      } else if (arg.rfind("--metrics=", 0) == 0) {
+        options.metrics_target = arg.substr(10);
+      } else if (arg.rfind("--publish=", 0) == 0) {
+        options.publish_name = arg.substr(10);
+      } else if (arg == "--upscale=nearest") {
+        options.filter = true;
+        options.filter_config.upscale = emu::Filter::Upscale::kNearest;
+      } else if (arg == "--upscale=scale2x") {
+        options.filter = true;
+        options.filter_config.upscale = emu::Filter::Upscale::kScale2x;
+      } else if (arg == "--phosphor" || arg.rfind("--phosphor=", 0) == 0) {
+        options.filter = true;
+        options.filter_config.phosphor = true;
+        if (arg != "--phosphor") {
+          options.filter_config.decay =
+              static_cast<uint8_t>(ParseInt(arg.substr(11), 0, 255));
+        }
+      } else if (arg == "--debug") {
+        options.debug_endpoint = "-";
+      } else if (arg.rfind("--debug=", 0) == 0) {
+        options.debug_endpoint = arg.substr(8);
+      } else if (arg == "--watch") {
+        options.watch = true;
+      } else if (arg.rfind("--netplay=", 0) == 0) {
+        // local port, then the peer
+        const size_t comma = arg.find(',');
+        if (comma == std::string::npos) {
+          emu::log::Error(usage);
+          return 1;
+        }
+        options.netplay = true;
+        options.netplay_config.port =
+            static_cast<uint16_t>(ParseInt(arg.substr(10, comma - 10), 1, 65535));
+        options.netplay_config.peer = arg.substr(comma + 1);
+      } else if (arg.rfind("--net-latency=", 0) == 0) {
+        const size_t comma = arg.find(',');
+        options.netplay_config.latency_ms = static_cast<uint32_t>(
+            ParseInt(arg.substr(14, comma == std::string::npos ? comma : comma - 14),
+                0, kMaxLatency));
+        if (comma != std::string::npos) {
+          options.netplay_config.jitter_ms =
+              static_cast<uint32_t>(ParseInt(arg.substr(comma + 1), 0, kMaxLatency));
+        }
+      } else if (arg.rfind("--net-loss=", 0) == 0) {
+        options.netplay_config.loss_percent =
+            static_cast<uint32_t>(ParseInt(arg.substr(11), 0, 100));
+      } else {
+        emu::log::Error("unknown option: " + arg + "\n" + usage);
+        return 1;
+      }
+    }
+  } catch (std::exception& e) {
+    emu::log::Error("bad value: " + std::string(argv[i]) + "\n" + usage);
+    return 1;
+  }
+
+  // the filter output has to be the window size for the 1:1 copy
+  if (options.filter_config.upscale == emu::Filter::Upscale::kScale2x
+      && options.scale % 2 != 0) {
+    emu::log::Error("--upscale=scale2x needs an even SCALE\n" + usage);
+    return 1;
+  }
+
+  if (options.netplay
+      && (options.rom_files.size() > 1 || !options.debug_endpoint.empty() || options.watch)) {
+    emu::log::Error("netplay runs one ROM, without debugger or --watch");
     return 1;
   }
-  int scale = std::stoi(argv[1]);
-  std::string rom_file = argv[2];
 
   int ret = 0;
   try {
-    ret = loop(scale, rom_file);
+    ret = loop(options);
   } catch (std::exception& e) {
     emu::log::Error(e.what());
   }
@@ -0,0 +1,312 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "metrics.h"
+
+namespace emu {
+
+namespace {
+
+void Line(std::string& out, const char* name, const std::string& labels, double value) {
+  char buffer[64];
+  std::snprintf(buffer, sizeof(buffer), "} %.9g\n", value);
+  out += name;
+  out += "{";
+  out += labels;
+  out += buffer;
+}
+
+void Help(std::string& out, const char* name, const char* type, const char* help) {
+  out += "# HELP ";
+  out += name;
+  out += " ";
+  out += help;
+  out += "\n# TYPE ";
+  out += name;
+  out += " ";
+  out += type;
+  out += "\n";
+}
+
+} // namespace
+
+// histogram
+
+size_t Histogram::Bucket(uint64_t ns) noexcept {
+  if (ns < kLinear) {
+    return static_cast<size_t>(ns);
+  }
+  ns = std::min(ns, (uint64_t{1} << (kMaxExponent + 1)) - 1u);
+  const int exponent = 63 - __builtin_clzll(ns);
+  const int shift = exponent - kSubBits;
+  const uint64_t sub = (ns >> shift) - (uint64_t{1} << kSubBits);
+  return kLinear + (static_cast<size_t>(exponent) - kSubBits - 1u) * (size_t{1} << kSubBits)
+      + static_cast<size_t>(sub);
+}
+
+uint64_t Histogram::UpperBound(size_t bucket) noexcept {
+  if (bucket < kLinear) {
+    return bucket;
+  }
+  const size_t k = bucket - kLinear;
+  const int exponent = static_cast<int>(k >> kSubBits) + kSubBits + 1;
+  const uint64_t sub = (k & ((size_t{1} << kSubBits) - 1u)) + (uint64_t{1} << kSubBits);
+  return ((sub + 1u) << (exponent - kSubBits)) - 1u;
+}
+
+void Histogram::Record(uint64_t ns) noexcept {
+  // single writer, a relaxed load + store is enough
+  auto& bucket = counts_[Bucket(ns)];
+  bucket.store(bucket.load(std::memory_order_relaxed) + 1u, std::memory_order_relaxed);
+  count_.store(count_.load(std::memory_order_relaxed) + 1u, std::memory_order_relaxed);
+  sum_.store(sum_.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+  if (ns > max_.load(std::memory_order_relaxed)) {
+    max_.store(ns, std::memory_order_relaxed);
+  }
+}
+
+uint64_t Histogram::Percentile(double q) const noexcept {
+  // the buckets are read one by one while the writer may be adding, so
+  // rank against their own total rather than count_
+  uint64_t total = 0;
+  for (const auto& bucket : counts_) {
+    total += bucket.load(std::memory_order_relaxed);
+  }
+  if (total == 0) {
+    return 0;
+  }
+  const uint64_t rank = std::max<uint64_t>(1u,
+      static_cast<uint64_t>(std::ceil(std::clamp(q, 0.0, 1.0) * total)));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kBuckets; ++i) {
+    seen += counts_[i].load(std::memory_order_relaxed);
+    if (seen >= rank) {
+      // the last bucket's bound can be above anything recorded
+      return std::min(UpperBound(i), get_max());
+    }
+  }
+  return get_max();
+}
+
+// metrics
+
+void Metrics::Update(const Chip8::Counters& counters) noexcept {
+  instructions_.store(counters.instructions, std::memory_order_relaxed);
+  draws_.store(counters.draws, std::memory_order_relaxed);
+  timer_ticks_.store(counters.timer_ticks, std::memory_order_relaxed);
+}
+
+void Metrics::RecordFrame(uint64_t ns, bool late) noexcept {
+  Add(frames_, 1u);
+  if (late) {
+    Add(late_frames_, 1u);
+  }
+  frame_time_.Record(ns);
+}
+
+Metrics::Values Metrics::Read() const noexcept {
+  Values values{};
+  values.instructions = instructions_.load(std::memory_order_relaxed);
+  values.draws = draws_.load(std::memory_order_relaxed);
+  values.timer_ticks = timer_ticks_.load(std::memory_order_relaxed);
+  values.frames = frames_.load(std::memory_order_relaxed);
+  values.late_frames = late_frames_.load(std::memory_order_relaxed);
+  for (size_t i = 0; i < 4; ++i) {
+    values.frame_time_quantiles[i] = frame_time_.Percentile(kQuantiles[i]);
+  }
+  values.frame_time_sum = frame_time_.get_sum();
+  values.frame_time_count = frame_time_.get_count();
+  values.frame_time_max = frame_time_.get_max();
+  for (size_t i = 0; i < 4; ++i) {
+    values.jitter_quantiles[i] = jitter_.Percentile(kQuantiles[i]);
+  }
+  values.jitter_max = jitter_.get_max();
+  return values;
+}
+
+// exporter
+
+MetricsExporter::MetricsExporter() {}
+
+MetricsExporter::~MetricsExporter() {
+  Close();
+}
+
+void MetricsExporter::Add(const Metrics* metrics) {
+  std::lock_guard<std::mutex> lock{mutex_};
+  metrics_.push_back(metrics);
+}
+
+void MetricsExporter::Remove(const Metrics* metrics) {
+  std::lock_guard<std::mutex> lock{mutex_};
+  metrics_.erase(std::remove(metrics_.begin(), metrics_.end(), metrics), metrics_.end());
+}
+
+int MetricsExporter::Open(const std::string& target, std::chrono::milliseconds interval) {
+  Close();
+  interval_ = interval;
+
+  if (target.rfind("unix:", 0) == 0) {
+    const std::string path = target.substr(5);
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+      log::Error("metrics socket path too long: " + path);
+      return 1;
+    }
+    std::copy(path.begin(), path.end(), addr.sun_path);
+
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd_ < 0) {
+      log::Error("metrics socket() failed");
+      return 1;
+    }
+    unlink(path.c_str());
+    if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+        || listen(listen_fd_, 4) != 0) {
+      log::Error("can't listen on metrics socket: " + path);
+      close(listen_fd_);
+      listen_fd_ = -1;
+      return 1;
+    }
+    socket_path_ = path;
+  } else {
+    file_ = target;
+  }
+
+  stop_.store(false, std::memory_order_relaxed);
+  thread_ = std::thread{&MetricsExporter::Serve, this};
+  return 0;
+}
+
+void MetricsExporter::Close() {
+  if (!thread_.joinable()) {
+    return;
+  }
+  stop_.store(true, std::memory_order_relaxed);
+  thread_.join();
+  if (listen_fd_ >= 0) {
+    close(listen_fd_);
+    unlink(socket_path_.c_str());
+    listen_fd_ = -1;
+    socket_path_.clear();
+  }
+  if (!file_.empty()) {
+    // last values, e.g. for a batch run
+    WriteFile();
+    file_.clear();
+  }
+}
+
+std::string MetricsExporter::Dump() const {
+  std::vector<std::pair<std::string, Metrics::Values>> instances;
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    for (const Metrics* metrics : metrics_) {
+      instances.emplace_back("instance=\"" + metrics->get_instance() + "\"", metrics->Read());
+    }
+  }
+
+  // the exposition format wants all samples of a family together
+  std::string out;
+  auto family = [&](const char* name, const char* type, const char* help,
+      auto value) {
+    Help(out, name, type, help);
+    for (const auto& [labels, values] : instances) {
+      Line(out, name, labels, static_cast<double>(value(values)));
+    }
+  };
+  using V = const Metrics::Values&;
+  family("chip8_instructions_total", "counter", "Instructions executed.",
+      [](V v) { return v.instructions; });
+  family("chip8_draws_total", "counter", "Dxyn instructions executed.",
+      [](V v) { return v.draws; });
+  family("chip8_timer_ticks_total", "counter", "Delay and sound timer decrements.",
+      [](V v) { return v.timer_ticks; });
+  family("chip8_frames_total", "counter", "Frames presented.",
+      [](V v) { return v.frames; });
+  family("chip8_late_frames_total", "counter", "Frames that missed their deadline.",
+      [](V v) { return v.late_frames; });
+  family("chip8_frame_time_max_seconds", "gauge", "Longest frame.",
+      [](V v) { return v.frame_time_max * 1e-9; });
+  family("chip8_pacing_jitter_max_seconds", "gauge", "Largest frame start error.",
+      [](V v) { return v.jitter_max * 1e-9; });
+
+  auto summary = [&](const char* name, const char* help, auto quantiles) {
+    Help(out, name, "summary", help);
+    for (const auto& [labels, values] : instances) {
+      for (size_t i = 0; i < 4; ++i) {
+        char quantile[32];
+        std::snprintf(quantile, sizeof(quantile), ",quantile=\"%g\"", Metrics::kQuantiles[i]);
+        Line(out, name, labels + quantile, quantiles(values)[i] * 1e-9);
+      }
+    }
+  };
+  summary("chip8_frame_time_seconds", "Time from frame start to present.",
+      [](V v) { return v.frame_time_quantiles; });
+  for (const auto& [labels, values] : instances) {
+    Line(out, "chip8_frame_time_seconds_sum", labels, values.frame_time_sum * 1e-9);
+    Line(out, "chip8_frame_time_seconds_count", labels,
+        static_cast<double>(values.frame_time_count));
+  }
+  summary("chip8_pacing_jitter_seconds", "Frame start error against the pacing deadline.",
+      [](V v) { return v.jitter_quantiles; });
+  return out;
+}
+
+void MetricsExporter::WriteFile() const {
+  // write then rename, so a scraper never sees half a file
+  const std::string tmp = file_ + ".tmp";
+  std::FILE* file = std::fopen(tmp.c_str(), "w");
+  if (file == nullptr) {
+    log::Warning("can't write metrics file: " + tmp);
+    return;
+  }
+  const std::string text = Dump();
+  std::fwrite(text.data(), 1, text.size(), file);
+  std::fclose(file);
+  std::rename(tmp.c_str(), file_.c_str());
+}
+
+void MetricsExporter::Serve() {
+  while (!stop_.load(std::memory_order_relaxed)) {
+    if (listen_fd_ < 0) {
+      WriteFile();
+      // wake up often enough to stop promptly
+      for (auto slept = std::chrono::milliseconds(0);
+           slept < interval_ && !stop_.load(std::memory_order_relaxed);
+           slept += std::chrono::milliseconds(50)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      }
+      continue;
+    }
+
+    pollfd pfd{listen_fd_, POLLIN, 0};
+    if (poll(&pfd, 1, 50) <= 0) {
+      continue;
+    }
+    int client = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (client < 0) {
+      continue;
+    }
+    const std::string text = Dump();
+    size_t sent = 0;
+    while (sent < text.size()) {
+      ssize_t n = send(client, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+      if (n <= 0) {
+        break;
+      }
+      sent += static_cast<size_t>(n);
+    }
+    close(client);
+  }
+}
+
+} // namespace emu
@@ -0,0 +1,149 @@
+#ifndef EMU_METRICS_H_
+#define EMU_METRICS_H_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "chip8.h"
+
+namespace emu {
+
+// High dynamic range histogram of nanosecond durations: exact below 128 ns,
+// then 64 linear buckets per power of two (under 1.6% error) up to ~1100 s.
+// One thread records, any thread reads; counts are relaxed atomics.
+class Histogram {
+  public:
+    static constexpr int kSubBits = 6;
+    static constexpr uint64_t kLinear = 2u << kSubBits; // exact values
+    static constexpr int kMaxExponent = 40;
+    static constexpr size_t kBuckets =
+        kLinear + (kMaxExponent - kSubBits) * (size_t{1} << kSubBits);
+
+    void Record(uint64_t ns) noexcept;
+
+    // value at quantile q (0..1), upper bound of its bucket
+    [[nodiscard]] uint64_t Percentile(double q) const noexcept;
+    [[nodiscard]] uint64_t get_count() const noexcept {
+      return count_.load(std::memory_order_relaxed);
+    }
+    [[nodiscard]] uint64_t get_sum() const noexcept {
+      return sum_.load(std::memory_order_relaxed);
+    }
+    [[nodiscard]] uint64_t get_max() const noexcept {
+      return max_.load(std::memory_order_relaxed);
+    }
+  private:
+    static size_t Bucket(uint64_t ns) noexcept;
+    static uint64_t UpperBound(size_t bucket) noexcept;
+
+    std::array<std::atomic<uint64_t>, kBuckets> counts_{};
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> sum_{0};
+    std::atomic<uint64_t> max_{0};
+};
+
+// Per instance metrics. The emulation thread is the only writer, so the
+// updates are relaxed load + store pairs (no locked instructions); the
+// exporter thread reads them at any time.
+class Metrics {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit Metrics(std::string instance) : instance_(std::move(instance)) {}
+
+    Metrics(const Metrics& rhs) = delete;
+    Metrics(const Metrics&& rhs) = delete;
+    Metrics& operator=(const Metrics& rhs) = delete;
+    Metrics& operator=(const Metrics&& rhs) = delete;
+
+    // copy the core's counters, once per frame
+    void Update(const Chip8::Counters& counters) noexcept;
+    // a frame took ns from start to present, late if it missed its deadline
+    void RecordFrame(uint64_t ns, bool late) noexcept;
+    // how far off its deadline a frame started, see Pacer
+    void RecordJitter(uint64_t ns) noexcept { jitter_.Record(ns); }
+
+    // consistent enough copy for export, counters are read one by one
+    struct Values {
+      uint64_t instructions;
+      uint64_t draws;
+      uint64_t timer_ticks;
+      uint64_t frames;
+      uint64_t late_frames;
+      uint64_t frame_time_quantiles[4]; // ns at kQuantiles
+      uint64_t frame_time_sum;
+      uint64_t frame_time_count;
+      uint64_t frame_time_max;
+      uint64_t jitter_quantiles[4];
+      uint64_t jitter_max;
+    };
+    static constexpr double kQuantiles[4] = {0.5, 0.9, 0.99, 0.999};
+
+    [[nodiscard]] Values Read() const noexcept;
+
+    [[nodiscard]] const std::string& get_instance() const noexcept { return instance_; }
+  private:
+    static void Add(std::atomic<uint64_t>& counter, uint64_t value) noexcept {
+      counter.store(counter.load(std::memory_order_relaxed) + value,
+          std::memory_order_relaxed);
+    }
+
+    std::string instance_;
+    std::atomic<uint64_t> instructions_{0};
+    std::atomic<uint64_t> draws_{0};
+    std::atomic<uint64_t> timer_ticks_{0};
+    std::atomic<uint64_t> frames_{0};
+    std::atomic<uint64_t> late_frames_{0};
+    Histogram frame_time_;
+    Histogram jitter_;
+};
+
+// Exposes a set of Metrics to other processes, either by rewriting a
+// Prometheus text file (for node_exporter's textfile collector) every
+// interval, or by dumping the same text to every client that connects to a
+// unix socket. Runs on its own thread.
+class MetricsExporter {
+  public:
+    MetricsExporter();
+    ~MetricsExporter();
+
+    MetricsExporter(const MetricsExporter& rhs) = delete;
+    MetricsExporter(const MetricsExporter&& rhs) = delete;
+    MetricsExporter& operator=(const MetricsExporter& rhs) = delete;
+    MetricsExporter& operator=(const MetricsExporter&& rhs) = delete;
+
+    // metrics must outlive the exporter (or be removed first)
+    void Add(const Metrics* metrics);
+    void Remove(const Metrics* metrics);
+
+    // "unix:PATH" serves a socket, anything else is a text file
+    [[nodiscard]] int Open(
+        const std::string& target,
+        std::chrono::milliseconds interval = std::chrono::milliseconds(1000));
+    void Close();
+
+    [[nodiscard]] std::string Dump() const;
+  private:
+    void Serve();
+    void WriteFile() const;
+
+    mutable std::mutex mutex_; // guards metrics_, not taken on the record path
+    std::vector<const Metrics*> metrics_;
+
+    std::string file_;
+    std::string socket_path_;
+    int listen_fd_{-1};
+    std::chrono::milliseconds interval_{1000};
+    std::atomic<bool> stop_{false};
+    std::thread thread_;
+};
+
+} // namespace emu
+
+#endif // EMU_METRICS_H_
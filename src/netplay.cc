@@ -0,0 +1,376 @@
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "netplay.h"
+
+namespace emu {
+
+namespace {
+
+constexpr uint32_t kMagic = 0x504E3843; // "C8NP"
+constexpr uint32_t kNone = 0xFFFFFFFFu;
+// magic, session, ack, start, count, check frame, check hash
+constexpr size_t kHeaderSize = 4 + 8 + 4 + 4 + 1 + 4 + 8;
+// inputs per packet, older unacknowledged ones are the peer's problem
+constexpr uint32_t kMaxInputs = 32;
+constexpr int64_t kNsPerMs = 1000000;
+
+template <typename T>
+uint8_t* Put(uint8_t* out, T value) noexcept {
+  for (size_t i = 0; i < sizeof(T); ++i) {
+    *out++ = static_cast<uint8_t>(value >> (8u * i));
+  }
+  return out;
+}
+
+template <typename T>
+const uint8_t* Get(const uint8_t* in, T& value) noexcept {
+  value = 0;
+  for (size_t i = 0; i < sizeof(T); ++i) {
+    value |= static_cast<T>(static_cast<T>(*in++) << (8u * i));
+  }
+  return in;
+}
+
+inline int64_t Now() noexcept {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline uint64_t Fnv(uint64_t hash, const void* data, size_t size) noexcept {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 0x100000001B3u;
+  }
+  return hash;
+}
+
+} // namespace
+
+Netplay::Netplay() : snapshots_(kRing) {}
+
+Netplay::~Netplay() {
+  Close();
+}
+
+int Netplay::Open(const Config& config, Chip8& chip8) {
+  Close();
+
+  const size_t colon = config.peer.rfind(':');
+  if (colon == std::string::npos) {
+    log::Error("netplay: peer must be HOST:PORT, got " + config.peer);
+    return 1;
+  }
+  const std::string host = config.peer.substr(0, colon);
+  const std::string service = config.peer.substr(colon + 1);
+  addrinfo hints{};
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  addrinfo* result = nullptr;
+  if (getaddrinfo(host.c_str(), service.c_str(), &hints, &result) != 0 || result == nullptr) {
+    log::Error("netplay: can't resolve " + config.peer);
+    return 1;
+  }
+  std::memcpy(&peer_, result->ai_addr, sizeof(peer_));
+  freeaddrinfo(result);
+
+  socket_ = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (socket_ < 0) {
+    log::Error("netplay: can't create socket");
+    return 1;
+  }
+  sockaddr_in local{};
+  local.sin_family = AF_INET;
+  local.sin_addr.s_addr = htonl(INADDR_ANY);
+  local.sin_port = htons(config.port);
+  if (bind(socket_, reinterpret_cast<sockaddr*>(&local), sizeof(local)) != 0) {
+    log::Error("netplay: can't bind port " + std::to_string(config.port));
+    Close();
+    return 1;
+  }
+
+  config_ = config;
+  chip8_ = &chip8;
+  chip8.Seed(config.seed);
+  chip8.set_cycles_per_tick(config.cycles_per_frame);
+  // both sides must start from the same state at the same speed, packets
+  // from a peer with another ROM or settings are ignored
+  chip8.Save(snapshots_[0]);
+  session_ = Fnv(Hash(snapshots_[0]), &config.cycles_per_frame, sizeof(config.cycles_per_frame));
+
+  frame_ = 0;
+  remote_ = 0;
+  acked_ = 0;
+  rollback_ = kNone;
+  local_.fill(0);
+  remote_inputs_.fill(0);
+  predicted_.fill(0);
+  check_frame_ = 0;
+  check_hash_ = 0;
+  check_pending_ = false;
+  desynced_ = false;
+  mismatch_logged_ = false;
+  impairment_.Seed(config.seed ^ config.port);
+  outgoing_.clear();
+  stats_ = {};
+  return 0;
+}
+
+void Netplay::Close() {
+  if (socket_ >= 0) {
+    close(socket_);
+    socket_ = -1;
+  }
+  chip8_ = nullptr;
+}
+
+uint32_t Netplay::get_confirmed() const noexcept {
+  return std::min(remote_, frame_);
+}
+
+bool Netplay::Advance(uint16_t keys) {
+  Receive();
+  Rollback();
+  // the peer is late or gone, running further would only make the
+  // rollback deeper
+  const bool stall = frame_ - get_confirmed() >= kMaxRollback;
+  if (stall) {
+    ++stats_.stalls;
+  } else {
+    local_[frame_ % kRing] = keys;
+    Simulate(frame_);
+    ++frame_;
+  }
+  CheckHash();
+  Send();
+  Flush();
+  return !stall;
+}
+
+void Netplay::Poll() {
+  Receive();
+  Rollback();
+  CheckHash();
+  Send();
+  Flush();
+}
+
+void Netplay::Simulate(uint32_t frame) {
+  uint16_t remote = 0;
+  if (frame < remote_) {
+    remote = remote_inputs_[frame % kRing];
+  } else if (remote_ != 0) {
+    remote = remote_inputs_[(remote_ - 1) % kRing];
+  }
+  predicted_[frame % kRing] = remote;
+
+  chip8_->Save(snapshots_[frame % kRing]);
+  const uint16_t keys = local_[frame % kRing] | remote;
+  auto& keypad = chip8_->get_keypad();
+  for (uint8_t key = 0; key < 16; ++key) {
+    keypad[key] = (keys >> key) & 0x1u;
+  }
+  chip8_->Run(config_.cycles_per_frame);
+}
+
+void Netplay::Rollback() {
+  if (rollback_ == kNone) {
+    return;
+  }
+  const uint32_t from = rollback_;
+  rollback_ = kNone;
+  if (from >= frame_) {
+    return;
+  }
+
+  const int64_t start = Now();
+  chip8_->Load(snapshots_[from % kRing]);
+  for (uint32_t frame = from; frame < frame_; ++frame) {
+    Simulate(frame);
+  }
+  const uint64_t elapsed = static_cast<uint64_t>(Now() - start);
+
+  ++stats_.rollbacks;
+  stats_.resimulated += frame_ - from;
+  stats_.max_depth = std::max(stats_.max_depth, frame_ - from);
+  stats_.max_rollback_ns = std::max(stats_.max_rollback_ns, elapsed);
+  EMU_LOG(kDebug, "netplay: rolled back " + std::to_string(frame_ - from)
+      + " frames to " + std::to_string(from));
+}
+
+void Netplay::Receive() {
+  uint8_t packet[kMaxPacket];
+  for (;;) {
+    sockaddr_in from{};
+    socklen_t from_size = sizeof(from);
+    const ssize_t size = recvfrom(socket_, packet, sizeof(packet), 0,
+        reinterpret_cast<sockaddr*>(&from), &from_size);
+    if (size < 0) {
+      // an ICMP port unreachable while the peer isn't up yet is reported
+      // once and consumed; anything else (EAGAIN, or a broken socket) ends
+      // this poll, so a persistent error can't spin here
+      if (errno == EINTR || errno == ECONNREFUSED) {
+        continue;
+      }
+      return;
+    }
+    if (from.sin_addr.s_addr != peer_.sin_addr.s_addr || from.sin_port != peer_.sin_port
+        || static_cast<size_t>(size) < kHeaderSize) {
+      continue;
+    }
+
+    uint32_t magic;
+    uint64_t session;
+    uint32_t ack;
+    uint32_t start;
+    uint8_t count;
+    uint32_t check_frame;
+    uint64_t check_hash;
+    const uint8_t* in = packet;
+    in = Get(in, magic);
+    in = Get(in, session);
+    in = Get(in, ack);
+    in = Get(in, start);
+    in = Get(in, count);
+    in = Get(in, check_frame);
+    in = Get(in, check_hash);
+    if (magic != kMagic || count > kMaxInputs
+        || static_cast<size_t>(size) != kHeaderSize + 2u * count) {
+      continue;
+    }
+    if (session != session_) {
+      if (!mismatch_logged_) {
+        log::Warning("netplay: the peer runs another ROM or other settings");
+        mismatch_logged_ = true;
+      }
+      continue;
+    }
+    ++stats_.packets_received;
+
+    // packets come late and out of order, only the news counts
+    acked_ = std::max(acked_, std::min(ack, frame_));
+    if (check_frame > (check_pending_ ? check_frame_ : 0u)) {
+      check_frame_ = check_frame;
+      check_hash_ = check_hash;
+      check_pending_ = true;
+    }
+    // the peer sends from what we acknowledged, so there is never a gap
+    if (start > remote_) {
+      continue;
+    }
+    for (uint32_t frame = start; frame < start + count; ++frame) {
+      uint16_t input;
+      in = Get(in, input);
+      if (frame < remote_) {
+        continue;
+      }
+      remote_inputs_[frame % kRing] = input;
+      if (frame < frame_ && predicted_[frame % kRing] != input) {
+        rollback_ = std::min(rollback_, frame);
+      }
+      remote_ = frame + 1;
+    }
+  }
+}
+
+void Netplay::CheckHash() {
+  if (!check_pending_ || frame_ == 0) {
+    return;
+  }
+  // the state at the start of a frame is final once the inputs of every
+  // frame before it are known, and it is still in the ring
+  const uint32_t confirmed = std::min(remote_, frame_ - 1);
+  if (check_frame_ > confirmed) {
+    return;
+  }
+  check_pending_ = false;
+  if (check_frame_ + kRing <= frame_) {
+    return;
+  }
+  if (Hash(snapshots_[check_frame_ % kRing]) != check_hash_ && !desynced_) {
+    log::Error("netplay: desync at frame " + std::to_string(check_frame_));
+    desynced_ = true;
+  }
+}
+
+void Netplay::Send() {
+  const uint32_t start = std::max(acked_, frame_ - std::min(frame_, kMaxInputs));
+  const uint8_t count = static_cast<uint8_t>(frame_ - start);
+  // our latest final state, for the peer to compare
+  uint32_t check_frame = 0;
+  uint64_t check_hash = 0;
+  if (frame_ != 0) {
+    check_frame = std::min(remote_, frame_ - 1);
+    if (check_frame != 0) {
+      check_hash = Hash(snapshots_[check_frame % kRing]);
+    }
+  }
+
+  Pending pending{};
+  uint8_t* out = pending.data.data();
+  out = Put(out, kMagic);
+  out = Put(out, session_);
+  out = Put(out, remote_);
+  out = Put(out, start);
+  out = Put(out, count);
+  out = Put(out, check_frame);
+  out = Put(out, check_hash);
+  for (uint32_t frame = start; frame < frame_; ++frame) {
+    out = Put(out, local_[frame % kRing]);
+  }
+  pending.size = static_cast<size_t>(out - pending.data.data());
+
+  if (config_.loss_percent != 0u && impairment_.NextByte() * 100u < config_.loss_percent * 256u) {
+    ++stats_.packets_dropped;
+    return;
+  }
+  pending.due = Now() + config_.latency_ms * kNsPerMs;
+  if (config_.jitter_ms != 0u) {
+    const uint32_t random = (impairment_.NextByte() << 8u) | impairment_.NextByte();
+    pending.due += (random % (config_.jitter_ms + 1u)) * kNsPerMs;
+  }
+  outgoing_.push_back(pending);
+}
+
+void Netplay::Flush() {
+  const int64_t now = Now();
+  for (auto it = outgoing_.begin(); it != outgoing_.end();) {
+    if (it->due > now) {
+      ++it;
+      continue;
+    }
+    // a full socket buffer loses the packet like the network would
+    sendto(socket_, it->data.data(), it->size, 0,
+        reinterpret_cast<const sockaddr*>(&peer_), sizeof(peer_));
+    ++stats_.packets_sent;
+    it = outgoing_.erase(it);
+  }
+}
+
+uint64_t Netplay::Hash(const Chip8::Snapshot& snapshot) noexcept {
+  // field by field, the padding between them is not part of the state
+  uint64_t hash = 0xCBF29CE484222325u;
+  hash = Fnv(hash, snapshot.registers.data(), sizeof(snapshot.registers));
+  hash = Fnv(hash, snapshot.memory.data(), sizeof(snapshot.memory));
+  hash = Fnv(hash, &snapshot.index, sizeof(snapshot.index));
+  hash = Fnv(hash, &snapshot.pc, sizeof(snapshot.pc));
+  hash = Fnv(hash, snapshot.stack.data(), sizeof(snapshot.stack));
+  hash = Fnv(hash, &snapshot.sp, sizeof(snapshot.sp));
+  hash = Fnv(hash, &snapshot.delay_timer, sizeof(snapshot.delay_timer));
+  hash = Fnv(hash, &snapshot.sound_timer, sizeof(snapshot.sound_timer));
+  hash = Fnv(hash, &snapshot.tick_phase, sizeof(snapshot.tick_phase));
+  hash = Fnv(hash, snapshot.keypad.data(), sizeof(snapshot.keypad));
+  hash = Fnv(hash, snapshot.video.data(), sizeof(snapshot.video));
+  hash = Fnv(hash, &snapshot.rng, sizeof(snapshot.rng));
+  return hash;
+}
+
+} // namespace emu
@@ -0,0 +1,134 @@
+#ifndef EMU_NETPLAY_H_
+#define EMU_NETPLAY_H_
+
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <netinet/in.h>
+
+#include "chip8.h"
+#include "rng.h"
+
+namespace emu {
+
+// Two player rollback netplay over UDP. Both sides run the same machine
+// and exchange only their keypad bitmasks, one per frame; the machine sees
+// the OR of the two. A frame never waits for the remote input: it runs on a
+// prediction (the last input received) and when the real input turns out
+// different, the machine is restored from the snapshot taken at the start
+// of the first wrong frame and the frames since are simulated again.
+//
+// Every packet carries all the inputs the peer hasn't acknowledged yet, so
+// a lost packet costs nothing as long as the next one arrives.
+class Netplay {
+  public:
+    struct Config {
+      uint16_t port;            // local UDP port
+      std::string peer;         // HOST:PORT
+      uint32_t cycles_per_frame;
+      uint64_t seed;            // Cxkk seed, both sides must agree
+      // impairments on what we send, to test without tc/netem
+      uint32_t latency_ms;
+      uint32_t jitter_ms;
+      uint32_t loss_percent;
+    };
+
+    struct Stats {
+      uint64_t rollbacks;       // restores from a snapshot
+      uint64_t resimulated;     // frames simulated again
+      uint64_t stalls;          // Advance() calls that waited for the peer
+      uint32_t max_depth;       // most frames undone by one rollback
+      uint64_t max_rollback_ns; // longest restore and resimulation
+      uint64_t packets_sent;
+      uint64_t packets_received;
+      uint64_t packets_dropped; // by the loss impairment
+    };
+
+    // frames we may run ahead of the last input received from the peer
+    static constexpr uint32_t kMaxRollback = 8;
+
+    Netplay();
+    ~Netplay();
+
+    Netplay(const Netplay& rhs) = delete;
+    Netplay(const Netplay&& rhs) = delete;
+    Netplay& operator=(const Netplay& rhs) = delete;
+    Netplay& operator=(const Netplay&& rhs) = delete;
+
+    // seeds the machine, which must be fresh after LoadRom() on both sides,
+    // and binds the socket; the machine is driven by Advance() from now on
+    [[nodiscard]] int Open(const Config& config, Chip8& chip8);
+    void Close();
+
+    // runs one frame with the local keypad bitmask (bit n = key n); false
+    // when too far ahead of the peer, the frame didn't run, call again
+    // next frame
+    [[nodiscard]] bool Advance(uint16_t keys);
+    // exchanges packets and rolls back if needed, without running a frame
+    void Poll();
+
+    [[nodiscard]] bool IsOpen() const noexcept { return socket_ >= 0; }
+    // the peer sent a different state hash for a confirmed frame
+    [[nodiscard]] bool IsDesynced() const noexcept { return desynced_; }
+
+    // frames run
+    uint32_t get_frame() const noexcept { return frame_; }
+    // frames run with both inputs known, they will never be rolled back
+    uint32_t get_confirmed() const noexcept;
+    // local inputs the peer has acknowledged
+    uint32_t get_acknowledged() const noexcept { return acked_; }
+    const Stats& get_stats() const noexcept { return stats_; }
+
+    // state hash compared between the peers, FNV-1a over every field
+    static uint64_t Hash(const Chip8::Snapshot& snapshot) noexcept;
+  private:
+    // power of two, above kMaxRollback on both sides plus the packets in flight
+    static constexpr uint32_t kRing = 64;
+    static constexpr size_t kMaxPacket = 64 + 2 * kRing;
+
+    struct Pending {
+      int64_t due;
+      size_t size;
+      std::array<uint8_t, kMaxPacket> data;
+    };
+
+    void Receive();
+    void Rollback();
+    void Simulate(uint32_t frame);
+    void Send();
+    void Flush();
+    void CheckHash();
+
+    Config config_{};
+    Chip8* chip8_{};
+    int socket_{-1};
+    sockaddr_in peer_{};
+    uint64_t session_{}; // hash of the starting state
+
+    uint32_t frame_{};     // next frame to run
+    uint32_t remote_{};    // remote inputs received, all frames below
+    uint32_t acked_{};     // local inputs the peer has
+    uint32_t rollback_{};  // first mispredicted frame, all ones if none
+    std::array<uint16_t, kRing> local_{};
+    std::array<uint16_t, kRing> remote_inputs_{};
+    std::array<uint16_t, kRing> predicted_{};
+    std::vector<Chip8::Snapshot> snapshots_; // at the start of each frame, kRing of them
+
+    // the peer's hash for a frame we may not have confirmed yet
+    uint32_t check_frame_{};
+    uint64_t check_hash_{};
+    bool check_pending_{};
+    bool desynced_{};
+    bool mismatch_logged_{};
+
+    Xorshift64 impairment_{};
+    std::deque<Pending> outgoing_;
+    Stats stats_{};
+};
+
+} // namespace emu
+
+#endif // EMU_NETPLAY_H_
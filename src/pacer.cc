@@ -0,0 +1,123 @@
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <ctime>
+
+#include "pacer.h"
+
+namespace emu {
+
+namespace {
+
+constexpr int64_t kNsPerSec = 1000000000;
+// vsync must land within 5% of the period over this many frames
+constexpr uint32_t kVsyncWindow = 60;
+constexpr double kVsyncTolerance = 0.05;
+
+inline void CpuRelax() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+} // namespace
+
+Pacer::Pacer(double hz, std::chrono::nanoseconds spin)
+    : hz_milli_(static_cast<uint64_t>(std::llround(hz * 1000.0))),
+      spin_(spin.count()) {}
+
+int64_t Pacer::Now() noexcept {
+  timespec ts{};
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * kNsPerSec + ts.tv_nsec;
+}
+
+int64_t Pacer::Deadline(uint64_t frame) const noexcept {
+  // frame * 1e12 / hz_milli_ exactly, split so it can't overflow 64 bits
+  constexpr uint64_t kNsPerMilliHz = static_cast<uint64_t>(kNsPerSec) * 1000u;
+  const uint64_t whole = frame / hz_milli_ * kNsPerMilliHz;
+  const uint64_t part = frame % hz_milli_ * kNsPerMilliHz / hz_milli_;
+  return epoch_ + static_cast<int64_t>(whole + part);
+}
+
+uint64_t Pacer::get_period() const noexcept {
+  return static_cast<uint64_t>(kNsPerSec) * 1000u / hz_milli_;
+}
+
+void Pacer::Start(Mode mode) noexcept {
+  mode_ = mode;
+  epoch_ = Now();
+  frame_ = 0;
+  start_ = epoch_;
+  last_ = epoch_;
+  frames_ = 0;
+  missed_ = 0;
+  jitter_ = 0;
+  window_start_ = epoch_;
+  window_frames_ = 0;
+}
+
+void Pacer::Wait() noexcept {
+  ++frames_;
+
+  if (mode_ == Mode::kVsync) {
+    // the present blocked already, check that it keeps our rate
+    const int64_t now = Now();
+    const int64_t interval = now - last_;
+    const int64_t period = static_cast<int64_t>(get_period());
+    last_ = now;
+    jitter_ = static_cast<uint64_t>(std::llabs(interval - period));
+
+    if (++window_frames_ == kVsyncWindow) {
+      const double measured = static_cast<double>(now - window_start_) / kVsyncWindow;
+      window_start_ = now;
+      window_frames_ = 0;
+      if (std::fabs(measured - period) > period * kVsyncTolerance) {
+        // continue on the timer from here
+        mode_ = Mode::kTimer;
+        epoch_ = now;
+        frame_ = 0;
+      }
+    }
+    return;
+  }
+
+  ++frame_;
+  int64_t deadline = Deadline(frame_);
+  int64_t now = Now();
+  if (now - deadline > static_cast<int64_t>(get_period())) {
+    // more than a frame behind (stall, breakpoint): skip the missed
+    // deadlines instead of running them back to back
+    missed_ += static_cast<uint64_t>((now - deadline) / static_cast<int64_t>(get_period()));
+    jitter_ = static_cast<uint64_t>(now - deadline);
+    epoch_ = now;
+    frame_ = 0;
+    last_ = now;
+    return;
+  }
+
+  // sleep to just before the deadline, the scheduler wakes us up late by
+  // a few tens of microseconds, then spin the rest
+  const int64_t wake = deadline - spin_;
+  if (now < wake) {
+    timespec ts{};
+    ts.tv_sec = wake / kNsPerSec;
+    ts.tv_nsec = wake % kNsPerSec;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {
+    }
+  }
+  while ((now = Now()) < deadline) {
+    CpuRelax();
+  }
+  jitter_ = static_cast<uint64_t>(now - deadline);
+  last_ = now;
+}
+
+double Pacer::get_rate() const noexcept {
+  const int64_t elapsed = last_ - start_;
+  return (elapsed > 0) ? static_cast<double>(frames_) * kNsPerSec / elapsed : 0.0;
+}
+
+} // namespace emu
@@ -0,0 +1,75 @@
+#ifndef EMU_PACER_H_
+#define EMU_PACER_H_
+
+#include <chrono>
+#include <cstdint>
+
+namespace emu {
+
+// Frame pacing. Deadlines are absolute, frame n is due at start + n / hz
+// computed from the frame count, so rounding never accumulates and the long
+// run rate is exactly hz. Wait() sleeps with clock_nanosleep(TIMER_ABSTIME)
+// until shortly before the deadline and spins the rest.
+//
+// In vsync mode SDL_RenderPresent already blocks on the display, Wait() only
+// measures. If the measured rate is off (the display isn't at hz, or the
+// compositor doesn't block presents), it falls back to the timer.
+class Pacer {
+  public:
+    enum class Mode {
+      kTimer,
+      kVsync,
+    };
+
+    explicit Pacer(
+        double hz = 60.0,
+        std::chrono::nanoseconds spin = std::chrono::microseconds(500));
+
+    Pacer(const Pacer& rhs) = delete;
+    Pacer(const Pacer&& rhs) = delete;
+    Pacer& operator=(const Pacer& rhs) = delete;
+    Pacer& operator=(const Pacer&& rhs) = delete;
+
+    // the first frame starts now
+    void Start(Mode mode = Mode::kTimer) noexcept;
+    // block until the next frame is due
+    void Wait() noexcept;
+
+    [[nodiscard]] Mode get_mode() const noexcept { return mode_; }
+    // ns the last frame started after its deadline (timer, a stall
+    // included), or how far the last frame interval was off the period
+    // (vsync)
+    [[nodiscard]] uint64_t get_jitter() const noexcept { return jitter_; }
+    // deadlines given up on because we were more than a frame behind
+    [[nodiscard]] uint64_t get_missed() const noexcept { return missed_; }
+    [[nodiscard]] uint64_t get_frames() const noexcept { return frames_; }
+    // measured frames per second since Start()
+    [[nodiscard]] double get_rate() const noexcept;
+    [[nodiscard]] uint64_t get_period() const noexcept;
+
+    // when frame n after the epoch (Start() or the last resync) is due,
+    // CLOCK_MONOTONIC ns
+    [[nodiscard]] int64_t Deadline(uint64_t frame) const noexcept;
+  private:
+    static int64_t Now() noexcept;
+
+    uint64_t hz_milli_;  // rate in mHz, keeps the deadline math integral
+    int64_t spin_;
+    Mode mode_{Mode::kTimer};
+
+    int64_t epoch_{};    // deadlines are counted from here
+    uint64_t frame_{};   // frames since epoch_
+    int64_t start_{};
+    int64_t last_{};
+    uint64_t frames_{};
+    uint64_t missed_{};
+    uint64_t jitter_{};
+
+    // vsync check, over a window of frames
+    int64_t window_start_{};
+    uint32_t window_frames_{};
+};
+
+} // namespace emu
+
+#endif // EMU_PACER_H_
@@ -0,0 +1,89 @@
+#ifndef EMU_RNG_H_
+#define EMU_RNG_H_
+
+#include <cstdint>
+
+namespace emu {
+
+// Small seedable generators used by Cxkk. Every policy exposes the same
+// interface: Seed(), NextByte() and a copyable State for save states.
+
+// xorshift64* (Vigna), 8 bytes of state
+class Xorshift64 {
+  public:
+    struct State {
+      uint64_t s;
+    };
+
+    explicit Xorshift64(uint64_t seed = 0) noexcept { Seed(seed); }
+
+    void Seed(uint64_t seed) noexcept {
+      // splitmix64 scramble so that small seeds give unrelated streams,
+      // the state must never be zero
+      uint64_t z = seed + 0x9E3779B97F4A7C15ull;
+      z = (z ^ (z >> 30u)) * 0xBF58476D1CE4E5B9ull;
+      z = (z ^ (z >> 27u)) * 0x94D049BB133111EBull;
+      z ^= z >> 31u;
+      state_.s = (z != 0u) ? z : 0x9E3779B97F4A7C15ull;
+    }
+
+    uint8_t NextByte() noexcept {
+      state_.s ^= state_.s >> 12u;
+      state_.s ^= state_.s << 25u;
+      state_.s ^= state_.s >> 27u;
+      // the high bits are the best ones
+      return static_cast<uint8_t>((state_.s * 0x2545F4914F6CDD1Dull) >> 56u);
+    }
+
+    const State& get_state() const noexcept { return state_; }
+    void set_state(const State& state) noexcept { state_ = state; }
+  private:
+    State state_{};
+};
+
+// PCG32 (XSH-RR, O'Neill), 16 bytes of state
+class Pcg32 {
+  public:
+    struct State {
+      uint64_t s;
+      uint64_t inc;
+    };
+
+    explicit Pcg32(uint64_t seed = 0) noexcept { Seed(seed); }
+
+    void Seed(uint64_t seed, uint64_t stream = 0xDA3E39CB94B95BDBull) noexcept {
+      state_.s = 0u;
+      state_.inc = (stream << 1u) | 1u;
+      Next();
+      state_.s += seed;
+      Next();
+    }
+
+    uint32_t Next() noexcept {
+      uint64_t old = state_.s;
+      state_.s = old * 6364136223846793005ull + state_.inc;
+      uint32_t xorshifted = static_cast<uint32_t>(((old >> 18u) ^ old) >> 27u);
+      uint32_t rot = static_cast<uint32_t>(old >> 59u);
+      return (xorshifted >> rot) | (xorshifted << ((32u - rot) & 31u));
+    }
+
+    uint8_t NextByte() noexcept {
+      return static_cast<uint8_t>(Next() >> 24u);
+    }
+
+    const State& get_state() const noexcept { return state_; }
+    void set_state(const State& state) noexcept { state_ = state; }
+  private:
+    State state_{};
+};
+
+// RNG policy, pick with -D EMU_RNG_XORSHIFT (default is PCG32)
+#ifdef EMU_RNG_XORSHIFT
+using Rng = Xorshift64;
+#else
+using Rng = Pcg32;
+#endif
+
+} // namespace emu
+
+#endif // EMU_RNG_H_
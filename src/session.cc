@@ -0,0 +1,120 @@
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+#include "session.h"
+
+namespace emu {
+
+Session::Session() {}
+
+Session::~Session() {}
+
+size_t Session::Add(const std::string& file, uint64_t seed) {
+  // slots are named after the file, without the directory
+  const size_t slot = Add(file.substr(file.find_last_of('/') + 1), Read(file), seed);
+  slots_[slot].file = file;
+  return slot;
+}
+
+size_t Session::Add(const std::string& name, const std::vector<uint8_t>& rom, uint64_t seed) {
+  if (rom.size() > Chip8::kMaxRomSize) {
+    throw std::runtime_error("ROM too large: " + std::to_string(rom.size()) + " bytes");
+  }
+  const uint64_t hash = Intern(rom);
+  const auto& image = roms_.at(hash);
+
+  Slot slot{};
+  slot.name = name;
+  slot.hash = hash;
+  slot.chip8.reset(new Chip8{kFrameWidth, kFrameHeight, seed});
+  slot.chip8->LoadRom(image.data(), image.size());
+  slot.metrics.reset(new Metrics{std::to_string(slots_.size())});
+  slots_.push_back(std::move(slot));
+  return slots_.size() - 1;
+}
+
+size_t Session::Reload(size_t slot) {
+  Slot& target = slots_.at(slot);
+  std::vector<uint8_t> rom = Read(target.file);
+  if (rom.empty()) {
+    // an editor that truncates, then writes, caught in between; patching
+    // would zero the whole program
+    throw std::runtime_error("empty ROM file: " + target.file + ", waiting for the write");
+  }
+  if (rom.size() > Chip8::kMaxRomSize) {
+    throw std::runtime_error("ROM too large: " + std::to_string(rom.size()) + " bytes");
+  }
+
+  // a shorter file leaves zeros behind, like a fresh load
+  std::vector<uint8_t> before = roms_.at(target.hash);
+  std::vector<uint8_t> after = rom;
+  const size_t size = std::max(before.size(), after.size());
+  before.resize(size, 0);
+  after.resize(size, 0);
+
+  // only the runs the file changed are patched, the bytes it didn't change
+  // may hold the game's variables by now
+  size_t patched = 0;
+  for (size_t i = 0; i < size;) {
+    if (before[i] == after[i]) {
+      ++i;
+      continue;
+    }
+    size_t end = i;
+    while (end < size && before[end] != after[end]) {
+      ++end;
+    }
+    patched += target.chip8->Patch(static_cast<uint16_t>(Chip8::kEntryPointAddr + i),
+        after.data() + i, end - i);
+    i = end;
+  }
+
+  // the version replaced is dropped unless another slot runs it
+  const uint64_t previous = target.hash;
+  target.hash = Intern(rom);
+  const bool used = std::any_of(slots_.begin(), slots_.end(),
+      [previous](const Slot& other) { return other.hash == previous; });
+  if (!used) {
+    roms_.erase(previous);
+  }
+  return patched;
+}
+
+bool Session::Switch(size_t slot) noexcept {
+  if (slot >= slots_.size()) {
+    return false;
+  }
+  active_ = slot;
+  return true;
+}
+
+std::vector<uint8_t> Session::Read(const std::string& file) {
+  std::ifstream fs{file, std::ios::binary};
+  if (!fs.is_open()) {
+    throw std::runtime_error("can't open ROM file: " + file);
+  }
+  return {std::istreambuf_iterator<char>(fs), {}};
+}
+
+uint64_t Session::Intern(const std::vector<uint8_t>& rom) {
+  // a different image under the same hash takes the next free key, so a
+  // collision can't hand a slot the wrong game
+  for (uint64_t key = Hash(rom.data(), rom.size());; ++key) {
+    const auto result = roms_.try_emplace(key, rom);
+    if (result.second || result.first->second == rom) {
+      return key;
+    }
+  }
+}
+
+uint64_t Session::Hash(const uint8_t* data, size_t size) noexcept {
+  uint64_t hash = 0xCBF29CE484222325u;
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ data[i]) * 0x100000001B3u;
+  }
+  return hash;
+}
+
+} // namespace emu
@@ -0,0 +1,71 @@
+#ifndef EMU_SESSION_H_
+#define EMU_SESSION_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "chip8.h"
+#include "metrics.h"
+
+namespace emu {
+
+// Several machines resident in one process. Only the active one is run by
+// the engine, the others keep their full state and cost nothing until
+// switched to, so a switch is a pointer change. ROM images are kept by
+// content hash, one copy of each distinct image, for Reload() to diff a
+// changed file against.
+class Session {
+  public:
+    struct Slot {
+      std::string name;
+      std::string file; // empty when added from memory
+      uint64_t hash;    // key of the image in roms_, see Intern()
+      std::unique_ptr<Chip8> chip8;
+      std::unique_ptr<Metrics> metrics;
+    };
+
+    Session();
+    ~Session();
+
+    Session(const Session& rhs) = delete;
+    Session(const Session&& rhs) = delete;
+    Session& operator=(const Session& rhs) = delete;
+    Session& operator=(const Session&& rhs) = delete;
+
+    // load a ROM into a new machine, throws like Chip8::LoadRom; the first
+    // slot added becomes the active one
+    size_t Add(const std::string& file, uint64_t seed);
+    size_t Add(const std::string& name, const std::vector<uint8_t>& rom, uint64_t seed);
+
+    // reads the slot's file again and patches the bytes that changed since
+    // the last load into the running machine, see Chip8::Patch; throws like
+    // Add, and on an empty file, which is taken for a save in progress.
+    // Returns the number of bytes patched
+    size_t Reload(size_t slot);
+
+    [[nodiscard]] bool Switch(size_t slot) noexcept;
+
+    [[nodiscard]] Slot& get_active() noexcept { return slots_[active_]; }
+    [[nodiscard]] size_t get_active_index() const noexcept { return active_; }
+    [[nodiscard]] Slot& get_slot(size_t slot) noexcept { return slots_[slot]; }
+    [[nodiscard]] size_t size() const noexcept { return slots_.size(); }
+    [[nodiscard]] bool empty() const noexcept { return slots_.empty(); }
+
+    // FNV-1a, 64 bit
+    static uint64_t Hash(const uint8_t* data, size_t size) noexcept;
+  private:
+    static std::vector<uint8_t> Read(const std::string& file);
+    // stores an image unless an equal one is there, returns its key
+    uint64_t Intern(const std::vector<uint8_t>& rom);
+
+    std::unordered_map<uint64_t, std::vector<uint8_t>> roms_;
+    std::vector<Slot> slots_;
+    size_t active_{};
+};
+
+} // namespace emu
+
+#endif // EMU_SESSION_H_
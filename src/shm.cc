@@ -0,0 +1,194 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "shm.h"
+
+namespace emu {
+
+namespace {
+
+constexpr size_t kSlotsOffset = alignof(shm::ShmSlot);
+constexpr int kReadRetries = 64;
+
+static_assert(sizeof(shm::ShmHeader) <= kSlotsOffset, "header overlaps the slots");
+
+std::string SegmentName(const std::string& name) {
+  return (!name.empty() && name[0] == '/') ? name : "/" + name;
+}
+
+size_t SegmentSize(uint32_t instances) noexcept {
+  return kSlotsOffset + instances * sizeof(shm::ShmSlot);
+}
+
+} // namespace
+
+// publisher
+
+ShmPublisher::ShmPublisher() {}
+
+ShmPublisher::~ShmPublisher() {
+  Close();
+}
+
+int ShmPublisher::Open(const std::string& name, uint32_t instances) {
+  Close();
+  if (instances == 0) {
+    log::Error("shm: no instances to publish");
+    return 1;
+  }
+
+  name_ = SegmentName(name);
+  size_ = SegmentSize(instances);
+  int fd = shm_open(name_.c_str(), O_CREAT | O_RDWR, 0644);
+  if (fd < 0) {
+    log::Error("shm: can't open segment " + name_);
+    return 1;
+  }
+  if (ftruncate(fd, static_cast<off_t>(size_)) != 0) {
+    log::Error("shm: can't size segment " + name_);
+    close(fd);
+    shm_unlink(name_.c_str());
+    return 1;
+  }
+  void* base = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    log::Error("shm: can't map segment " + name_);
+    shm_unlink(name_.c_str());
+    return 1;
+  }
+
+  header_ = static_cast<shm::ShmHeader*>(base);
+  slots_ = reinterpret_cast<shm::ShmSlot*>(static_cast<uint8_t*>(base) + kSlotsOffset);
+
+  // readers wait for the magic, so it goes in after everything else
+  header_->magic.store(0u, std::memory_order_relaxed);
+  header_->version = shm::kVersion;
+  header_->instances = instances;
+  header_->slot_size = sizeof(shm::ShmSlot);
+  for (uint32_t i = 0; i < instances; ++i) {
+    slots_[i].sequence.store(0u, std::memory_order_relaxed);
+    for (auto& row : slots_[i].rows) {
+      row.store(0u, std::memory_order_relaxed);
+    }
+  }
+  header_->magic.store(shm::kMagic, std::memory_order_release);
+  return 0;
+}
+
+void ShmPublisher::Close() {
+  if (header_ == nullptr) {
+    return;
+  }
+  munmap(header_, size_);
+  shm_unlink(name_.c_str());
+  header_ = nullptr;
+  slots_ = nullptr;
+}
+
+void ShmPublisher::Publish(uint32_t instance, const Frame& frame) noexcept {
+  if (header_ == nullptr || instance >= header_->instances) {
+    return;
+  }
+  shm::ShmSlot& slot = slots_[instance];
+  // single writer per slot, a plain load of our own counter is enough
+  uint64_t sequence = slot.sequence.load(std::memory_order_relaxed);
+  slot.sequence.store(sequence + 1u, std::memory_order_relaxed);
+  // the odd count must be visible before any of the rows
+  std::atomic_thread_fence(std::memory_order_release);
+  for (uint16_t y = 0; y < kFrameHeight; ++y) {
+    slot.rows[y].store(frame[y], std::memory_order_relaxed);
+  }
+  slot.sequence.store(sequence + 2u, std::memory_order_release);
+}
+
+// reader
+
+ShmReader::ShmReader() {}
+
+ShmReader::~ShmReader() {
+  Close();
+}
+
+int ShmReader::Open(const std::string& name) {
+  Close();
+
+  const std::string segment = SegmentName(name);
+  int fd = shm_open(segment.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    log::Error("shm: no segment " + segment);
+    return 1;
+  }
+  struct stat st{};
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < SegmentSize(1)) {
+    log::Error("shm: segment too small " + segment);
+    close(fd);
+    return 1;
+  }
+  size_ = static_cast<size_t>(st.st_size);
+  void* base = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    log::Error("shm: can't map segment " + segment);
+    return 1;
+  }
+
+  header_ = static_cast<const shm::ShmHeader*>(base);
+  slots_ = reinterpret_cast<const shm::ShmSlot*>(
+      static_cast<const uint8_t*>(base) + kSlotsOffset);
+  if (header_->magic.load(std::memory_order_acquire) != shm::kMagic
+      || header_->version != shm::kVersion
+      || header_->slot_size != sizeof(shm::ShmSlot)
+      || SegmentSize(header_->instances) > size_) {
+    log::Error("shm: not a framebuffer segment (or an other version) " + segment);
+    Close();
+    return 1;
+  }
+  instances_ = header_->instances;
+  return 0;
+}
+
+void ShmReader::Close() {
+  if (header_ == nullptr) {
+    return;
+  }
+  munmap(const_cast<shm::ShmHeader*>(header_), size_);
+  header_ = nullptr;
+  slots_ = nullptr;
+  instances_ = 0;
+}
+
+bool ShmReader::Read(uint32_t instance, Frame& frame, uint64_t& number) const noexcept {
+  if (instance >= instances_) {
+    return false;
+  }
+  const shm::ShmSlot& slot = slots_[instance];
+  for (int retry = 0; retry < kReadRetries; ++retry) {
+    uint64_t before = slot.sequence.load(std::memory_order_acquire);
+    if ((before & 0x1u) != 0u) {
+      continue;
+    }
+    for (uint16_t y = 0; y < kFrameHeight; ++y) {
+      frame[y] = slot.rows[y].load(std::memory_order_relaxed);
+    }
+    // the rows must be read before the count is checked again
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.sequence.load(std::memory_order_relaxed) == before) {
+      number = before / 2u;
+      return true;
+    }
+  }
+  return false;
+}
+
+uint64_t ShmReader::get_number(uint32_t instance) const noexcept {
+  if (instance >= instances_) {
+    return 0;
+  }
+  return slots_[instance].sequence.load(std::memory_order_acquire) / 2u;
+}
+
+} // namespace emu
@@ -0,0 +1,97 @@
+#ifndef EMU_SHM_H_
+#define EMU_SHM_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "frame.h"
+
+namespace emu {
+
+// Framebuffers published through a POSIX shared memory segment, for
+// monitoring and streaming processes that don't go through SDL. The segment
+// holds one slot per instance, each guarded by a seqlock: the writer never
+// waits for readers, readers retry when they race a write.
+//
+// Layout: ShmHeader, then instances ShmSlot, each on its own cache lines.
+namespace shm {
+
+constexpr uint32_t kMagic = 0x42463843; // "C8FB"
+constexpr uint32_t kVersion = 1;
+
+struct ShmHeader {
+  std::atomic<uint32_t> magic; // written last by the publisher
+  uint32_t version;
+  uint32_t instances;
+  uint32_t slot_size;
+};
+
+struct alignas(64) ShmSlot {
+  // odd while a write is in progress, frame number = sequence / 2
+  std::atomic<uint64_t> sequence;
+  // relaxed atomics so a torn read is a retry, not undefined behaviour
+  std::atomic<uint64_t> rows[kFrameHeight];
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+    "shared memory atomics must be lock free");
+
+} // namespace shm
+
+class ShmPublisher {
+  public:
+    ShmPublisher();
+    ~ShmPublisher();
+
+    ShmPublisher(const ShmPublisher& rhs) = delete;
+    ShmPublisher(const ShmPublisher&& rhs) = delete;
+    ShmPublisher& operator=(const ShmPublisher& rhs) = delete;
+    ShmPublisher& operator=(const ShmPublisher&& rhs) = delete;
+
+    // creates (or takes over) the segment, the name gets a leading '/'
+    [[nodiscard]] int Open(const std::string& name, uint32_t instances = 1);
+    // unmaps and removes the segment
+    void Close();
+
+    // wait free, called once per frame from the emulation thread
+    void Publish(uint32_t instance, const Frame& frame) noexcept;
+
+    [[nodiscard]] bool IsOpen() const noexcept { return header_ != nullptr; }
+  private:
+    std::string name_;
+    size_t size_{};
+    shm::ShmHeader* header_{nullptr};
+    shm::ShmSlot* slots_{nullptr};
+};
+
+class ShmReader {
+  public:
+    ShmReader();
+    ~ShmReader();
+
+    ShmReader(const ShmReader& rhs) = delete;
+    ShmReader(const ShmReader&& rhs) = delete;
+    ShmReader& operator=(const ShmReader& rhs) = delete;
+    ShmReader& operator=(const ShmReader&& rhs) = delete;
+
+    [[nodiscard]] int Open(const std::string& name);
+    void Close();
+
+    // latest complete frame of an instance, false if the writer kept
+    // racing us or the instance does not exist; never blocks the writer
+    [[nodiscard]] bool Read(uint32_t instance, Frame& frame, uint64_t& number) const noexcept;
+
+    // frame number without copying the frame, to poll for changes
+    [[nodiscard]] uint64_t get_number(uint32_t instance) const noexcept;
+    [[nodiscard]] uint32_t get_instances() const noexcept { return instances_; }
+  private:
+    size_t size_{};
+    uint32_t instances_{};
+    const shm::ShmHeader* header_{nullptr};
+    const shm::ShmSlot* slots_{nullptr};
+};
+
+} // namespace emu
+
+#endif // EMU_SHM_H_
@@ -0,0 +1,67 @@
+#include <algorithm>
+
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "watch.h"
+
+namespace emu {
+
+FileWatcher::FileWatcher() {}
+
+FileWatcher::~FileWatcher() {
+  Close();
+}
+
+int FileWatcher::Add(const std::string& file) {
+  if (fd_ < 0) {
+    fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd_ < 0) {
+      log::Error("watch: can't initialize inotify");
+      return 1;
+    }
+  }
+  const size_t slash = file.find_last_of('/');
+  const std::string directory = (slash == std::string::npos) ? "." : file.substr(0, slash + 1);
+  // a finished write, or a file renamed into place
+  const int wd = inotify_add_watch(fd_, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+  if (wd < 0) {
+    log::Error("watch: can't watch " + directory);
+    return 1;
+  }
+  watches_.push_back({wd, file.substr(slash + 1), file});
+  return 0;
+}
+
+void FileWatcher::Close() {
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+  watches_.clear();
+}
+
+std::vector<std::string> FileWatcher::Poll() {
+  std::vector<std::string> changed;
+  alignas(inotify_event) char buffer[4096];
+  ssize_t size;
+  while ((size = read(fd_, buffer, sizeof(buffer))) > 0) {
+    for (ssize_t offset = 0; offset < size;) {
+      const auto* event = reinterpret_cast<const inotify_event*>(buffer + offset);
+      offset += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+      if (event->len == 0) {
+        continue;
+      }
+      for (const auto& watch : watches_) {
+        if (watch.wd == event->wd && watch.name == event->name
+            && std::find(changed.begin(), changed.end(), watch.file) == changed.end()) {
+          changed.push_back(watch.file);
+        }
+      }
+    }
+  }
+  return changed;
+}
+
+} // namespace emu
@@ -0,0 +1,43 @@
+#ifndef EMU_WATCH_H_
+#define EMU_WATCH_H_
+
+#include <string>
+#include <vector>
+
+namespace emu {
+
+// Change notifications for a set of files through inotify. The directories
+// are watched rather than the files: editors save by writing a new file
+// and renaming it over the old one, which a watch on the file would lose.
+class FileWatcher {
+  public:
+    FileWatcher();
+    ~FileWatcher();
+
+    FileWatcher(const FileWatcher& rhs) = delete;
+    FileWatcher(const FileWatcher&& rhs) = delete;
+    FileWatcher& operator=(const FileWatcher& rhs) = delete;
+    FileWatcher& operator=(const FileWatcher&& rhs) = delete;
+
+    [[nodiscard]] int Add(const std::string& file);
+    void Close();
+
+    // files written or replaced since the last call, each once; never
+    // blocks, nothing is allocated when nothing changed
+    std::vector<std::string> Poll();
+
+    [[nodiscard]] bool IsOpen() const noexcept { return fd_ >= 0; }
+  private:
+    struct Watch {
+      int wd;
+      std::string name; // inside the watched directory
+      std::string file; // as given to Add()
+    };
+
+    int fd_{-1};
+    std::vector<Watch> watches_;
+};
+
+} // namespace emu
+
+#endif // EMU_WATCH_H_
@@ -0,0 +1,416 @@
+// Differential conformance runner. The Chip8 core and the reference
+// interpreter run the same program in lockstep and the full machine state is
+// compared after every instruction. Chip8::Run() is checked the same way,
+// once a single instruction at a time and once in blocks of kKeyPeriod
+// instructions compared at the block ends, which is where superinstructions
+// run; a few fixed programs rewrite them right before executing them. A
+// divergence in a random program is shrunk to a minimal failing program
+// before it is reported.
+//
+//   conform [--steps=N] [--random=N] [--seed=S] [ROM...]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "chip8.h"
+#include "debugger.h"
+#include "reference.h"
+
+namespace {
+
+using Program = std::vector<uint8_t>;
+
+constexpr uint16_t kNop = 0x8000; // LD V0, V0
+constexpr uint64_t kKeyPeriod = 64; // instructions between keypad changes
+constexpr size_t kRandomLength = 64; // instructions per random program
+constexpr uint64_t kRandomSteps = 2000;
+// instructions per timer tick the random programs cycle through
+constexpr uint32_t kCyclesPerTick[] = {1, 7, 60};
+
+struct Result {
+  bool ok;
+  uint64_t step;
+  std::string field;
+  uint16_t pc;
+  uint16_t opcode;
+};
+
+uint64_t executed = 0;
+
+// the sound off edge the core announces up front, against the timer of the
+// reference: s ticks left, p instructions into the current one
+bool SoundAgrees(const emu::Chip8& machine, const emu::Chip8::Snapshot& s,
+    uint32_t cycles_per_tick) {
+  if (machine.IsSounding() != (s.sound_timer != 0)) {
+    return false;
+  }
+  const uint64_t cycle = machine.get_cycle();
+  const uint64_t end = machine.get_sound_end();
+  if (s.sound_timer == 0) {
+    return end <= cycle;
+  }
+  return end > cycle
+      && end - cycle == uint64_t{s.sound_timer} * cycles_per_tick - s.tick_phase;
+}
+
+// edit, when given, is patched over the program halfway through, like a
+// hot reload (Chip8::Patch), and the reference gets the same bytes
+Result Lockstep(const Program& rom, uint64_t seed, uint64_t steps,
+    uint32_t cycles_per_tick = 1, const Program* edit = nullptr) {
+  emu::Chip8 chip8{64, 32, seed};
+  emu::Chip8 single{64, 32, seed}; // Run(1) per step
+  emu::Chip8 block{64, 32, seed};  // Run(kKeyPeriod) per keypad change
+  for (emu::Chip8* machine : {&chip8, &single, &block}) {
+    machine->set_cycles_per_tick(cycles_per_tick);
+    machine->LoadRom(rom.data(), rom.size());
+  }
+
+  emu::Chip8::Snapshot expected;
+  emu::Chip8::Snapshot actual;
+  chip8.Save(expected);
+
+  auto check = [&](const emu::Chip8& machine, const char* name) {
+    machine.Save(actual);
+    std::string field = emu::reference::Diff(actual, expected);
+    if (field.empty() && !SoundAgrees(machine, expected, cycles_per_tick)) {
+      field = "sound end";
+    }
+    return field.empty() ? field : name + field;
+  };
+
+  // all machines see the same keypad
+  emu::Xorshift64 keys{seed};
+  uint16_t block_pc = 0;
+  uint16_t block_opcode = 0;
+  // at a block boundary, between two Run() calls of the block machine
+  const uint64_t edit_step = steps / 2 / kKeyPeriod * kKeyPeriod;
+  for (uint64_t step = 0; step < steps; ++step) {
+    if (edit != nullptr && step == edit_step) {
+      for (emu::Chip8* machine : {&chip8, &single, &block}) {
+        machine->Patch(emu::Chip8::kEntryPointAddr, edit->data(), edit->size());
+      }
+      std::copy(edit->begin(), edit->end(),
+          expected.memory.begin() + emu::Chip8::kEntryPointAddr);
+    }
+    if (step % kKeyPeriod == 0) {
+      if (step != 0) {
+        std::string field = check(block, "Run(block): ");
+        if (!field.empty()) {
+          return {false, step - 1, field, block_pc, block_opcode};
+        }
+      }
+      for (auto& key : expected.keypad) {
+        key = (keys.NextByte() < 32u) ? 1 : 0;
+      }
+      chip8.get_keypad() = expected.keypad;
+      single.get_keypad() = expected.keypad;
+      // a save state round trip must not change anything, the timer phase
+      // included
+      block.Save(actual);
+      block.Load(actual);
+      block.get_keypad() = expected.keypad;
+      block.Run(static_cast<uint32_t>(std::min(kKeyPeriod, steps - step)));
+    }
+
+    uint16_t pc = expected.pc;
+    uint16_t opcode = (expected.memory[pc & 0xFFFu] << 8u)
+        | expected.memory[(pc + 1u) & 0xFFFu];
+    block_pc = pc;
+    block_opcode = opcode;
+
+    chip8.Cycle();
+    single.Run(1);
+    emu::reference::Step(expected, cycles_per_tick);
+    ++executed;
+
+    std::string field = check(chip8, "");
+    if (field.empty()) {
+      field = check(single, "Run: ");
+    }
+    if (!field.empty()) {
+      return {false, step, field, pc, opcode};
+    }
+  }
+  if (steps != 0) {
+    std::string field = check(block, "Run(block): ");
+    if (!field.empty()) {
+      return {false, steps - 1, field, block_pc, block_opcode};
+    }
+    // the statistics must not depend on the execution path either
+    auto same = [](const emu::Chip8::Counters& a, const emu::Chip8::Counters& b) {
+      return a.instructions == b.instructions && a.draws == b.draws
+          && a.timer_ticks == b.timer_ticks;
+    };
+    if (!same(chip8.get_counters(), single.get_counters())
+        || !same(chip8.get_counters(), block.get_counters())) {
+      return {false, steps - 1, "counters", block_pc, block_opcode};
+    }
+  }
+  return {true, steps, {}, 0, 0};
+}
+
+uint16_t Word(const Program& program, size_t i) {
+  return static_cast<uint16_t>((program[2 * i] << 8u) | program[2 * i + 1]);
+}
+
+void SetWord(Program& program, size_t i, uint16_t word) {
+  program[2 * i] = static_cast<uint8_t>(word >> 8u);
+  program[2 * i + 1] = static_cast<uint8_t>(word);
+}
+
+// random but mostly meaningful instructions, jumps stay inside the program
+Program RandomProgram(emu::Xorshift64& rng, size_t length) {
+  static constexpr uint8_t kF[] = {
+    0x07, 0x0A, 0x15, 0x18, 0x1E, 0x29, 0x33, 0x55, 0x65
+  };
+  auto byte = [&rng] { return static_cast<uint16_t>(rng.NextByte()); };
+
+  Program program(2 * length);
+  for (size_t i = 0; i < length; ++i) {
+    uint16_t x = byte() & 0xFu;
+    uint16_t y = byte() & 0xFu;
+    uint16_t target = emu::Chip8::kEntryPointAddr
+        + 2u * (((byte() << 8u) | byte()) % length);
+    uint16_t op = static_cast<uint16_t>((byte() << 8u) | byte());
+    switch (byte() & 0xFu) {
+      case 0x0: op = (byte() & 1u) ? 0x00E0u : 0x00EEu; break;
+      case 0x1: op = 0x1000u | target; break;
+      case 0x2: op = 0x2000u | target; break;
+      case 0x3: op = 0x8000u | (x << 8u) | (y << 4u) | (byte() % 9u); break;
+      case 0x4: op = 0x8000u | (x << 8u) | (y << 4u) | 0xEu; break;
+      case 0x5: op = 0x6000u | (x << 8u) | byte(); break;
+      case 0x6: op = 0x7000u | (x << 8u) | byte(); break;
+      case 0x7:
+        // half into the program itself, so Fx33/Fx55 rewrite code
+        op = 0xA000u | ((byte() & 1u) ? target : (((byte() << 8u) | byte()) & 0xFFFu));
+        break;
+      case 0x8: op = 0xD000u | (x << 8u) | (y << 4u) | (byte() & 0xFu); break;
+      case 0x9: op = 0xF000u | (x << 8u) | kF[byte() % sizeof(kF)]; break;
+      case 0xA: op = 0xC000u | (x << 8u) | byte(); break;
+      case 0xB: op = 0xB000u | (target - (byte() & 0x3Fu)); break;
+      default: break; // fully random word, including undefined opcodes
+    }
+    SetWord(program, i, op);
+  }
+
+  // the wait loops Run() fuses, they need a jump back to their own start
+  const size_t at = ((byte() << 8u) | byte()) % (length - 2);
+  const uint16_t self = emu::Chip8::kEntryPointAddr + 2u * at;
+  const uint16_t x = byte() & 0xFu;
+  switch (byte() & 0x3u) {
+    case 0x0:
+      SetWord(program, at, 0x1000u | self);
+      break;
+    case 0x1:
+      // loop on the test not skipping, or on it skipping
+      SetWord(program, at, 0xE000u | (x << 8u) | ((byte() & 1u) ? 0x9Eu : 0xA1u));
+      SetWord(program, at + 1 + (byte() & 1u), 0x1000u | self);
+      break;
+    case 0x2:
+      SetWord(program, at, 0xF007u | (x << 8u));
+      SetWord(program, at + 1, ((byte() & 1u) ? 0x3000u : 0x4000u) | (x << 8u) | (byte() & 0x3Fu));
+      SetWord(program, at + 2, 0x1000u | self);
+      break;
+    default:
+      break;
+  }
+  return program;
+}
+
+// the program with a few instructions replaced, as a developer would
+Program Edit(const Program& program, emu::Xorshift64& rng) {
+  const size_t length = program.size() / 2;
+  const Program words = RandomProgram(rng, length);
+  Program edited = program;
+  for (uint8_t n = 1 + (rng.NextByte() & 0x3u); n > 0; --n) {
+    const size_t i = rng.NextByte() % length;
+    SetWord(edited, i, Word(words, i));
+  }
+  // and often the loop the program sits in, which Run() has fused
+  std::vector<size_t> loops;
+  for (size_t i = 0; i < length; ++i) {
+    const uint16_t family = Word(program, i) >> 12u;
+    if (family == 0x1u || family == 0xEu || family == 0xFu) {
+      loops.push_back(i);
+    }
+  }
+  if (!loops.empty()) {
+    const size_t i = loops[rng.NextByte() % loops.size()];
+    SetWord(edited, i, Word(words, i));
+  }
+  return edited;
+}
+
+// Fx33/Fx55 rewriting the sequences Run() fuses right before they execute,
+// too unlikely to come up at random
+const std::vector<std::vector<uint16_t>> kSelfModifying = {
+  // 6xkk pair at 20A overwritten with 00E0
+  {0x6000, 0x61E0, 0xA20A, 0xF155, 0x8000, 0x6401, 0x6501, 0x120E},
+  // 7xkk pair at 20A overwritten with BCD digits
+  {0x6200, 0xA20A, 0xF233, 0x8000, 0x8000, 0x7105, 0x7205, 0x120E},
+  // Annn Dxyn at 20C turned into Annn Fx65
+  {0x60F1, 0x6165, 0xA20E, 0xF155, 0x8000, 0x8000, 0xA050, 0xD015, 0x1210},
+  // a jump to itself at 20A overwritten with 00E0
+  {0x6000, 0x61E0, 0xA20A, 0xF155, 0x8000, 0x120A, 0x120C},
+};
+
+Program Words(const std::vector<uint16_t>& words) {
+  Program program(2 * words.size());
+  for (size_t i = 0; i < words.size(); ++i) {
+    SetWord(program, i, words[i]);
+  }
+  return program;
+}
+
+// nop out every instruction that is not needed to reproduce the
+// divergence, then drop the trailing nops
+Result Shrink(Program& program, uint64_t seed, uint32_t cycles_per_tick, Result result,
+    const Program* edit) {
+  const size_t length = program.size() / 2;
+  // repeat until nothing else can go, removing one instruction can make
+  // another one redundant
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (size_t n = length; n-- > 0;) {
+      if (Word(program, n) == kNop) {
+        continue;
+      }
+      Program candidate = program;
+      SetWord(candidate, n, kNop);
+      Result r = Lockstep(candidate, seed, result.step + 1, cycles_per_tick, edit);
+      if (!r.ok) {
+        program = candidate;
+        result = r;
+        changed = true;
+      }
+    }
+  }
+  while (program.size() >= 2 && Word(program, program.size() / 2 - 1) == kNop) {
+    program.resize(program.size() - 2);
+  }
+  return result;
+}
+
+void Report(const std::string& name, const Result& result) {
+  char buffer[128];
+  std::snprintf(buffer, sizeof(buffer),
+      "%s: %s differs after step %llu (pc=%03X op=%04X ",
+      name.c_str(), result.field.c_str(),
+      static_cast<unsigned long long>(result.step), result.pc, result.opcode);
+  emu::log::Failure(buffer + emu::Debugger::Disassemble(result.opcode) + ")");
+  // Dump() prints directly, keep it below the report
+  emu::log::Flush();
+}
+
+// the shrunk program, every word not listed is a nop (8000)
+void Dump(const Program& program) {
+  for (size_t i = 0; i < program.size() / 2; ++i) {
+    char buffer[32];
+    uint16_t word = Word(program, i);
+    if (word == kNop) {
+      continue;
+    }
+    std::snprintf(buffer, sizeof(buffer), "  %03zX: %04X  ",
+        emu::Chip8::kEntryPointAddr + 2 * i, word);
+    std::printf("%s%s\n", buffer, emu::Debugger::Disassemble(word).c_str());
+  }
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  uint64_t steps = 200000;
+  uint64_t programs = 2000;
+  uint64_t seed = 1;
+  std::vector<std::string> roms;
+
+  try {
+    for (int i = 1; i < argc; ++i) {
+      const std::string arg = argv[i];
+      if (arg.rfind("--steps=", 0) == 0) {
+        steps = std::stoull(arg.substr(8));
+      } else if (arg.rfind("--random=", 0) == 0) {
+        programs = std::stoull(arg.substr(9));
+      } else if (arg.rfind("--seed=", 0) == 0) {
+        seed = std::stoull(arg.substr(7));
+      } else {
+        roms.push_back(arg);
+      }
+    }
+  } catch (std::exception& e) {
+    emu::log::Error("Usage: " + std::string(argv[0])
+        + " [--steps=N] [--random=N] [--seed=S] [ROM...]");
+    return 1;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  int failures = 0;
+
+  for (const auto& rom : roms) {
+    std::ifstream fs{rom, std::ios::binary};
+    if (!fs.is_open()) {
+      emu::log::Error("can't open ROM file: " + rom);
+      return 1;
+    }
+    Program program{std::istreambuf_iterator<char>(fs), {}};
+    Result result = Lockstep(program, seed, steps);
+    if (result.ok) {
+      emu::log::Success(rom);
+    } else {
+      Report(rom, result);
+      ++failures;
+    }
+  }
+
+  for (size_t i = 0; i < kSelfModifying.size(); ++i) {
+    Result result = Lockstep(Words(kSelfModifying[i]), seed, kKeyPeriod);
+    if (!result.ok) {
+      Report("self-modifying program " + std::to_string(i), result);
+      ++failures;
+    }
+  }
+
+  emu::Xorshift64 rng{seed};
+  uint64_t diverged = 0;
+  for (uint64_t i = 0; i < programs; ++i) {
+    Program program = RandomProgram(rng, kRandomLength);
+    uint64_t program_seed = seed + i;
+    uint32_t cycles_per_tick = kCyclesPerTick[i % std::size(kCyclesPerTick)];
+    // every other program is hot patched, from its own stream so the
+    // programs stay the same for a given --seed
+    emu::Xorshift64 edit_rng{~program_seed};
+    const Program edited = Edit(program, edit_rng);
+    const Program* edit = (i % 2 == 1) ? &edited : nullptr;
+    Result result = Lockstep(program, program_seed, kRandomSteps, cycles_per_tick, edit);
+    if (result.ok) {
+      continue;
+    }
+    ++diverged;
+    ++failures;
+    result = Shrink(program, program_seed, cycles_per_tick, result, edit);
+    Report("random program " + std::to_string(i)
+        + " (seed " + std::to_string(program_seed)
+        + ", " + std::to_string(cycles_per_tick) + " cycles per tick"
+        + (edit != nullptr ? ", patched" : "") + ")", result);
+    Dump(program);
+  }
+  if (programs != 0 && diverged == 0) {
+    emu::log::Success(std::to_string(programs) + " random programs");
+  }
+
+  double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+  char buffer[96];
+  std::snprintf(buffer, sizeof(buffer),
+      "%llu instructions in %.2f s (%.1f M/s)",
+      static_cast<unsigned long long>(executed), seconds,
+      executed / seconds / 1e6);
+  emu::log::Info(buffer);
+
+  return (failures == 0) ? 0 : 1;
+}
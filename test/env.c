@@ -0,0 +1,206 @@
+/* RL environment through its C ABI (inc/chip8_env.h), linked against the
+ * shared library the bindings load. Written in C so the header is checked
+ * as C too. Refuses bad configs, resets, steps with plain and sticky
+ * actions, and checks the rewards, the episode ends and the strided
+ * observation view.
+ *
+ *   envtest
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "chip8_env.h"
+
+#define INSTANCES 3
+#define STEPS 64
+#define SCORE_ADDR 0x300
+
+static int failures = 0;
+
+static void check(int ok, const char* what) {
+  if (!ok) {
+    printf("FAILED: %s\n", what);
+    ++failures;
+  }
+}
+
+/* draws the digit 0 at the top left, then once per frame adds one to a
+ * count if key 0 is held and writes the count as BCD to SCORE_ADDR; the
+ * delay timer wait puts the key check at the start of every step */
+static const uint8_t kRom[] = {
+  0x60, 0x00, /* 200: v0 = 0 */
+  0xF0, 0x29, /* 202: I = font(v0) */
+  0xD0, 0x05, /* 204: draw 5 rows at (v0, v0) */
+  0xA3, 0x00, /* 206: I = SCORE_ADDR */
+  0x61, 0x00, /* 208: v1 = 0, the key */
+  0x63, 0x01, /* 20A: v3 = 1 */
+  0xE1, 0xA1, /* 20C: skip if key v1 is up */
+  0x72, 0x01, /* 20E: v2 += 1 */
+  0xF2, 0x33, /* 210: BCD of v2 at I */
+  0xF3, 0x15, /* 212: delay timer = v3 */
+  0xF4, 0x07, /* 214: v4 = delay timer */
+  0x34, 0x00, /* 216: skip if v4 == 0 */
+  0x12, 0x14, /* 218: jump 214 */
+  0x12, 0x0C, /* 21A: jump 20C */
+};
+
+/* one byte over the 3584 that fit above 0x200 */
+static const uint8_t kTooLarge[3585];
+
+static const chip8_env_reward kReward = { SCORE_ADDR, CHIP8_ENV_REWARD_BCD, 1.0f };
+
+static chip8_env* create(float sticky, uint32_t max_frames) {
+  chip8_env_config config;
+  memset(&config, 0, sizeof(config));
+  config.frame_skip = 1;
+  config.cycles_per_frame = 16;
+  config.sticky = sticky;
+  config.max_frames = max_frames;
+  config.rewards = &kReward;
+  config.reward_count = 1;
+  return chip8_env_create(kRom, sizeof(kRom), INSTANCES, &config);
+}
+
+/* every instance shows the digit 0 at the top left and nothing else */
+static int observations_ok(const chip8_env* env) {
+  size_t stride = 0;
+  const uint8_t* base = chip8_env_observation(env, &stride);
+  if (base == NULL || stride < 32 * sizeof(uint64_t)) {
+    return 0;
+  }
+  /* font 0 is F0 90 90 90 F0, bit 63 is the leftmost pixel */
+  static const uint64_t kRows[5] = { 0xF0, 0x90, 0x90, 0x90, 0xF0 };
+  for (size_t i = 0; i < INSTANCES; ++i) {
+    uint64_t rows[32];
+    memcpy(rows, base + i * stride, sizeof(rows));
+    for (int y = 0; y < 32; ++y) {
+      uint64_t expected = (y < 5) ? kRows[y] << 56 : 0;
+      if (rows[y] != expected) {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+static void plain(void) {
+  chip8_env* env = create(0.0f, 10);
+  check(env != NULL, "create");
+  if (env == NULL) {
+    return;
+  }
+  chip8_env_reset(env, 1);
+
+  /* instance 1 holds key 0, the others don't */
+  const uint16_t actions[INSTANCES] = { 0x0000, 0x0001, 0x0000 };
+  chip8_env_step(env, actions);
+  const float* rewards = chip8_env_rewards(env);
+  check(rewards[0] == 0.0f && rewards[2] == 0.0f, "no reward without the key");
+  check(rewards[1] == 1.0f, "reward with the key");
+  check(observations_ok(env), "observation view");
+
+  const uint8_t* dones = chip8_env_dones(env);
+  for (int step = 1; step < 9; ++step) {
+    chip8_env_step(env, actions);
+  }
+  check(!dones[0] && !dones[1] && !dones[2], "running before max_frames");
+  chip8_env_step(env, actions);
+  check(dones[0] && dones[1] && dones[2], "done at max_frames");
+
+  chip8_env_reset_one(env, 1, 7);
+  check(!dones[1] && dones[0], "reset_one resets only its instance");
+  chip8_env_reset(env, 1);
+  check(!dones[0] && !dones[1] && !dones[2], "reset clears done");
+  chip8_env_destroy(env);
+}
+
+/* sum of rewards of instance 0 while alternating key 0 and nothing, and
+ * the number of steps without the key that still scored: the last action
+ * was repeated */
+static float alternate(float sticky, int* repeated) {
+  chip8_env* env = create(sticky, 0);
+  if (env == NULL) {
+    return -1.0f;
+  }
+  chip8_env_reset(env, 42);
+  float total = 0.0f;
+  *repeated = 0;
+  for (int step = 0; step < STEPS; ++step) {
+    uint16_t actions[INSTANCES];
+    for (size_t i = 0; i < INSTANCES; ++i) {
+      actions[i] = (step % 2 == 0) ? 0x0001 : 0x0000;
+    }
+    chip8_env_step(env, actions);
+    const float reward = chip8_env_rewards(env)[0];
+    total += reward;
+    if (step % 2 == 1 && reward > 0.0f) {
+      ++*repeated;
+    }
+  }
+  chip8_env_destroy(env);
+  return total;
+}
+
+static void sticky(void) {
+  int repeated = 0;
+  check(alternate(0.0f, &repeated) == STEPS / 2 && repeated == 0,
+      "no repeats without sticky actions");
+
+  /* always repeating the last action, which starts as nothing */
+  check(alternate(1.0f, &repeated) == 0.0f, "sticky 1 never presses");
+
+  int again = 0;
+  const float total = alternate(0.5f, &repeated);
+  check(repeated > 0 && repeated < STEPS / 2, "sticky 0.5 repeats some actions");
+  check(alternate(0.5f, &again) == total && again == repeated, "sticky actions are seeded");
+}
+
+/* configs that would hang or never advance the machines, or that name a
+ * reward the environment doesn't know, are refused */
+static void bad_configs(void) {
+  chip8_env_config config;
+  memset(&config, 0, sizeof(config));
+  check(chip8_env_create(kRom, sizeof(kRom), 1, &config) == NULL, "zeroed config");
+
+  config.frame_skip = 1;
+  config.cycles_per_frame = -1;
+  check(chip8_env_create(kRom, sizeof(kRom), 1, &config) == NULL, "negative cycles_per_frame");
+  config.cycles_per_frame = 1 << 20;
+  config.frame_skip = 1 << 20;
+  check(chip8_env_create(kRom, sizeof(kRom), 1, &config) == NULL, "cycles per step overflow");
+
+  config.frame_skip = 1;
+  config.cycles_per_frame = 16;
+  config.sticky = 1.5f;
+  check(chip8_env_create(kRom, sizeof(kRom), 1, &config) == NULL, "sticky above 1");
+  config.sticky = -0.5f;
+  check(chip8_env_create(kRom, sizeof(kRom), 1, &config) == NULL, "sticky below 0");
+
+  const chip8_env_reward unknown = { SCORE_ADDR, 7, 1.0f };
+  config.sticky = 0.0f;
+  config.rewards = &unknown;
+  config.reward_count = 1;
+  check(chip8_env_create(kRom, sizeof(kRom), 1, &config) == NULL, "unknown reward kind");
+  config.rewards = NULL;
+  check(chip8_env_create(kRom, sizeof(kRom), 1, &config) == NULL, "reward_count without rewards");
+
+  config.rewards = &kReward;
+  chip8_env* env = chip8_env_create(kRom, sizeof(kRom), 1, &config);
+  check(env != NULL, "the fixed config");
+  chip8_env_destroy(env);
+}
+
+int main(void) {
+  check(chip8_env_create(NULL, 0, 1, NULL) == NULL, "no ROM");
+  check(chip8_env_create(kTooLarge, sizeof(kTooLarge), 1, NULL) == NULL, "ROM too large");
+  bad_configs();
+  plain();
+  sticky();
+  if (failures != 0) {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  printf("all checks passed\n");
+  return 0;
+}
@@ -0,0 +1,326 @@
+// Netplay loopback test. Two processes play the same ROM against each other
+// over 127.0.0.1, each with its own scripted keypad, through links with
+// latency, jitter and packet loss injected by Netplay itself. Once both
+// have every input, their machines must be bit identical to a local run
+// that knew the inputs up front, however many rollbacks it took. Then the
+// rollback itself is timed: restoring a snapshot and running kMaxRollback
+// frames again must stay well under a millisecond.
+//
+//   netplay [--frames=N] [--cycles=N] [--latency=MS] [--jitter=MS] [--loss=PCT] ROM
+//
+// The second process is this binary again, with --player=1.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "chip8.h"
+#include "netplay.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr auto kTimeout = std::chrono::seconds(20);
+// after both sides have everything, so the peer hears our last acks
+constexpr auto kLinger = std::chrono::milliseconds(200);
+constexpr uint32_t kBenchmarkRounds = 200;
+constexpr uint64_t kBudgetNs = 1000000;
+
+struct Options {
+  uint32_t frames{300};
+  uint32_t cycles{200};
+  uint32_t latency{20};
+  uint32_t jitter{10};
+  uint32_t loss{10};
+  std::string rom;
+  // the second process
+  int player{0};
+  uint16_t port{};
+  uint16_t peer_port{};
+  int result_fd{-1};
+};
+
+// what a player holds at a frame: player 0 moves with 1 and 4, player 1
+// with C and D, each changing on its own beat so the changes interleave
+uint16_t Script(int player, uint32_t frame) {
+  static const uint16_t kKeys[2][4] = {
+    {0x0000, 0x0002, 0x0010, 0x0000},
+    {0x0000, 0x1000, 0x2000, 0x1000},
+  };
+  const uint32_t beat = (player == 0) ? 11u : 17u;
+  uint64_t z = (static_cast<uint64_t>(player) << 32u) + frame / beat;
+  z = (z ^ (z >> 30u)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27u)) * 0x94D049BB133111EBull;
+  z ^= z >> 31u;
+  return kKeys[player][z & 0x3u];
+}
+
+void Press(emu::Chip8& chip8, uint16_t keys) {
+  auto& keypad = chip8.get_keypad();
+  for (uint8_t key = 0; key < 16; ++key) {
+    keypad[key] = (keys >> key) & 0x1u;
+  }
+}
+
+uint64_t StateHash(const emu::Chip8& chip8) {
+  std::unique_ptr<emu::Chip8::Snapshot> snapshot{new emu::Chip8::Snapshot{}};
+  chip8.Save(*snapshot);
+  return emu::Netplay::Hash(*snapshot);
+}
+
+std::unique_ptr<emu::Chip8> Machine(const Options& options) {
+  std::unique_ptr<emu::Chip8> chip8{new emu::Chip8{emu::kFrameWidth, emu::kFrameHeight}};
+  chip8->LoadRom(options.rom);
+  return chip8;
+}
+
+// one side of the game, returns the result line
+std::string Play(const Options& options) {
+  auto chip8 = Machine(options);
+  emu::Netplay netplay;
+  emu::Netplay::Config config{};
+  config.port = options.port;
+  config.peer = "127.0.0.1:" + std::to_string(options.peer_port);
+  config.cycles_per_frame = options.cycles;
+  config.seed = emu::Chip8::kDefaultSeed;
+  config.latency_ms = options.latency;
+  config.jitter_ms = options.jitter;
+  config.loss_percent = options.loss;
+  if (netplay.Open(config, *chip8) != 0) {
+    return "error open";
+  }
+
+  // as fast as the link allows, the stalls are where it waits
+  const auto deadline = Clock::now() + kTimeout;
+  while (netplay.get_frame() < options.frames && Clock::now() < deadline) {
+    if (!netplay.Advance(Script(options.player, netplay.get_frame()))) {
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+  }
+  auto end = deadline;
+  bool done = false;
+  while (Clock::now() < end) {
+    netplay.Poll();
+    if (!done && netplay.get_confirmed() >= options.frames
+        && netplay.get_acknowledged() >= options.frames) {
+      done = true;
+      end = std::min(deadline, Clock::now() + kLinger);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  if (netplay.get_confirmed() < options.frames) {
+    return "error timeout at frame " + std::to_string(netplay.get_confirmed());
+  }
+
+  const auto& stats = netplay.get_stats();
+  char line[256];
+  std::snprintf(line, sizeof(line),
+      "%016llx %d %llu %llu %u %llu %llu %llu %llu %llu",
+      static_cast<unsigned long long>(StateHash(*chip8)),
+      netplay.IsDesynced() ? 1 : 0,
+      static_cast<unsigned long long>(stats.rollbacks),
+      static_cast<unsigned long long>(stats.resimulated),
+      stats.max_depth,
+      static_cast<unsigned long long>(stats.max_rollback_ns),
+      static_cast<unsigned long long>(stats.stalls),
+      static_cast<unsigned long long>(stats.packets_sent),
+      static_cast<unsigned long long>(stats.packets_received),
+      static_cast<unsigned long long>(stats.packets_dropped));
+  return line;
+}
+
+// the game without a network, every input known from the start
+uint64_t Reference(const Options& options) {
+  auto chip8 = Machine(options);
+  chip8->Seed(emu::Chip8::kDefaultSeed);
+  chip8->set_cycles_per_tick(options.cycles);
+  for (uint32_t frame = 0; frame < options.frames; ++frame) {
+    Press(*chip8, Script(0, frame) | Script(1, frame));
+    chip8->Run(options.cycles);
+  }
+  return StateHash(*chip8);
+}
+
+// average ns to restore a snapshot and run kMaxRollback frames again
+uint64_t Benchmark(const Options& options) {
+  auto chip8 = Machine(options);
+  chip8->set_cycles_per_tick(options.cycles);
+  std::unique_ptr<emu::Chip8::Snapshot> snapshot{new emu::Chip8::Snapshot{}};
+  chip8->Save(*snapshot);
+
+  const auto start = Clock::now();
+  for (uint32_t round = 0; round < kBenchmarkRounds; ++round) {
+    chip8->Load(*snapshot);
+    for (uint32_t frame = 0; frame < emu::Netplay::kMaxRollback; ++frame) {
+      // every frame takes a snapshot on the way, like Netplay does
+      chip8->Save(*snapshot);
+      Press(*chip8, Script(0, round + frame) | Script(1, round + frame));
+      chip8->Run(options.cycles);
+    }
+  }
+  return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+      Clock::now() - start).count()) / kBenchmarkRounds;
+}
+
+void Report(const char* who, const std::string& line) {
+  unsigned long long hash, rollbacks, resimulated, max_ns, stalls, sent, received, dropped;
+  int desync;
+  unsigned depth;
+  if (std::sscanf(line.c_str(), "%llx %d %llu %llu %u %llu %llu %llu %llu %llu",
+          &hash, &desync, &rollbacks, &resimulated, &depth, &max_ns, &stalls,
+          &sent, &received, &dropped) != 10) {
+    std::printf("%s: %s\n", who, line.c_str());
+    return;
+  }
+  std::printf("%s: %llu rollbacks, %llu frames resimulated, depth max %u, rollback max %.1f us,"
+      " %llu stalls, %llu packets sent, %llu received, %llu dropped\n",
+      who, rollbacks, resimulated, depth, max_ns / 1e3, stalls, sent, received, dropped);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  const std::string usage = "Usage: " + std::string(argv[0])
+      + " [--frames=N] [--cycles=N] [--latency=MS] [--jitter=MS] [--loss=PCT] ROM";
+  Options options{};
+  try {
+    for (int i = 1; i < argc; ++i) {
+      const std::string arg = argv[i];
+      if (arg.rfind("--frames=", 0) == 0) {
+        options.frames = static_cast<uint32_t>(std::stoul(arg.substr(9)));
+      } else if (arg.rfind("--cycles=", 0) == 0) {
+        options.cycles = static_cast<uint32_t>(std::stoul(arg.substr(9)));
+      } else if (arg.rfind("--latency=", 0) == 0) {
+        options.latency = static_cast<uint32_t>(std::stoul(arg.substr(10)));
+      } else if (arg.rfind("--jitter=", 0) == 0) {
+        options.jitter = static_cast<uint32_t>(std::stoul(arg.substr(9)));
+      } else if (arg.rfind("--loss=", 0) == 0) {
+        options.loss = static_cast<uint32_t>(std::stoul(arg.substr(7)));
+      } else if (arg.rfind("--player=", 0) == 0) {
+        options.player = std::stoi(arg.substr(9));
+      } else if (arg.rfind("--port=", 0) == 0) {
+        options.port = static_cast<uint16_t>(std::stoul(arg.substr(7)));
+      } else if (arg.rfind("--peer-port=", 0) == 0) {
+        options.peer_port = static_cast<uint16_t>(std::stoul(arg.substr(12)));
+      } else if (arg.rfind("--result-fd=", 0) == 0) {
+        options.result_fd = std::stoi(arg.substr(12));
+      } else if (arg.rfind("--", 0) == 0) {
+        throw std::invalid_argument(arg);
+      } else {
+        options.rom = arg;
+      }
+    }
+  } catch (std::exception& e) {
+    std::fprintf(stderr, "%s\n", usage.c_str());
+    return 1;
+  }
+  if (options.rom.empty()) {
+    std::fprintf(stderr, "%s\n", usage.c_str());
+    return 1;
+  }
+
+  try {
+    if (options.result_fd >= 0) {
+      // the second process
+      const std::string line = Play(options) + "\n";
+      const bool written = write(options.result_fd, line.data(), line.size())
+          == static_cast<ssize_t>(line.size());
+      close(options.result_fd);
+      return written ? 0 : 1;
+    }
+
+    // ports from the pid, so parallel runs don't collide
+    options.port = static_cast<uint16_t>(30000 + (getpid() % 15000) * 2);
+    options.peer_port = static_cast<uint16_t>(options.port + 1);
+    std::printf("%u frames of %s, %u instructions each, %u ms latency, %u ms jitter, %u%% loss\n",
+        options.frames, options.rom.c_str(), options.cycles,
+        options.latency, options.jitter, options.loss);
+    std::fflush(stdout);
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+      std::fprintf(stderr, "can't create a pipe\n");
+      return 1;
+    }
+    const pid_t pid = fork();
+    if (pid < 0) {
+      std::fprintf(stderr, "can't fork\n");
+      return 1;
+    }
+    if (pid == 0) {
+      close(fds[0]);
+      const std::string args[] = {
+        "--frames=" + std::to_string(options.frames),
+        "--cycles=" + std::to_string(options.cycles),
+        "--latency=" + std::to_string(options.latency),
+        "--jitter=" + std::to_string(options.jitter),
+        "--loss=" + std::to_string(options.loss),
+        "--player=1",
+        "--port=" + std::to_string(options.peer_port),
+        "--peer-port=" + std::to_string(options.port),
+        "--result-fd=" + std::to_string(fds[1]),
+      };
+      char* child_argv[] = {
+        argv[0],
+        const_cast<char*>(args[0].c_str()), const_cast<char*>(args[1].c_str()),
+        const_cast<char*>(args[2].c_str()), const_cast<char*>(args[3].c_str()),
+        const_cast<char*>(args[4].c_str()), const_cast<char*>(args[5].c_str()),
+        const_cast<char*>(args[6].c_str()), const_cast<char*>(args[7].c_str()),
+        const_cast<char*>(args[8].c_str()), const_cast<char*>(options.rom.c_str()),
+        nullptr,
+      };
+      execv("/proc/self/exe", child_argv);
+      _exit(127);
+    }
+    close(fds[1]);
+
+    const std::string local = Play(options);
+    std::string remote;
+    char buffer[256];
+    ssize_t size;
+    while ((size = read(fds[0], buffer, sizeof(buffer))) > 0) {
+      remote.append(buffer, static_cast<size_t>(size));
+    }
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (!remote.empty() && remote.back() == '\n') {
+      remote.pop_back();
+    }
+
+    Report("player 0", local);
+    Report("player 1", remote);
+    const uint64_t reference = Reference(options);
+    const std::string expected = [reference]() {
+      char hash[17];
+      std::snprintf(hash, sizeof(hash), "%016llx", static_cast<unsigned long long>(reference));
+      return std::string{hash};
+    }();
+    std::printf("reference: %s\n", expected.c_str());
+
+    // the hash, then no desync seen
+    auto matches = [&expected](const std::string& line) {
+      return line.compare(0, expected.size() + 2, expected + " 0") == 0;
+    };
+    const bool ok = matches(local) && matches(remote)
+        && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    std::printf("final states %s\n", ok ? "match" : "DIVERGE");
+
+    const uint64_t rollback_ns = Benchmark(options);
+    const bool fast = rollback_ns < kBudgetNs;
+    std::printf("rollback of %u frames: %.1f us on average, budget %.1f us%s\n",
+        emu::Netplay::kMaxRollback, rollback_ns / 1e3, kBudgetNs / 1e3, fast ? "" : ", TOO SLOW");
+    return (ok && fast) ? 0 : 1;
+  } catch (std::exception& e) {
+    std::fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+}
@@ -0,0 +1,241 @@
+#include <cstdio>
+#include <cstring>
+
+#include "reference.h"
+
+namespace emu {
+
+namespace reference {
+
+namespace {
+
+constexpr uint16_t kFontSetAddr = 0x50;
+
+uint8_t& Mem(Chip8::Snapshot& s, unsigned addr) noexcept {
+  return s.memory[addr % s.memory.size()];
+}
+
+bool Pixel(const Chip8::Snapshot& s, unsigned x, unsigned y) noexcept {
+  return GetPixel(s.video, static_cast<uint16_t>(x), static_cast<uint16_t>(y));
+}
+
+void FlipPixel(Chip8::Snapshot& s, unsigned x, unsigned y) noexcept {
+  s.video[y] ^= uint64_t{1} << (kFrameWidth - 1u - x);
+}
+
+} // namespace
+
+void Step(Chip8::Snapshot& s, uint32_t cycles_per_tick) noexcept {
+  const unsigned opcode = (Mem(s, s.pc) << 8u) | Mem(s, s.pc + 1u);
+  s.pc += 2;
+
+  const unsigned x = (opcode >> 8u) & 0xFu;
+  const unsigned y = (opcode >> 4u) & 0xFu;
+  const unsigned n = opcode & 0xFu;
+  const unsigned kk = opcode & 0xFFu;
+  const unsigned nnn = opcode & 0xFFFu;
+  auto& v = s.registers;
+
+  switch (opcode >> 12u) {
+    // the decoder only looks at the low nibble of 0, 8 and E opcodes and at
+    // the low byte of F opcodes, anything else is ignored
+    case 0x0:
+      if (n == 0x0) {
+        s.video.fill(0u);
+      } else if (n == 0xE) {
+        s.sp = (s.sp + 15u) % 16u;
+        s.pc = s.stack[s.sp];
+      }
+      break;
+    case 0x1:
+      s.pc = nnn;
+      break;
+    case 0x2:
+      s.stack[s.sp] = s.pc;
+      s.sp = (s.sp + 1u) % 16u;
+      s.pc = nnn;
+      break;
+    case 0x3:
+      if (v[x] == kk) s.pc += 2;
+      break;
+    case 0x4:
+      if (v[x] != kk) s.pc += 2;
+      break;
+    case 0x5:
+      if (v[x] == v[y]) s.pc += 2;
+      break;
+    case 0x6:
+      v[x] = kk;
+      break;
+    case 0x7:
+      v[x] = (v[x] + kk) % 256u;
+      break;
+    case 0x8: {
+      // VF is written before the result and the operands are read again
+      // afterwards, like the core does, so x or y being F matters
+      const unsigned a = v[x];
+      const unsigned b = v[y];
+      switch (n) {
+        case 0x0: v[x] = b; break;
+        case 0x1: v[x] = a | b; break;
+        case 0x2: v[x] = a & b; break;
+        case 0x3: v[x] = a ^ b; break;
+        case 0x4:
+          v[0xF] = (a + b > 255u) ? 1 : 0;
+          v[x] = (a + b) % 256u;
+          break;
+        case 0x5:
+          v[0xF] = (a > b) ? 1 : 0;
+          v[x] = (v[x] + 256u - v[y]) % 256u;
+          break;
+        case 0x6:
+          v[0xF] = a % 2u;
+          v[x] = v[x] / 2u;
+          break;
+        case 0x7:
+          v[0xF] = (b > a) ? 1 : 0;
+          v[x] = (v[y] + 256u - v[x]) % 256u;
+          break;
+        case 0xE:
+          v[0xF] = a / 128u;
+          v[x] = (v[x] * 2u) % 256u;
+          break;
+      }
+      break;
+    }
+    case 0x9:
+      if (v[x] != v[y]) s.pc += 2;
+      break;
+    case 0xA:
+      s.index = nnn;
+      break;
+    case 0xB:
+      s.pc = v[0] + nnn;
+      break;
+    case 0xC: {
+      Rng rng;
+      rng.set_state(s.rng);
+      v[x] = rng.NextByte() & kk;
+      s.rng = rng.get_state();
+      break;
+    }
+    case 0xD: {
+      const unsigned px = v[x] % kFrameWidth;
+      const unsigned py = v[y] % kFrameHeight;
+      bool collision = false;
+      for (unsigned row = 0; row < n; ++row) {
+        const unsigned sprite = Mem(s, s.index + row);
+        for (unsigned col = 0; col < 8; ++col) {
+          if ((sprite & (0x80u >> col)) == 0u) {
+            continue;
+          }
+          const unsigned sx = (px + col) % kFrameWidth;
+          const unsigned sy = (py + row) % kFrameHeight;
+          if (Pixel(s, sx, sy)) {
+            collision = true;
+          }
+          FlipPixel(s, sx, sy);
+        }
+      }
+      v[0xF] = collision ? 1 : 0;
+      break;
+    }
+    case 0xE:
+      if (n == 0xE && s.keypad[v[x] % 16u]) s.pc += 2;
+      if (n == 0x1 && !s.keypad[v[x] % 16u]) s.pc += 2;
+      break;
+    case 0xF:
+      switch (kk) {
+        case 0x07:
+          v[x] = s.delay_timer;
+          break;
+        case 0x0A: {
+          unsigned key = 0;
+          while (key < 16 && !s.keypad[key]) {
+            ++key;
+          }
+          if (key < 16) {
+            v[x] = static_cast<uint8_t>(key);
+          } else {
+            s.pc -= 2;
+          }
+          break;
+        }
+        case 0x15:
+          s.delay_timer = v[x];
+          break;
+        case 0x18:
+          s.sound_timer = v[x];
+          break;
+        case 0x1E:
+          s.index += v[x];
+          break;
+        case 0x29:
+          s.index = kFontSetAddr + 5u * v[x];
+          break;
+        case 0x33: {
+          const unsigned value = v[x];
+          Mem(s, s.index) = value / 100u;
+          Mem(s, s.index + 1u) = (value / 10u) % 10u;
+          Mem(s, s.index + 2u) = value % 10u;
+          break;
+        }
+        case 0x55:
+          for (unsigned i = 0; i <= x; ++i) {
+            Mem(s, s.index + i) = v[i];
+          }
+          break;
+        case 0x65:
+          for (unsigned i = 0; i <= x; ++i) {
+            v[i] = Mem(s, s.index + i);
+          }
+          break;
+      }
+      break;
+  }
+
+  if (++s.tick_phase < cycles_per_tick) {
+    return;
+  }
+  s.tick_phase = 0;
+  if (s.delay_timer > 0) {
+    --s.delay_timer;
+  }
+  if (s.sound_timer > 0) {
+    --s.sound_timer;
+  }
+}
+
+std::string Diff(const Chip8::Snapshot& a, const Chip8::Snapshot& b) {
+  for (unsigned i = 0; i < 16; ++i) {
+    if (a.registers[i] != b.registers[i]) {
+      return "V" + std::string(1, "0123456789ABCDEF"[i]);
+    }
+  }
+  if (a.pc != b.pc) return "pc";
+  if (a.index != b.index) return "I";
+  if (a.sp != b.sp) return "sp";
+  if (a.stack != b.stack) return "stack";
+  if (a.delay_timer != b.delay_timer) return "delay timer";
+  if (a.sound_timer != b.sound_timer) return "sound timer";
+  if (a.tick_phase != b.tick_phase) return "tick phase";
+  if (a.keypad != b.keypad) return "keypad";
+  if (a.video != b.video) return "video";
+  // the whole generator state, PCG32 has a stream increment besides s
+  if (std::memcmp(&a.rng, &b.rng, sizeof(a.rng)) != 0) return "rng";
+  if (std::memcmp(a.memory.data(), b.memory.data(), a.memory.size()) == 0) {
+    return {};
+  }
+  for (size_t i = 0; i < a.memory.size(); ++i) {
+    if (a.memory[i] != b.memory[i]) {
+      char buffer[24];
+      std::snprintf(buffer, sizeof(buffer), "memory[0x%03zX]", i);
+      return buffer;
+    }
+  }
+  return {};
+}
+
+} // namespace reference
+
+} // namespace emu
@@ -0,0 +1,27 @@
+#ifndef EMU_TEST_REFERENCE_H_
+#define EMU_TEST_REFERENCE_H_
+
+#include <string>
+
+#include "chip8.h"
+
+namespace emu {
+
+// Reference interpreter for the differential tests. It is written to be
+// obviously correct rather than fast: one switch, pixel by pixel drawing,
+// and it works directly on a Chip8::Snapshot so the states of both cores
+// can be compared field by field.
+namespace reference {
+
+// execute one instruction, then tick the timers if it was the last one of
+// a tick (same as Chip8::Cycle)
+void Step(Chip8::Snapshot& s, uint32_t cycles_per_tick = 1) noexcept;
+
+// name of the first field that differs, empty if the states are equal
+std::string Diff(const Chip8::Snapshot& a, const Chip8::Snapshot& b);
+
+} // namespace reference
+
+} // namespace emu
+
+#endif // EMU_TEST_REFERENCE_H_
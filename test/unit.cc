@@ -0,0 +1,427 @@
+// Unit checks for the pieces the conformance and netplay runs don't reach:
+// the output of each display filter and the phosphor decay, the capture
+// file formats, the debugger protocol on a socket and on the console, the
+// frame pacer's deadline math and hot reloads of a session's ROM files.
+//
+//   unit
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "debugger.h"
+#include "filter.h"
+#include "pacer.h"
+#include "session.h"
+
+namespace {
+
+int failures = 0;
+
+void Check(bool ok, const char* what) {
+  if (!ok) {
+    std::printf("FAILED: %s\n", what);
+    ++failures;
+  }
+}
+
+struct Image {
+  int width;
+  std::vector<uint32_t> pixels;
+
+  uint32_t At(int x, int y) const { return pixels[y * width + x]; }
+};
+
+Image Render(const emu::Filter::Config& config, const emu::Frame& frame) {
+  emu::Filter filter{config};
+  Image image{filter.get_width(),
+      std::vector<uint32_t>(filter.get_width() * filter.get_height())};
+  filter.Apply(frame, reinterpret_cast<uint8_t*>(image.pixels.data()),
+      image.width * static_cast<int>(sizeof(uint32_t)));
+  return image;
+}
+
+void SetPixel(emu::Frame& frame, int x, int y) {
+  frame[y] |= uint64_t{1} << (emu::kFrameWidth - 1 - x);
+}
+
+// the pixel at (x, y) of a frame upscaled by scale: EPX first for an even
+// scale, nearest for the rest, edges repeat the border pixel
+bool Epx(const emu::Frame& frame, int x, int y, int scale) {
+  if (scale % 2 != 0) {
+    return emu::GetPixel(frame, static_cast<uint16_t>(x / scale),
+        static_cast<uint16_t>(y / scale));
+  }
+  const int half = scale / 2;
+  const int sx = x / half / 2;
+  const int sy = y / half / 2;
+  const bool right = (x / half) % 2 != 0;
+  const bool lower = (y / half) % 2 != 0;
+  auto at = [&](int px, int py) {
+    px = std::clamp(px, 0, emu::kFrameWidth - 1);
+    py = std::clamp(py, 0, emu::kFrameHeight - 1);
+    return emu::GetPixel(frame, static_cast<uint16_t>(px), static_cast<uint16_t>(py));
+  };
+  const bool b = at(sx, sy - 1);
+  const bool d = at(sx - 1, sy);
+  const bool e = at(sx, sy);
+  const bool f = at(sx + 1, sy);
+  const bool h = at(sx, sy + 1);
+  if (b == h || d == f) {
+    return e;
+  }
+  const bool side = right ? f : d;
+  const bool edge = lower ? h : b;
+  return side == edge ? side : e;
+}
+
+void Filters() {
+  emu::Filter::Config config{};
+  const uint32_t on = config.on;
+  const uint32_t off = config.off;
+
+  emu::Frame frame{};
+  SetPixel(frame, 0, 0);
+  SetPixel(frame, 63, 31);
+
+  config.upscale = emu::Filter::Upscale::kNearest;
+  config.scale = 3;
+  Image nearest = Render(config, frame);
+  Check(nearest.width == 192 && nearest.pixels.size() == 192u * 96u, "nearest size");
+  Check(nearest.At(0, 0) == on && nearest.At(2, 2) == on, "nearest fills the block");
+  Check(nearest.At(3, 0) == off && nearest.At(0, 3) == off, "nearest stops at the block");
+  Check(nearest.At(189, 93) == on && nearest.At(191, 95) == on, "nearest last block");
+  Check(nearest.At(188, 95) == off, "nearest left of the last block");
+
+  // a corner: left of and above (5, 5) lit, the rest dark; scale2x lights
+  // only the top left quarter of (5, 5) and keeps the lit pixels whole
+  frame = emu::Frame{};
+  SetPixel(frame, 4, 5);
+  SetPixel(frame, 5, 4);
+  config.upscale = emu::Filter::Upscale::kScale2x;
+  config.scale = 4;
+  Image epx = Render(config, frame);
+  Check(epx.width == 256 && epx.pixels.size() == 256u * 128u, "scale2x size");
+  Check(epx.At(20, 20) == on && epx.At(21, 21) == on, "scale2x fills the corner");
+  Check(epx.At(22, 20) == off && epx.At(20, 22) == off && epx.At(22, 22) == off,
+      "scale2x leaves the rest of the pixel");
+  Check(epx.At(16, 20) == on && epx.At(19, 23) == on, "scale2x keeps the left pixel");
+  Check(epx.At(20, 16) == on && epx.At(23, 19) == on, "scale2x keeps the top pixel");
+  Check(epx.At(24, 24) == off, "scale2x below right");
+
+  // the vector upscalers against a pixel by pixel reading of a noisy frame,
+  // odd scales leave a partial store at the end of each row
+  uint64_t seed = 0x9E3779B97F4A7C15ull;
+  for (auto& row : frame) {
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    row = seed;
+  }
+  for (int scale : {2, 3, 5, 6}) {
+    config.upscale = (scale % 2 == 0) ? emu::Filter::Upscale::kScale2x
+        : emu::Filter::Upscale::kNearest;
+    config.scale = scale;
+    Image image = Render(config, frame);
+    bool same = true;
+    for (int y = 0; y < emu::kFrameHeight * scale; ++y) {
+      for (int x = 0; x < emu::kFrameWidth * scale; ++x) {
+        same = same && image.At(x, y) == (Epx(frame, x, y, scale) ? on : off);
+      }
+    }
+    Check(same, scale % 2 == 0 ? "scale2x matches EPX" : "nearest matches the frame");
+  }
+}
+
+void Phosphor() {
+  emu::Filter::Config config{};
+  config.phosphor = true;
+  emu::Filter filter{config};
+  uint32_t pixels[emu::kFrameWidth * emu::kFrameHeight];
+  const int pitch = emu::kFrameWidth * static_cast<int>(sizeof(uint32_t));
+
+  emu::Frame frame{};
+  SetPixel(frame, 9, 3);
+  const uint32_t* pixel = &pixels[3 * emu::kFrameWidth + 9];
+  filter.Apply(frame, reinterpret_cast<uint8_t*>(pixels), pitch);
+  Check(*pixel == config.on, "phosphor lit at full");
+
+  // 255 * 160 / 256 = 159, then 159 * 160 / 256 = 99, alpha stays opaque
+  frame = emu::Frame{};
+  filter.Apply(frame, reinterpret_cast<uint8_t*>(pixels), pitch);
+  Check(*pixel == 0x9F9F9FFFu, "phosphor decays a frame");
+  filter.Apply(frame, reinterpret_cast<uint8_t*>(pixels), pitch);
+  Check(*pixel == 0x636363FFu, "phosphor decays again");
+  for (int i = 0; i < 16; ++i) {
+    filter.Apply(frame, reinterpret_cast<uint8_t*>(pixels), pitch);
+  }
+  Check(*pixel == config.off, "phosphor fades out");
+
+  SetPixel(frame, 9, 3);
+  filter.Apply(frame, reinterpret_cast<uint8_t*>(pixels), pitch);
+  Check(*pixel == config.on, "phosphor relit at full");
+  Check(pixels[3 * emu::kFrameWidth + 10] == config.off, "phosphor leaves its neighbour");
+
+  config.phosphor = false;
+  emu::Filter plain{config};
+  plain.Apply(frame, reinterpret_cast<uint8_t*>(pixels), pitch);
+  frame = emu::Frame{};
+  plain.Apply(frame, reinterpret_cast<uint8_t*>(pixels), pitch);
+  Check(*pixel == config.off, "no phosphor, off at once");
+}
+
+std::vector<uint8_t> ReadFile(const std::string& file) {
+  std::ifstream in{file, std::ios::binary};
+  return {std::istreambuf_iterator<char>(in), {}};
+}
+
+bool Contains(const std::vector<uint8_t>& data, const char* text) {
+  const std::string needle{text};
+  return std::search(data.begin(), data.end(), needle.begin(), needle.end()) != data.end();
+}
+
+void Captures() {
+  const std::string base = "/tmp/chip8-unit-" + std::to_string(getpid());
+
+  // raw: a repeat count of 3 and a row, both big endian
+  emu::Frame frame{};
+  frame[0] = 0x0123456789ABCDEFull;
+  emu::Capture raw;
+  if (raw.Open(base + ".raw", emu::Capture::Format::kRaw) == 0) {
+    for (int i = 0; i < 3; ++i) {
+      raw.Push(frame);
+    }
+    raw.Close();
+  }
+  const std::vector<uint8_t> record = ReadFile(base + ".raw");
+  Check(record.size() == 4 + 32 * 8, "raw record size");
+  Check(record.size() >= 12 && record[0] == 0 && record[1] == 0 && record[2] == 0
+      && record[3] == 3, "raw repeat count big endian");
+  Check(record.size() >= 12 && record[4] == 0x01 && record[11] == 0xEF, "raw row big endian");
+
+  // an APNG closed before any frame still needs one to be a valid PNG
+  emu::Capture apng;
+  if (apng.Open(base + ".png", emu::Capture::Format::kApng) == 0) {
+    apng.Close();
+  }
+  const std::vector<uint8_t> png = ReadFile(base + ".png");
+  const auto actl = std::search(png.begin(), png.end(), "acTL", "acTL" + 4);
+  Check(Contains(png, "IDAT") && Contains(png, "IEND"), "empty APNG has an image");
+  Check(actl + 8 <= png.end() && actl[4] == 0 && actl[5] == 0 && actl[6] == 0 && actl[7] == 1,
+      "empty APNG has one frame");
+  std::remove((base + ".raw").c_str());
+  std::remove((base + ".png").c_str());
+}
+
+// sends one line to the debugger, lets it poll and returns what it answered
+std::string Command(int client, emu::Debugger& debugger, const std::string& line) {
+  const std::string text = line + "\n";
+  if (send(client, text.data(), text.size(), MSG_NOSIGNAL)
+      != static_cast<ssize_t>(text.size())) {
+    return "send failed";
+  }
+  debugger.Update(0);
+  std::string reply;
+  pollfd pfd{client, POLLIN, 0};
+  char buffer[512];
+  while (poll(&pfd, 1, 0) > 0) {
+    const ssize_t n = read(client, buffer, sizeof(buffer));
+    if (n <= 0) {
+      break;
+    }
+    reply.append(buffer, static_cast<size_t>(n));
+  }
+  return reply;
+}
+
+bool StartsWith(const std::string& text, const std::string& prefix) {
+  return text.rfind(prefix, 0) == 0;
+}
+
+void DebuggerProtocol() {
+  emu::Chip8 chip8{};
+  // 6105 7101 1202: v1 = 5, then count it up forever
+  const uint8_t rom[] = {0x61, 0x05, 0x71, 0x01, 0x12, 0x02};
+  chip8.LoadRom(rom, sizeof(rom));
+  emu::Debugger debugger{chip8};
+  const std::string path = "/tmp/chip8-unit-" + std::to_string(getpid()) + ".sock";
+  if (debugger.Open(path) != 0) {
+    Check(false, "debugger listens");
+    return;
+  }
+
+  const int client = socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  path.copy(addr.sun_path, path.size());
+  if (connect(client, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+    Check(false, "debugger accepts");
+    close(client);
+    return;
+  }
+  Check(StartsWith(Command(client, debugger, ""), "stop: attach"), "debugger attach");
+
+  // blank and malformed lines get an error or nothing, never a crash
+  Check(Command(client, debugger, " ").empty(), "blank line");
+  Check(Command(client, debugger, " \t \r").empty(), "blank line with tab and cr");
+  Check(StartsWith(Command(client, debugger, "b"), "error: unknown command"), "b without address");
+  Check(StartsWith(Command(client, debugger, "b zz"), "error:"), "b with a bad address");
+  Check(StartsWith(Command(client, debugger, "b 10000"), "error:"), "b out of range");
+  Check(StartsWith(Command(client, debugger, "w v"), "error: usage"), "w without register");
+  Check(StartsWith(Command(client, debugger, "w mem 1 2"), "error: usage"), "w too many args");
+  Check(StartsWith(Command(client, debugger, "x"), "error: unknown command"), "x without address");
+  Check(StartsWith(Command(client, debugger, "frobnicate 1 2"), "error: unknown command"),
+      "unknown command");
+
+  // and the machine is still there to debug
+  Check(Command(client, debugger, "  b 204  ") == "ok\n", "b with blanks around");
+  Check(Command(client, debugger, "l") == "b 204\nok\n", "list breakpoints");
+  Check(Command(client, debugger, "x 200 2") == "200: 61 05\nok\n", "dump memory");
+  Check(Command(client, debugger, "c") == "ok\n", "continue");
+  debugger.Update(10);
+  const std::string stop = Command(client, debugger, "r");
+  Check(debugger.IsPaused() && StartsWith(stop, "stop: breakpoint 204\npc=204")
+      && stop.find("v1=06") != std::string::npos, "stop at the breakpoint");
+  close(client);
+}
+
+// the console debugger on a pipe: it starts paused, and once the pipe
+// closes nothing could resume it, so it detaches after running what was sent
+void DebuggerConsole() {
+  emu::Chip8 chip8{};
+  const uint8_t rom[] = {0x61, 0x05, 0x71, 0x01, 0x12, 0x02};
+  chip8.LoadRom(rom, sizeof(rom));
+  int pipe_fds[2];
+  const int saved_in = dup(STDIN_FILENO);
+  const int saved_out = dup(STDOUT_FILENO);
+  const int null_fd = open("/dev/null", O_WRONLY);
+  if (pipe(pipe_fds) != 0 || saved_in < 0 || saved_out < 0 || null_fd < 0) {
+    Check(false, "console pipe");
+    return;
+  }
+  dup2(pipe_fds[0], STDIN_FILENO);
+  dup2(null_fd, STDOUT_FILENO);
+  close(pipe_fds[0]);
+  close(null_fd);
+
+  {
+    emu::Debugger debugger{chip8};
+    if (debugger.Open("-") == 0) {
+      const char commands[] = "b 204\nw v 1\n";
+      const bool sent = write(pipe_fds[1], commands, sizeof(commands) - 1)
+          == static_cast<ssize_t>(sizeof(commands) - 1);
+      close(pipe_fds[1]);
+      debugger.Update(100);
+      Check(sent && !debugger.IsPaused(), "console closed, running");
+      Check(chip8.get_counters().instructions == 100,
+          "console closed, no breakpoint or watch left");
+    } else {
+      close(pipe_fds[1]);
+      Check(false, "console opens");
+    }
+  }
+  std::fflush(stdout);
+  dup2(saved_in, STDIN_FILENO);
+  dup2(saved_out, STDOUT_FILENO);
+  close(saved_in);
+  close(saved_out);
+}
+
+void Pacing() {
+  constexpr int64_t kSecond = 1000000000;
+
+  emu::Pacer pacer{60.0};
+  pacer.Start();
+  const int64_t epoch = pacer.Deadline(0);
+  Check(pacer.get_period() == 16666666u, "60 Hz period");
+  Check(pacer.Deadline(60) - epoch == kSecond, "60 frames at 60 Hz are 1 s");
+  Check(pacer.Deadline(60000) - epoch == 1000 * kSecond, "60000 frames at 60 Hz are 1000 s");
+  // a day of frames, no drift and no overflow
+  Check(pacer.Deadline(60ull * 86400) - epoch == 86400 * kSecond, "a day at 60 Hz");
+  bool even = true;
+  for (uint64_t frame = 0; frame < 600; ++frame) {
+    const int64_t step = pacer.Deadline(frame + 1) - pacer.Deadline(frame);
+    even = even && (step == 16666666 || step == 16666667);
+  }
+  Check(even, "60 Hz deadlines a period apart");
+
+  emu::Pacer ntsc{59.94};
+  ntsc.Start();
+  Check(ntsc.Deadline(59940) - ntsc.Deadline(0) == 1000 * kSecond,
+      "59940 frames at 59.94 Hz are 1000 s");
+
+  // a stall of several periods: the deadlines are given up on, and the
+  // jitter says how late the frame was
+  emu::Pacer stalled{1000.0};
+  stalled.Start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  stalled.Wait();
+  Check(stalled.get_missed() >= 3, "stall misses deadlines");
+  Check(stalled.get_jitter() >= 3000000u, "stall shows in the jitter");
+}
+
+void WriteFile(const std::string& file, const std::vector<uint8_t>& data) {
+  std::ofstream out{file, std::ios::binary | std::ios::trunc};
+  out.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+}
+
+void HotReload() {
+  const std::string file = "/tmp/chip8-unit-" + std::to_string(getpid()) + ".ch8";
+  // 6105 7101 1202, as in DebuggerProtocol()
+  std::vector<uint8_t> rom = {0x61, 0x05, 0x71, 0x01, 0x12, 0x02};
+  WriteFile(file, rom);
+
+  emu::Session session;
+  const size_t slot = session.Add(file, 1);
+  const auto& memory = session.get_slot(slot).chip8->get_memory();
+  const size_t entry = emu::Chip8::kEntryPointAddr;
+
+  rom[1] = 0x09;
+  WriteFile(file, rom);
+  Check(session.Reload(slot) == 1 && memory[entry + 1] == 0x09, "reload patches the change");
+
+  // a save caught between its truncate and its write
+  WriteFile(file, {});
+  bool thrown = false;
+  try {
+    session.Reload(slot);
+  } catch (std::exception& e) {
+    thrown = true;
+  }
+  Check(thrown && memory[entry] == 0x61 && memory[entry + 5] == 0x02,
+      "an empty file patches nothing");
+
+  // and the save completes: diffed against the last version loaded
+  rom[3] = 0x02;
+  WriteFile(file, rom);
+  Check(session.Reload(slot) == 1 && memory[entry + 3] == 0x02, "reload after the empty file");
+  std::remove(file.c_str());
+}
+
+} // namespace
+
+int main() {
+  Filters();
+  Phosphor();
+  Captures();
+  DebuggerProtocol();
+  DebuggerConsole();
+  Pacing();
+  HotReload();
+  if (failures != 0) {
+    std::printf("%d checks failed\n", failures);
+    return 1;
+  }
+  std::printf("all checks passed\n");
+  return 0;
+}
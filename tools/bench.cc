@@ -0,0 +1,138 @@
+// Multi-instance throughput, the load of the RL environment and the farm:
+// many machines resident at once, stepped a slice at a time in turn, so
+// every switch lands on state that has left L1. Run() keeps its state in
+// locals, Cycle() goes through the members on every instruction; both are
+// timed, and Run() again with a debug log record per slice for the cost of
+// logging on the hot path. Under perf stat (make bench) it shows the cache
+// misses and IPC.
+//
+//   bench [--instances=N] [--slice=N] [--cycles=N] ROM...
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "chip8.h"
+#include "log.h"
+
+namespace {
+
+constexpr uint64_t kKeyPeriod = 40000; // instructions per machine between keys
+
+using Machines = std::vector<std::unique_ptr<emu::Chip8>>;
+
+Machines Boot(const std::vector<std::vector<uint8_t>>& images, size_t instances) {
+  Machines machines;
+  for (size_t i = 0; i < instances; ++i) {
+    const auto& image = images[i % images.size()];
+    machines.emplace_back(new emu::Chip8{emu::kFrameWidth, emu::kFrameHeight, i});
+    machines.back()->LoadRom(image.data(), image.size());
+  }
+  return machines;
+}
+
+enum class Mode {
+  kRun,
+  kCycle,
+  kLogged, // Run() and a debug record per slice
+};
+
+// instructions per second over all machines
+double Measure(Machines& machines, uint32_t slice, uint64_t cycles, Mode mode) {
+  const uint64_t rounds = cycles / slice / machines.size();
+  const auto start = std::chrono::steady_clock::now();
+  for (uint64_t round = 0; round < rounds; ++round) {
+    const uint64_t done = round * slice;
+    for (auto& chip8 : machines) {
+      if (done % kKeyPeriod < slice) {
+        auto& keypad = chip8->get_keypad();
+        keypad.fill(0);
+        keypad[(done / kKeyPeriod) % keypad.size()] = 1;
+      }
+      if (mode == Mode::kCycle) {
+        for (uint32_t n = 0; n < slice; ++n) {
+          chip8->Cycle();
+        }
+      } else {
+        chip8->Run(slice);
+      }
+      if (mode == Mode::kLogged) {
+        EMU_LOG(kDebug, "slice done at pc " + std::to_string(chip8->get_pc()));
+      }
+    }
+  }
+  const double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+  return rounds * slice * machines.size() / seconds;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  const std::string usage = "Usage: " + std::string(argv[0])
+      + " [--instances=N] [--slice=N] [--cycles=N] ROM...";
+  size_t instances = 512;
+  uint32_t slice = 64;
+  uint64_t cycles = 200000000;
+  std::vector<std::string> roms;
+  try {
+    for (int i = 1; i < argc; ++i) {
+      const std::string arg = argv[i];
+      if (arg.rfind("--instances=", 0) == 0) {
+        instances = std::stoul(arg.substr(12));
+      } else if (arg.rfind("--slice=", 0) == 0) {
+        slice = static_cast<uint32_t>(std::stoul(arg.substr(8)));
+      } else if (arg.rfind("--cycles=", 0) == 0) {
+        cycles = std::stoull(arg.substr(9));
+      } else if (arg.rfind("--", 0) == 0) {
+        throw std::invalid_argument(arg);
+      } else {
+        roms.push_back(arg);
+      }
+    }
+  } catch (std::exception& e) {
+    emu::log::Error(usage);
+    return 1;
+  }
+  if (roms.empty() || instances == 0 || slice == 0) {
+    emu::log::Error(usage);
+    return 1;
+  }
+
+  std::vector<std::vector<uint8_t>> images;
+  try {
+    for (const auto& rom : roms) {
+      // LoadRom() does the reading and the size check
+      std::unique_ptr<emu::Chip8> chip8{new emu::Chip8{}};
+      chip8->LoadRom(rom);
+      const auto& memory = chip8->get_memory();
+      images.emplace_back(memory.begin() + emu::Chip8::kEntryPointAddr, memory.end());
+    }
+  } catch (std::exception& e) {
+    emu::log::Error(e.what());
+    return 1;
+  }
+
+  std::printf("%zu machines of %zu bytes, %u instructions per slice\n",
+      instances, sizeof(emu::Chip8), slice);
+  Machines run = Boot(images, instances);
+  const double run_rate = Measure(run, slice, cycles, Mode::kRun);
+  std::printf("Run():   %8.1f M instructions/s\n", run_rate / 1e6);
+  Machines step = Boot(images, instances);
+  std::printf("Cycle(): %8.1f M instructions/s\n", Measure(step, slice, cycles / 4, Mode::kCycle) / 1e6);
+
+  // the cost of logging on the hot path: formatting plus the queue push,
+  // the console is off so the drainer isn't writing to a terminal
+  emu::log::Flush();
+  emu::log::SetConsole(false);
+  Machines logged = Boot(images, instances);
+  const double logged_rate = Measure(logged, slice, cycles, Mode::kLogged);
+  emu::log::SetConsole(true);
+  std::printf("Run() + EMU_LOG(kDebug) per slice: %8.1f M instructions/s, %.0f%% of Run()%s\n",
+      logged_rate / 1e6, 100.0 * logged_rate / run_rate,
+      EMU_LOG_LEVEL > 0 ? ", debug compiled out" : "");
+  return 0;
+}
@@ -0,0 +1,478 @@
+// Regression farm. Runs every job of a manifest headless on all cores and
+// checks the framebuffer after the last instruction against a golden hash.
+//
+//   farm MANIFEST [--jobs=N] [--junit=FILE] [--json=FILE]
+//
+// One job per line, paths are relative to the manifest, '#' starts a comment:
+//
+//   # rom              seed  cycles  input      hash
+//   ../roms/pong.ch8   1     200000  pong.keys  3b1f0c5d6e7a8b9c
+//
+// input is a key script or "-". hash is emu::HashFrame() in hex, "-" runs
+// the job and prints the hash to put there. A key script has one event per
+// line, "CYCLE KEY down|up" with KEY in hex, applied before instruction
+// number CYCLE.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "chip8.h"
+#include "log.h"
+
+namespace {
+
+struct KeyEvent {
+  uint64_t cycle;
+  uint8_t key;
+  bool down;
+};
+
+struct Job {
+  std::string rom_file;   // as written in the manifest
+  std::string input_file;
+  const std::vector<uint8_t>* rom;
+  const std::vector<KeyEvent>* input;
+  uint64_t seed;
+  uint64_t cycles;
+  bool check;             // false when the hash is "-"
+  uint64_t expected;
+  int line;
+};
+
+struct Result {
+  uint64_t hash;
+  double seconds;
+};
+
+// Work stealing over one deque per worker: the owner takes from the front,
+// an idle worker steals from the back of the others. Jobs are dealt longest
+// first, so whatever is left to steal near the end is short and the tail
+// stays small. Nothing is pushed once the workers run, so a worker that
+// finds every deque empty is done.
+class Scheduler {
+  public:
+    explicit Scheduler(size_t workers) : queues_(workers) {}
+
+    Scheduler(const Scheduler& rhs) = delete;
+    Scheduler(const Scheduler&& rhs) = delete;
+    Scheduler& operator=(const Scheduler& rhs) = delete;
+    Scheduler& operator=(const Scheduler&& rhs) = delete;
+
+    void Push(size_t worker, size_t job) {
+      queues_[worker].jobs.push_back(job);
+    }
+
+    [[nodiscard]] bool Next(size_t worker, size_t& job) {
+      if (Take(queues_[worker], job, true)) {
+        return true;
+      }
+      for (size_t i = 1; i < queues_.size(); ++i) {
+        if (Take(queues_[(worker + i) % queues_.size()], job, false)) {
+          steals_.fetch_add(1u, std::memory_order_relaxed);
+          return true;
+        }
+      }
+      return false;
+    }
+
+    [[nodiscard]] uint64_t get_steals() const noexcept {
+      return steals_.load(std::memory_order_relaxed);
+    }
+  private:
+    // own cache line each, workers mostly touch their own
+    struct alignas(64) Queue {
+      std::mutex mutex;
+      std::deque<size_t> jobs;
+    };
+
+    static bool Take(Queue& queue, size_t& job, bool front) {
+      std::lock_guard<std::mutex> lock{queue.mutex};
+      if (queue.jobs.empty()) {
+        return false;
+      }
+      if (front) {
+        job = queue.jobs.front();
+        queue.jobs.pop_front();
+      } else {
+        job = queue.jobs.back();
+        queue.jobs.pop_back();
+      }
+      return true;
+    }
+
+    std::vector<Queue> queues_;
+    std::atomic<uint64_t> steals_{};
+};
+
+std::string Directory(const std::string& file) {
+  const size_t slash = file.find_last_of('/');
+  return (slash == std::string::npos) ? std::string{} : file.substr(0, slash + 1);
+}
+
+std::string Resolve(const std::string& base, const std::string& file) {
+  return (file.empty() || file[0] == '/') ? file : base + file;
+}
+
+std::vector<uint8_t> ReadRom(const std::string& file) {
+  std::ifstream fs{file, std::ios::binary};
+  if (!fs.is_open()) {
+    throw std::runtime_error("can't open ROM file: " + file);
+  }
+  std::vector<uint8_t> rom{std::istreambuf_iterator<char>(fs), {}};
+  if (rom.size() > emu::Chip8::kMaxRomSize) {
+    throw std::runtime_error("ROM too large: " + file);
+  }
+  return rom;
+}
+
+std::vector<KeyEvent> ReadInput(const std::string& file) {
+  std::ifstream fs{file};
+  if (!fs.is_open()) {
+    throw std::runtime_error("can't open input script: " + file);
+  }
+  std::vector<KeyEvent> events;
+  std::string line;
+  for (int number = 1; std::getline(fs, line); ++number) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream ss{line};
+    std::string cycle, key, state;
+    if (!(ss >> cycle)) {
+      continue;
+    }
+    if (!(ss >> key >> state) || (state != "down" && state != "up")) {
+      throw std::runtime_error(file + ":" + std::to_string(number) + ": bad event");
+    }
+    const unsigned long value = std::stoul(key, nullptr, 16);
+    if (value > 0xFu) {
+      throw std::runtime_error(file + ":" + std::to_string(number) + ": bad key");
+    }
+    events.push_back({std::stoull(cycle), static_cast<uint8_t>(value), state == "down"});
+  }
+  // scripts may be written out of order, same cycle keeps file order
+  std::stable_sort(events.begin(), events.end(),
+      [](const KeyEvent& a, const KeyEvent& b) { return a.cycle < b.cycle; });
+  return events;
+}
+
+// ROMs and scripts are read once however many jobs use them, the maps keep
+// the addresses the jobs point to stable
+struct Manifest {
+  std::vector<Job> jobs;
+  std::map<std::string, std::vector<uint8_t>> roms;
+  std::map<std::string, std::vector<KeyEvent>> inputs;
+};
+
+void ReadManifest(const std::string& file, Manifest& manifest) {
+  static const std::vector<KeyEvent> kNoInput{};
+
+  std::ifstream fs{file};
+  if (!fs.is_open()) {
+    throw std::runtime_error("can't open manifest: " + file);
+  }
+  const std::string base = Directory(file);
+  std::string line;
+  for (int number = 1; std::getline(fs, line); ++number) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream ss{line};
+    std::string rom, seed, cycles, input, hash;
+    if (!(ss >> rom)) {
+      continue;
+    }
+    if (!(ss >> seed >> cycles >> input >> hash)) {
+      throw std::runtime_error(file + ":" + std::to_string(number) + ": expected 5 fields");
+    }
+
+    Job job{};
+    job.rom_file = rom;
+    job.input_file = input;
+    job.seed = std::stoull(seed, nullptr, 0);
+    job.cycles = std::stoull(cycles);
+    job.check = (hash != "-");
+    job.expected = job.check ? std::stoull(hash, nullptr, 16) : 0u;
+    job.line = number;
+
+    const std::string rom_path = Resolve(base, rom);
+    auto found = manifest.roms.find(rom_path);
+    if (found == manifest.roms.end()) {
+      found = manifest.roms.emplace(rom_path, ReadRom(rom_path)).first;
+    }
+    job.rom = &found->second;
+
+    if (input == "-") {
+      job.input = &kNoInput;
+    } else {
+      const std::string input_path = Resolve(base, input);
+      auto script = manifest.inputs.find(input_path);
+      if (script == manifest.inputs.end()) {
+        script = manifest.inputs.emplace(input_path, ReadInput(input_path)).first;
+      }
+      job.input = &script->second;
+    }
+    manifest.jobs.push_back(job);
+  }
+}
+
+void Execute(emu::Chip8& chip8, uint64_t cycles) noexcept {
+  while (cycles != 0) {
+    const uint32_t block = static_cast<uint32_t>(std::min<uint64_t>(cycles, UINT32_MAX));
+    chip8.Run(block);
+    cycles -= block;
+  }
+}
+
+// the machine is reused from the last job, Reset() only restores what that
+// job wrote
+void RunJob(emu::Chip8& chip8, const Job& job, Result& result) noexcept {
+  const auto start = std::chrono::steady_clock::now();
+  chip8.Reset(job.seed);
+  chip8.LoadRom(job.rom->data(), job.rom->size());
+
+  uint64_t done = 0;
+  for (const auto& event : *job.input) {
+    if (event.cycle >= job.cycles) {
+      break;
+    }
+    Execute(chip8, event.cycle - done);
+    done = event.cycle;
+    chip8.get_keypad()[event.key] = event.down ? 1u : 0u;
+  }
+  Execute(chip8, job.cycles - done);
+
+  result.hash = emu::HashFrame(chip8.get_video());
+  result.seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+std::string Hex(uint64_t value) {
+  char buffer[17];
+  std::snprintf(buffer, sizeof(buffer), "%016llx", static_cast<unsigned long long>(value));
+  return buffer;
+}
+
+std::string Describe(const Job& job) {
+  return job.rom_file + " seed=" + std::to_string(job.seed)
+      + " cycles=" + std::to_string(job.cycles) + " input=" + job.input_file;
+}
+
+std::string EscapeXml(const std::string& text) {
+  std::string out;
+  for (char c : text) {
+    switch (c) {
+      case '&': out += "&amp;"; break;
+      case '<': out += "&lt;"; break;
+      case '>': out += "&gt;"; break;
+      case '"': out += "&quot;"; break;
+      case '\'': out += "&apos;"; break;
+      default: out += c; break;
+    }
+  }
+  return out;
+}
+
+std::string EscapeJson(const std::string& text) {
+  std::string out;
+  for (char c : text) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (static_cast<unsigned char>(c) < 0x20u) {
+      char buffer[8];
+      std::snprintf(buffer, sizeof(buffer), "\\u%04x", static_cast<unsigned>(c));
+      out += buffer;
+    } else {
+      out += c;
+    }
+  }
+  return out;
+}
+
+bool WriteText(const std::string& file, const std::string& text) {
+  std::FILE* out = std::fopen(file.c_str(), "w");
+  if (out == nullptr) {
+    return false;
+  }
+  const bool ok = std::fwrite(text.data(), 1, text.size(), out) == text.size();
+  return (std::fclose(out) == 0) && ok;
+}
+
+std::string JUnit(const std::string& manifest, const std::vector<Job>& jobs,
+    const std::vector<Result>& results, size_t failed, size_t unchecked, double seconds) {
+  char buffer[256];
+  std::string out = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+  std::snprintf(buffer, sizeof(buffer),
+      "<testsuite name=\"farm\" tests=\"%zu\" failures=\"%zu\" skipped=\"%zu\" time=\"%.6f\">\n",
+      jobs.size(), failed, unchecked, seconds);
+  out += buffer;
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    const Job& job = jobs[i];
+    std::snprintf(buffer, sizeof(buffer), "\" time=\"%.6f\"", results[i].seconds);
+    out += "  <testcase classname=\"" + EscapeXml(manifest) + ":" + std::to_string(job.line)
+        + "\" name=\"" + EscapeXml(Describe(job)) + buffer;
+    if (!job.check) {
+      out += ">\n    <skipped message=\"no golden hash, got " + Hex(results[i].hash)
+          + "\"/>\n  </testcase>\n";
+    } else if (results[i].hash != job.expected) {
+      out += ">\n    <failure message=\"frame hash " + Hex(results[i].hash)
+          + ", expected " + Hex(job.expected) + "\"/>\n  </testcase>\n";
+    } else {
+      out += "/>\n";
+    }
+  }
+  out += "</testsuite>\n";
+  return out;
+}
+
+std::string Json(const std::string& manifest, const std::vector<Job>& jobs,
+    const std::vector<Result>& results, size_t workers, double seconds) {
+  char buffer[128];
+  std::snprintf(buffer, sizeof(buffer), "\",\"workers\":%zu,\"seconds\":%.6f,\"jobs\":[",
+      workers, seconds);
+  std::string out = "{\"manifest\":\"" + EscapeJson(manifest) + buffer;
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    const Job& job = jobs[i];
+    const char* status = !job.check ? "new"
+        : (results[i].hash == job.expected) ? "pass" : "fail";
+    std::snprintf(buffer, sizeof(buffer), ",\"status\":\"%s\",\"seconds\":%.6f}",
+        status, results[i].seconds);
+    out += (i == 0) ? "\n" : ",\n";
+    out += "{\"line\":" + std::to_string(job.line)
+        + ",\"rom\":\"" + EscapeJson(job.rom_file)
+        + "\",\"seed\":" + std::to_string(job.seed)
+        + ",\"cycles\":" + std::to_string(job.cycles)
+        + ",\"input\":\"" + EscapeJson(job.input_file)
+        + "\",\"expected\":\"" + (job.check ? Hex(job.expected) : "-")
+        + "\",\"hash\":\"" + Hex(results[i].hash) + "\"" + buffer;
+  }
+  out += "\n]}\n";
+  return out;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  const std::string usage = "Usage: " + std::string(argv[0])
+      + " MANIFEST [--jobs=N] [--junit=FILE] [--json=FILE]";
+  if (argc < 2) {
+    emu::log::Error(usage);
+    return 1;
+  }
+
+  const std::string manifest_file = argv[1];
+  size_t workers = std::max(1u, std::thread::hardware_concurrency());
+  std::string junit_file;
+  std::string json_file;
+  Manifest manifest{};
+  try {
+    for (int i = 2; i < argc; ++i) {
+      const std::string arg = argv[i];
+      if (arg.rfind("--jobs=", 0) == 0) {
+        workers = std::max<size_t>(1u, std::stoul(arg.substr(7)));
+      } else if (arg.rfind("--junit=", 0) == 0) {
+        junit_file = arg.substr(8);
+      } else if (arg.rfind("--json=", 0) == 0) {
+        json_file = arg.substr(7);
+      } else {
+        throw std::invalid_argument(arg);
+      }
+    }
+  } catch (std::exception& e) {
+    emu::log::Error(usage);
+    return 1;
+  }
+  try {
+    ReadManifest(manifest_file, manifest);
+  } catch (std::exception& e) {
+    emu::log::Error(e.what());
+    return 1;
+  }
+
+  const std::vector<Job>& jobs = manifest.jobs;
+  workers = std::min(workers, std::max<size_t>(jobs.size(), 1u));
+  std::vector<Result> results(jobs.size());
+
+  // deal longest first, round robin
+  std::vector<size_t> order(jobs.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(),
+      [&](size_t a, size_t b) { return jobs[a].cycles > jobs[b].cycles; });
+  Scheduler scheduler{workers};
+  for (size_t i = 0; i < order.size(); ++i) {
+    scheduler.Push(i % workers, order[i]);
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (size_t worker = 0; worker < workers; ++worker) {
+    threads.emplace_back([&, worker]() {
+      // one machine per worker for all its jobs
+      std::unique_ptr<emu::Chip8> chip8{new emu::Chip8{emu::kFrameWidth, emu::kFrameHeight}};
+      size_t job = 0;
+      while (scheduler.Next(worker, job)) {
+        RunJob(*chip8, jobs[job], results[job]);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  const double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+
+  size_t failed = 0;
+  size_t unchecked = 0;
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    const std::string where = manifest_file + ":" + std::to_string(jobs[i].line) + ": ";
+    if (!jobs[i].check) {
+      ++unchecked;
+      emu::log::Warning(where + Describe(jobs[i]) + " hash " + Hex(results[i].hash));
+    } else if (results[i].hash != jobs[i].expected) {
+      ++failed;
+      emu::log::Failure(where + Describe(jobs[i]) + " hash " + Hex(results[i].hash)
+          + ", expected " + Hex(jobs[i].expected));
+    }
+  }
+
+  if (!junit_file.empty()
+      && !WriteText(junit_file, JUnit(manifest_file, jobs, results, failed, unchecked, seconds))) {
+    emu::log::Error("can't write report: " + junit_file);
+    return 1;
+  }
+  if (!json_file.empty()
+      && !WriteText(json_file, Json(manifest_file, jobs, results, workers, seconds))) {
+    emu::log::Error("can't write report: " + json_file);
+    return 1;
+  }
+
+  uint64_t instructions = 0;
+  for (const auto& job : jobs) {
+    instructions += job.cycles;
+  }
+  char buffer[160];
+  std::snprintf(buffer, sizeof(buffer),
+      "%zu jobs, %zu failed, %zu unchecked in %.2f s on %zu workers"
+      " (%llu steals, %.1f M instructions/s)",
+      jobs.size(), failed, unchecked, seconds, workers,
+      static_cast<unsigned long long>(scheduler.get_steals()),
+      (seconds > 0.0) ? instructions / seconds / 1e6 : 0.0);
+  if (failed == 0) {
+    emu::log::Success(buffer);
+  } else {
+    emu::log::Failure(buffer);
+  }
+  return (failed == 0) ? 0 : 1;
+}
@@ -0,0 +1,224 @@
+// Superinstruction profile and report. Counts the most frequent straight
+// line instruction sequences the ROMs execute, which is what the fused
+// sequences in Chip8::Run() were picked from, then runs every ROM with and
+// without fusion and reports the dispatches it removed, apart from the
+// instructions of idle loops it skipped.
+//
+//   fusion [--cycles=N] [--top=N] ROM...
+//
+// Input is synthetic: one key held at a time, the next one every 40000
+// instructions, so games get past their title screens.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "chip8.h"
+#include "log.h"
+
+namespace {
+
+constexpr uint64_t kKeyPeriod = 40000;
+constexpr uint32_t kBlock = 1000; // instructions per Run(), about a frame
+
+// instruction class as written in the docs, e.g. 7xkk or 8xy4
+std::string Class(uint16_t op) {
+  char buffer[8];
+  switch (op >> 12u) {
+    case 0x0:
+      std::snprintf(buffer, sizeof(buffer), "%04X",
+          (op == 0x00E0u || op == 0x00EEu) ? op : 0x0000u);
+      return buffer;
+    case 0x1: return "1nnn";
+    case 0x2: return "2nnn";
+    case 0x3: return "3xkk";
+    case 0x4: return "4xkk";
+    case 0x5: return "5xy0";
+    case 0x6: return "6xkk";
+    case 0x7: return "7xkk";
+    case 0x8:
+      std::snprintf(buffer, sizeof(buffer), "8xy%X", op & 0xFu);
+      return buffer;
+    case 0x9: return "9xy0";
+    case 0xA: return "Annn";
+    case 0xB: return "Bnnn";
+    case 0xC: return "Cxkk";
+    case 0xD: return "Dxyn";
+    case 0xE:
+      std::snprintf(buffer, sizeof(buffer), "Ex%02X", op & 0xFFu);
+      return buffer;
+    default:
+      std::snprintf(buffer, sizeof(buffer), "Fx%02X", op & 0xFFu);
+      return buffer;
+  }
+}
+
+void Press(emu::Chip8& chip8, uint64_t instruction) {
+  auto& keypad = chip8.get_keypad();
+  keypad.fill(0);
+  keypad[(instruction / kKeyPeriod) % keypad.size()] = 1;
+}
+
+struct Profile {
+  uint64_t instructions{};
+  // sequences of 1, 2 and 3 instructions at consecutive addresses, a jump
+  // to itself counts as its own sequence
+  std::map<std::string, uint64_t> counts[3];
+};
+
+void Record(const std::vector<uint8_t>& rom, uint64_t cycles, Profile& profile) {
+  std::unique_ptr<emu::Chip8> chip8{new emu::Chip8{emu::kFrameWidth, emu::kFrameHeight}};
+  chip8->LoadRom(rom.data(), rom.size());
+
+  std::string last[2];
+  uint16_t last_pc[2] = {0xFFFFu, 0xFFFFu};
+  for (uint64_t n = 0; n < cycles; ++n) {
+    if (n % kKeyPeriod == 0) {
+      Press(*chip8, n);
+    }
+    const uint16_t pc = chip8->get_pc() & 0xFFFu;
+    const auto& memory = chip8->get_memory();
+    const uint16_t op = (memory[pc] << 8u) | memory[(pc + 1u) & 0xFFFu];
+    const std::string name = (op == (0x1000u | pc)) ? "1nnn (self)" : Class(op);
+
+    ++profile.counts[0][name];
+    if (last_pc[1] != 0xFFFFu && ((last_pc[1] + 2u) & 0xFFFu) == pc) {
+      ++profile.counts[1][last[1] + " " + name];
+      if (last_pc[0] != 0xFFFFu && ((last_pc[0] + 2u) & 0xFFFu) == last_pc[1]) {
+        ++profile.counts[2][last[0] + " " + last[1] + " " + name];
+      }
+    }
+    last[0] = last[1];
+    last_pc[0] = last_pc[1];
+    last[1] = name;
+    last_pc[1] = pc;
+    chip8->Cycle();
+  }
+  profile.instructions += cycles;
+}
+
+struct Measure {
+  uint64_t fused;
+  uint64_t idle;
+  double seconds;
+};
+
+Measure Time(const std::vector<uint8_t>& rom, uint64_t cycles, bool fusion) {
+  std::unique_ptr<emu::Chip8> chip8{new emu::Chip8{emu::kFrameWidth, emu::kFrameHeight}};
+  chip8->set_fusion(fusion);
+  chip8->LoadRom(rom.data(), rom.size());
+
+  const auto start = std::chrono::steady_clock::now();
+  for (uint64_t n = 0; n < cycles;) {
+    if (n % kKeyPeriod == 0) {
+      Press(*chip8, n);
+    }
+    // never across a key change
+    const uint64_t block = std::min<uint64_t>(
+        {kBlock, cycles - n, kKeyPeriod - n % kKeyPeriod});
+    chip8->Run(static_cast<uint32_t>(block));
+    n += block;
+  }
+  return {chip8->get_fused(), chip8->get_idle(), std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count()};
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  const std::string usage = "Usage: " + std::string(argv[0])
+      + " [--cycles=N] [--top=N] ROM...";
+  uint64_t cycles = 2000000;
+  size_t top = 12;
+  std::vector<std::string> roms;
+  try {
+    for (int i = 1; i < argc; ++i) {
+      const std::string arg = argv[i];
+      if (arg.rfind("--cycles=", 0) == 0) {
+        cycles = std::stoull(arg.substr(9));
+      } else if (arg.rfind("--top=", 0) == 0) {
+        top = std::stoul(arg.substr(6));
+      } else if (arg.rfind("--", 0) == 0) {
+        throw std::invalid_argument(arg);
+      } else {
+        roms.push_back(arg);
+      }
+    }
+  } catch (std::exception& e) {
+    emu::log::Error(usage);
+    return 1;
+  }
+  if (roms.empty()) {
+    emu::log::Error(usage);
+    return 1;
+  }
+
+  std::vector<std::vector<uint8_t>> images;
+  try {
+    for (const auto& rom : roms) {
+      // LoadRom() does the reading and the size check
+      std::unique_ptr<emu::Chip8> chip8{new emu::Chip8{}};
+      chip8->LoadRom(rom);
+      const auto& memory = chip8->get_memory();
+      images.emplace_back(memory.begin() + emu::Chip8::kEntryPointAddr, memory.end());
+    }
+  } catch (std::exception& e) {
+    emu::log::Error(e.what());
+    return 1;
+  }
+
+  Profile profile{};
+  for (const auto& image : images) {
+    Record(image, cycles, profile);
+  }
+  static const char* const kTitles[3] = {"instructions", "pairs", "triples"};
+  for (size_t length = 0; length < 3; ++length) {
+    std::vector<std::pair<uint64_t, std::string>> sorted;
+    for (const auto& [sequence, count] : profile.counts[length]) {
+      sorted.emplace_back(count, sequence);
+    }
+    std::sort(sorted.rbegin(), sorted.rend());
+    std::printf("most executed %s (share of all instructions)\n", kTitles[length]);
+    for (size_t i = 0; i < std::min(top, sorted.size()); ++i) {
+      std::printf("  %6.2f%%  %s\n",
+          100.0 * sorted[i].first / profile.instructions, sorted[i].second.c_str());
+    }
+    std::printf("\n");
+  }
+
+  // idle loops are skipped, not executed: they are reported on their own
+  // and left out of the share removed and of the fused rate
+  std::printf("%-24s %14s %14s %14s %8s %10s %10s\n",
+      "rom", "instructions", "idle skipped", "dispatches", "removed", "M/s plain", "M/s fused");
+  uint64_t total_fused = 0;
+  uint64_t total_idle = 0;
+  double plain_seconds = 0.0;
+  double fused_seconds = 0.0;
+  auto row = [](const std::string& name, uint64_t instructions, uint64_t idle, uint64_t fused,
+      double plain, double seconds) {
+    const uint64_t executed = instructions - idle;
+    std::printf("%-24s %14llu %14llu %14llu %7.2f%% %10.1f %10.1f\n", name.c_str(),
+        static_cast<unsigned long long>(instructions),
+        static_cast<unsigned long long>(idle),
+        static_cast<unsigned long long>(executed - fused),
+        executed != 0 ? 100.0 * fused / executed : 0.0,
+        instructions / plain / 1e6, executed / seconds / 1e6);
+  };
+  for (size_t i = 0; i < images.size(); ++i) {
+    const Measure plain = Time(images[i], cycles, false);
+    const Measure fused = Time(images[i], cycles, true);
+    total_fused += fused.fused;
+    total_idle += fused.idle;
+    plain_seconds += plain.seconds;
+    fused_seconds += fused.seconds;
+    row(roms[i].substr(roms[i].find_last_of('/') + 1), cycles, fused.idle, fused.fused,
+        plain.seconds, fused.seconds);
+  }
+  row("total", cycles * images.size(), total_idle, total_fused, plain_seconds, fused_seconds);
+  return 0;
+}
@@ -0,0 +1,101 @@
+// Terminal viewer for framebuffers published with --publish. Two pixel rows
+// are drawn per text line with half block characters.
+//
+//   shmview NAME [--instance=N] [--once]
+
+#include <chrono>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "shm.h"
+#include "log.h"
+
+namespace {
+
+void Draw(const emu::Frame& frame, uint64_t number, uint64_t skipped) {
+  static const char* const kCells[4] = {" ", "▀", "▄", "█"};
+
+  std::string out = "\033[H"; // cursor home, draw over the last frame
+  for (uint16_t y = 0; y < emu::kFrameHeight; y += 2) {
+    for (uint16_t x = 0; x < emu::kFrameWidth; ++x) {
+      unsigned cell = emu::GetPixel(frame, x, y)
+          | (emu::GetPixel(frame, x, static_cast<uint16_t>(y + 1)) << 1u);
+      out += kCells[cell];
+    }
+    out += '\n';
+  }
+  char buffer[64];
+  std::snprintf(buffer, sizeof(buffer), "frame %llu, skipped %llu\033[K\n",
+      static_cast<unsigned long long>(number),
+      static_cast<unsigned long long>(skipped));
+  out += buffer;
+  std::fwrite(out.data(), 1, out.size(), stdout);
+  std::fflush(stdout);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  const std::string usage = "Usage: " + std::string(argv[0])
+      + " NAME [--instance=N] [--once]";
+  if (argc < 2) {
+    emu::log::Error(usage);
+    return 1;
+  }
+
+  uint32_t instance = 0;
+  bool once = false;
+  try {
+    for (int i = 2; i < argc; ++i) {
+      const std::string arg = argv[i];
+      if (arg.rfind("--instance=", 0) == 0) {
+        instance = static_cast<uint32_t>(std::stoul(arg.substr(11)));
+      } else if (arg == "--once") {
+        once = true;
+      } else {
+        throw std::invalid_argument(arg);
+      }
+    }
+  } catch (std::exception& e) {
+    emu::log::Error(usage);
+    return 1;
+  }
+
+  emu::ShmReader reader;
+  if (reader.Open(argv[1]) != 0) {
+    return 1;
+  }
+  if (instance >= reader.get_instances()) {
+    emu::log::Error("instance " + std::to_string(instance) + " of "
+        + std::to_string(reader.get_instances()));
+    return 1;
+  }
+
+  if (!once) {
+    std::printf("\033[2J");
+  }
+  emu::Frame frame{};
+  uint64_t last = 0;
+  uint64_t skipped = 0;
+  bool first = true;
+  for (;;) {
+    // the publisher may be gone, keep showing the last frame
+    if (reader.get_number(instance) != last || first) {
+      uint64_t number = 0;
+      if (reader.Read(instance, frame, number)) {
+        if (!first && number > last + 1u) {
+          skipped += number - last - 1u;
+        }
+        last = number;
+        first = false;
+        Draw(frame, number, skipped);
+        if (once) {
+          return 0;
+        }
+      }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(4));
+  }
+}